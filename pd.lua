@@ -23,8 +23,11 @@ pd._classes = { } -- take absolute paths and turn them into classes
 pd._pathnames = { } -- look up absolute path by creation name
 pd._objects = { }
 pd._clocks = { }
-pd._receives = { }
+pd._receives = { } -- shared receive proxy => list of pd.Receive subscribers
+pd._receivenames = { } -- delivery mode => receive name => shared receive proxy
 pd._loadpath = ""
+pd._watching = false
+pd._watched = { } -- canonical script path => class, for hot reloading
 
 -- add a path to Lua's "require" search paths
 pd._setrequirepath = function(path)
@@ -50,15 +53,23 @@ pd._checkbase = function (name)
   return pd._pathnames[name] == true
 end
 
--- constructor dispatcher
+-- constructor dispatcher, also returns the class so that the C side can
+-- cache it and call pd._construct directly for the next object
 pd._constructor = function (name, atoms)
   local fullpath = pd._pathnames[name]
-  if nil ~= pd._classes[fullpath] then
-    local o = pd._classes[fullpath]:new():construct(name, atoms)
-    if o then
-      pd._objects[o._object] = o
-      return o._object
-    end
+  local class = pd._classes[fullpath]
+  if nil ~= class then
+    return pd._construct(class, name, atoms), class
+  end
+  return nil
+end
+
+-- constructor for an already resolved class
+pd._construct = function (class, name, atoms)
+  local o = class:new():construct(name, atoms)
+  if o then
+    pd._objects[o._object] = o
+    return o._object
   end
   return nil
 end
@@ -85,6 +96,66 @@ pd._clockdispatch = function (c)
   end
 end
 
+-- run the script of a class again, returns false and the error if it
+-- couldn't be compiled or failed while running; either way the class is
+-- left as it was
+local function reloadclass(class)
+  local chunk, dir = pd._loadfilex(class._class, class._scriptname)
+  if not chunk then
+    return false, dir
+  end
+  local saved = { }
+  for k, v in pairs(class) do
+    saved[k] = v
+  end
+  -- the script declares its typed methods from scratch
+  local declared = class._declared
+  class._declared = { }
+  pd._clearmethods(class._methods)
+  local namesave = pd._loadname
+  local pathsave = pd._loadpath
+  pd._loadname = nil
+  pd._loadpath = class._loadpath
+  pd._setrequirepath(dir)
+  local ok, err = pcall(chunk)
+  pd._clearrequirepath()
+  pd._loadname = namesave
+  pd._loadpath = pathsave
+  if not ok then
+    -- undo what the script did before it failed, keeping the old methods
+    -- and their declarations
+    for k in pairs(class) do
+      class[k] = nil
+    end
+    for k, v in pairs(saved) do
+      class[k] = v
+    end
+    pd._clearmethods(class._methods)
+    class._declared = { }
+    for _, d in ipairs(declared) do
+      class:method(d[1], d[2], d[3])
+    end
+  end
+  return ok, err
+end
+
+-- hot reload dispatcher, paths is a set of changed files
+pd._hotreload = function (paths)
+  for path in pairs(paths) do
+    local class = pd._watched[path]
+    if nil ~= class then
+      -- re-running the script redefines the methods in the existing class
+      -- table, so live objects keep their state and pick up the new code
+      local ok, err = reloadclass(class)
+      if ok then
+        pd.post("lua: reloaded " .. path)
+      else
+        pd.post("lua: error: reloading " .. path .. " failed:\n" .. tostring(err))
+      end
+    end
+  end
+end
+
 --whoami method dispatcher
 pd._whoami = function (object)
   if nil ~= pd._objects[object] then
@@ -109,6 +180,50 @@ function pd.Prototype:new(o)
   return o
 end
 
+-- compiled expressions
+-- source text => factory that returns a fresh closure over the body; the
+-- source is only parsed once, however many instances compile it
+local compiled = { }
+local ncompiled = 0
+
+-- compile src (the body of a vararg function) and bind it to a new
+-- environment holding a copy of the fields of env_template; returns the
+-- function and its environment, or nil and an error message
+function pd.compile(src, env_template)
+  local factory = compiled[src]
+  if nil == factory then
+    local chunk, err
+    if setfenv then -- Lua 5.1 / LuaJIT
+      chunk, err = loadstring("return function(...) " .. src .. "\nend", "=pd.compile")
+    else -- Lua 5.2+: the environment is the _ENV upvalue of the closure
+      chunk, err = load("local _ENV = ...\nreturn function(...) " .. src .. "\nend", "=pd.compile", "t")
+    end
+    if nil == chunk then
+      return nil, err
+    end
+    if ncompiled >= 1024 then -- don't grow without bound on live-coding
+      compiled = { }
+      ncompiled = 0
+    end
+    factory = chunk
+    compiled[src] = factory
+    ncompiled = ncompiled + 1
+  end
+  local env = { }
+  if nil ~= env_template then
+    for k, v in pairs(env_template) do
+      env[k] = v
+    end
+  end
+  local f
+  if setfenv then
+    f = setfenv(factory(), env)
+  else
+    f = factory(env)
+  end
+  return f, env
+end
+
 -- clocks
 pd.Clock = pd.Prototype:new()
 
@@ -155,13 +270,317 @@ function pd.Clock:unset()
   pd._clockunset(self._clock)
 end
 
+-- queues of timed messages
+-- A queue keeps messages with the time they are due at in C and sends them
+-- to an outlet when it comes, all with a single clock. With a method name
+-- instead of an outlet, the method is called with the selector and atoms.
+pd._queues = { }
+
+function pd._queuedispatch(q, sel, atoms)
+  local queue = pd._queues[q]
+  if nil ~= queue then
+    queue:dispatch(sel, atoms)
+  end
+end
+
+pd.Queue = pd.Prototype:new()
+
+function pd.Queue:register(object, target)
+  if nil ~= object then
+    if nil ~= object._object then
+      if type(target) == "number" then
+        self._queue = pd._queuenew(object._object, target)
+      else
+        self._queue = pd._queuenew(object._object, nil)
+        self._method = target
+      end
+      self._target = object
+      pd._queues[self._queue] = self
+      return self
+    end
+  end
+  return nil
+end
+
+function pd.Queue:destruct()
+  if nil ~= self._queue then
+    pd._queues[self._queue] = nil
+    pd._queuefree(self._queue)
+    self._queue = nil
+  end
+end
+
+function pd.Queue:dispatch(sel, atoms)
+  local m = self._target[self._method]
+  if type(m) == "function" then
+    return m(self._target, sel, atoms)
+  else
+    self._target:error("no method for `" .. tostring(self._method) .. "' at queue")
+  end
+end
+
+-- send the message in delaytime milliseconds, to the queue's outlet or the
+-- given one
+function pd.Queue:push(delaytime, sel, atoms, outlet)
+  pd._queuepush(self._queue, delaytime, sel, atoms or { }, outlet)
+end
+
+-- drop all waiting messages
+function pd.Queue:clear()
+  pd._queueclear(self._queue, false)
+end
+
+-- send all waiting messages right away
+function pd.Queue:flush()
+  pd._queueclear(self._queue, true)
+end
+
+function pd.Queue:size()
+  return pd._queuesize(self._queue)
+end
+
+-- tasks
+-- A task runs a function in a coroutine, which can pd.sleep() on Pd's
+-- logical time. Sleeping tasks are queued on the C side and all share a
+-- single clock. Coroutines of finished tasks are kept in a pool and reused.
+local EXIT = { } -- yielded by a pooled coroutine when its function returns
+local tasks = { } -- coroutine => task running in it
+local sleeping = { } -- wake up key => sleeping task
+local lastkey = 0
+local pool = { }
+
+local function cocreate(f)
+  local co = table.remove(pool)
+  if nil == co then
+    co = coroutine.create(function (...)
+      f(...)
+      while true do
+        f = nil
+        pool[#pool + 1] = co
+        f = coroutine.yield(EXIT)
+        f(coroutine.yield())
+      end
+    end)
+  else
+    coroutine.resume(co, f) -- hand it the new function, it waits for arguments
+  end
+  return co
+end
+
+pd.Task = pd.Prototype:new()
+
+local function taskdone(task)
+  if nil ~= task._co then
+    tasks[task._co] = nil
+    task._co = nil
+  end
+  if nil ~= task._owner and nil ~= task._owner._tasks then
+    task._owner._tasks[task] = nil
+  end
+end
+
+local function taskresume(task, ...)
+  local co = task._co
+  local ok, what = coroutine.resume(co, ...)
+  if not ok then
+    local msg = "lua: error in task:\n" .. tostring(what)
+    if debug and debug.traceback then
+      msg = debug.traceback(co, msg)
+    end
+    taskdone(task)
+    if nil ~= task._owner and not task._cancelled then
+      task._owner:error(msg)
+    else
+      pd.post(msg)
+    end
+  elseif what == EXIT or task._cancelled then
+    taskdone(task)
+  elseif nil == task._key and not task._queued then
+    -- yielded by something other than pd.sleep(), nothing will ever wake it
+    taskdone(task)
+    pd.post("lua: error: task yielded without pd.sleep() or pd.wait_until()")
+  end
+end
+
+-- run f(...) in a new task, until it finishes or sleeps
+function pd.spawn(f, ...)
+  return pd.Task:new():_start(nil, f, ...)
+end
+
+function pd.Task:_create(owner, f)
+  self._owner = owner
+  self._co = cocreate(f)
+  tasks[self._co] = self
+  if nil ~= owner then
+    owner._tasks = owner._tasks or { }
+    owner._tasks[self] = true
+  end
+  return self
+end
+
+function pd.Task:_start(owner, f, ...)
+  self:_create(owner, f)
+  taskresume(self, ...)
+  return self
+end
+
+-- stop a task, it won't wake up again
+function pd.Task:cancel()
+  self._cancelled = true
+  if nil ~= self._key then
+    sleeping[self._key] = nil
+    pd._unschedule(self._key)
+    self._key = nil
+  end
+  -- a task can't be dropped while it is running (or resuming another one),
+  -- it stops at its next pd.sleep() instead
+  if nil ~= self._co and coroutine.status(self._co) == "suspended" then
+    taskdone(self) -- the coroutine is dropped, not reused
+  end
+end
+
+function pd.Task:running()
+  return nil ~= self._co
+end
+
+-- sleep until Pd's logical time (as from pd.systime()) reaches systime;
+-- only callable from inside a task
+function pd.wait_until(systime)
+  local task = tasks[coroutine.running() or 0]
+  if nil == task then
+    error("pd.sleep() and pd.wait_until() can only be called from a task (see pd.spawn())", 2)
+  end
+  if not task._cancelled then
+    lastkey = lastkey + 1
+    task._key = lastkey
+    sleeping[lastkey] = task
+    pd._schedule(systime, lastkey)
+  end
+  coroutine.yield()
+end
+
+-- sleep for ms milliseconds of logical time
+function pd.sleep(ms)
+  pd.wait_until(pd.systime(ms))
+end
+
+-- wake up dispatcher
+pd._wake = function (key)
+  local task = sleeping[key]
+  if nil ~= task then
+    sleeping[key] = nil
+    task._key = nil
+    taskresume(task)
+  end
+end
+
+-- deferred work
+-- Tasks started with pd.defer() run in the following scheduler ticks, for at
+-- most pd.deferbudget() microseconds (real time) per tick. Long jobs call
+-- pd.yield() now and then, which suspends them until the next tick once the
+-- budget is used up, so the work is spread out instead of causing dropouts.
+local unpack = table.unpack or unpack
+local idlequeue = { } -- tasks waiting for their slice, first come first served
+local idlebudget = 1000
+local idledeadline = nil -- real time at which the current slice ends
+
+local function idlepush(task)
+  task._queued = true
+  idlequeue[#idlequeue + 1] = task
+  pd._idlewake()
+end
+
+function pd.Task:_defer(owner, f, ...)
+  self:_create(owner, f)
+  self._args = { n = select("#", ...), ... }
+  idlepush(self)
+  return self
+end
+
+-- run f(...) in a task, in the time budget of the next scheduler tick
+function pd.defer(f, ...)
+  return pd.Task:new():_defer(nil, f, ...)
+end
+
+-- get (or set, if us is given) the time budget for deferred work per tick,
+-- in microseconds, at least 1
+function pd.deferbudget(us)
+  if nil ~= us then
+    if type(us) ~= "number" then
+      error("pd.deferbudget() needs a number of microseconds", 2)
+    end
+    idlebudget = math.max(us, 1)
+  end
+  return idlebudget
+end
+
+-- suspend the current task until the next tick, if the budget is used up;
+-- tasks that aren't deferred work are moved to it
+function pd.yield()
+  local task = tasks[coroutine.running() or 0]
+  if nil == task then
+    error("pd.yield() can only be called from a task (see pd.defer())", 2)
+  end
+  if nil ~= idledeadline and pd._realtime() < idledeadline then
+    return
+  end
+  if not task._cancelled then
+    idlepush(task)
+  end
+  coroutine.yield()
+end
+
+-- deferred work dispatcher, returns true if there is work left
+pd._idle = function ()
+  local queue = idlequeue
+  local i = 1
+  local ran = false
+  idlequeue = { }
+  idledeadline = pd._realtime() + idlebudget * 1e-6
+  -- one task runs in every slice, however small the budget, so that
+  -- the work gets done at all
+  while i <= #queue and (not ran or pd._realtime() < idledeadline) do
+    local task = queue[i]
+    i = i + 1
+    task._queued = nil
+    if not task._cancelled and nil ~= task._co then
+      ran = true
+      local args = task._args
+      if nil ~= args then
+        task._args = nil
+        taskresume(task, unpack(args, 1, args.n))
+      else
+        taskresume(task)
+      end
+    end
+  end
+  idledeadline = nil
+  -- what's left runs before the work queued during this slice
+  if i <= #queue then
+    local rest = { }
+    for j = i, #queue do
+      rest[#rest + 1] = queue[j]
+    end
+    for j = 1, #idlequeue do
+      rest[#rest + 1] = idlequeue[j]
+    end
+    idlequeue = rest
+  end
+  return #idlequeue > 0
+end
+
 -- tables
 pd.Table = pd.Prototype:new()
 
+-- A table keeps a handle to the array, which notices when the array was
+-- resized, deleted or recreated (checking only when control went through
+-- Pd since the last access), so it's enough to sync once and keep the table.
 function pd.Table:sync(name)
-  self.name = name
-  self._length, self._array = pd._getarray(name)
-  if self._length < 0 then
+  if name ~= self.name or nil == self._table then
+    self.name = name
+    self._table = pd._tablenew(name)
+  end
+  if pd._tablelength(self._table) < 0 then
     return nil
   else
     return self
@@ -169,55 +588,411 @@ function pd.Table:sync(name)
 end
 
 function pd.Table:destruct()
-  self._length = -3
-  self._array = nil
+  self._table = nil
 end
 
 function pd.Table:get(i)
-  if type(i) == "number" and 0 <= i and i < self._length then
-    return pd._readarray(self._length, self._array, i)
+  if type(i) == "number" and nil ~= self._table then
+    return pd._tableread(self._table, i)
   else
     return nil
   end
 end
 
 function pd.Table:set(i, f)
-  if type(i) == "number" and type(f) == "number" and 0 <= i and i < self._length then
-    return pd._writearray(self._length, self._array, i, f)
+  if type(i) == "number" and type(f) == "number" and nil ~= self._table then
+    return pd._tablewrite(self._table, i, f)
   else
     return nil
   end
 end
 
+-- nil if the array doesn't exist (any more)
 function pd.Table:length()
-  if self._length >= 0 then
-    return self._length
+  local n = nil ~= self._table and pd._tablelength(self._table) or -1
+  if n >= 0 then
+    return n
   else
     return nil
   end
 end
 
+-- the redraw happens later, once for all redraws requested meanwhile
 function pd.Table:redraw()
   pd._redrawarray(self.name)
 end
 
+-- get (or set, if ms is given) the minimum time between two redraws of
+-- arrays in milliseconds; 0 redraws right away
+function pd.redrawinterval(ms)
+  return pd._redrawinterval(ms)
+end
+
+-- texts
+-- A text keeps a handle to the contents of a [text define], with an index
+-- of its lines that is only made again when the text changed, so reading
+-- a line doesn't go through the whole text. Lines are numbered from 0, as
+-- in [text get].
+pd.Text = pd.Prototype:new()
+
+-- (sync once and keep the text, syncing again makes the index again)
+function pd.Text:sync(name)
+  self.name = name
+  self._text = pd._textnew(name)
+  if pd._textlength(self._text) < 0 then
+    return nil
+  else
+    return self
+  end
+end
+
+function pd.Text:destruct()
+  self._text = nil
+end
+
+-- nil if the text doesn't exist (any more)
+function pd.Text:length()
+  local n = nil ~= self._text and pd._textlength(self._text) or -1
+  if n >= 0 then
+    return n
+  else
+    return nil
+  end
+end
+
+-- the atoms of line i, as a table (or pd.Atoms if raw is true)
+function pd.Text:get(i, raw)
+  if type(i) == "number" and nil ~= self._text then
+    return pd._textread(self._text, i, nil, raw)
+  else
+    return nil
+  end
+end
+
+-- a table of n lines from line i on (all of them by default)
+function pd.Text:lines(i, n, raw)
+  if nil ~= self._text then
+    i = i or 0
+    return pd._textread(self._text, i, n or math.max(0, pd._textlength(self._text) - i), raw)
+  else
+    return nil
+  end
+end
+
+-- replace n lines from line i on with a table of lines (tables or
+-- pd.Atoms), n = 0 inserts them; returns the number of lines now
+function pd.Text:replace(i, n, lines)
+  if type(i) == "number" and type(n) == "number" and nil ~= self._text then
+    return pd._textreplace(self._text, i, n, lines)
+  else
+    return nil
+  end
+end
+
+-- replace all lines
+function pd.Text:set(lines)
+  if nil ~= self._text then
+    return pd._textreplace(self._text, 0, math.max(0, pd._textlength(self._text)), lines)
+  else
+    return nil
+  end
+end
+
+-- pointers
+-- A pointer keeps a reference of its own to a scalar (or an element of an
+-- array field), so it can be kept after the message it came in with, and
+-- notices when the scalar is gone. Field names are looked up once per
+-- template, not on every access.
+pd.Pointer = pd.Prototype:new()
+
+local function pointer(h)
+  if nil == h then
+    return nil
+  end
+  local o = pd.Prototype.new(pd.Pointer)
+  o._pointer = h
+  return o
+end
+
+-- from a pointer in a message, or a copy of another pd.Pointer; nil if
+-- it's stale
+function pd.Pointer:new(p)
+  return pointer(pd._pointernew(type(p) == "table" and p._pointer or p))
+end
+
+-- the head of a canvas like [pointer]'s "traverse pd-data", next() moves
+-- on to the first scalar
+function pd.Pointer:traverse(canvas)
+  return pointer(pd._pointernew(canvas))
+end
+
+function pd.Pointer:destruct()
+  self._pointer = nil
+end
+
+function pd.Pointer:valid()
+  return nil ~= self._pointer and pd._pointervalid(self._pointer)
+end
+
+-- the template name, as in [struct]
+function pd.Pointer:template()
+  return pd._pointertemplate(self._pointer)
+end
+
+-- a number, a string, the size of an array field or the atoms of a text field
+function pd.Pointer:get(field)
+  return pd._pointerget(self._pointer, field)
+end
+
+-- float and symbol fields only; call redraw() when done
+function pd.Pointer:set(field, value)
+  pd._pointerset(self._pointer, field, value)
+end
+
+function pd.Pointer:redraw()
+  pd._pointerredraw(self._pointer)
+end
+
+-- move on to the next scalar of the canvas; nil at the end
+function pd.Pointer:next()
+  if pd._pointernext(self._pointer) then
+    return self
+  else
+    return nil
+  end
+end
+
+-- iterate over the following scalars, moving the pointer along:
+--   for p in pd.Pointer:traverse("pd-data"):scalars() do ... end
+function pd.Pointer:scalars()
+  return function ()
+    return self:next()
+  end
+end
+
+-- a new pointer to element i (from 0) of an array field
+function pd.Pointer:element(field, i)
+  return pointer(pd._pointerelement(self._pointer, field, i))
+end
+
+-- a table of elemfield of n elements of an array field from element i on
+-- (all of them by default)
+function pd.Pointer:elements(field, elemfield, i, n)
+  return pd._pointerelements(self._pointer, field, elemfield, i, n)
+end
+
+-- set elemfield of the elements of an array field from element i on to
+-- the values in a table; returns the number of elements set
+function pd.Pointer:setelements(field, elemfield, values, i)
+  return pd._pointersetelements(self._pointer, field, elemfield, values, i)
+end
+
+-- the pointer for a message, e.g. self:outlet(1, "pointer", { p:atom() })
+function pd.Pointer:atom()
+  return pd._pointeratom(self._pointer)
+end
+
+-- values
+-- A handle holds a reference to the [value] cell of a name, so get and set
+-- don't have to look it up every time. The cell is created if needed, and
+-- stays shared with any [value] objects of the same name until destruct().
+pd.Value = pd.Prototype:new()
+
+function pd.Value:new(name)
+  local o = pd.Prototype.new(self)
+  o.name = name
+  o._value = pd._valuenew(name)
+  return o
+end
+
+function pd.Value:destruct()
+  if nil ~= self._value then
+    pd._valuefree(self.name)
+    self._value = nil
+  end
+end
+
+function pd.Value:get()
+  return pd._readvalue(self._value)
+end
+
+function pd.Value:set(f)
+  pd._writevalue(self._value, f)
+end
+
+-- When running under LuaJIT, access the array memory directly through the
+-- FFI, so that loops over tables get JIT-compiled instead of going through
+-- a C function call for each element. Only leaf operations are done this
+-- way: anything that may call back into Lua (outlets, sends) must stay on
+-- the classic Lua/C API, since re-entering the Lua state from a C function
+-- called through the FFI isn't allowed.
+if jit and pd._ffi then
+  local ok, ffi = pcall(require, "ffi")
+  if ok then
+    local float = pd._ffi.floatsize == 8 and "double" or "float"
+    if pd._ffi.words then
+      ffi.cdef("typedef union { " .. float .. " w_float; void *w_ptr; } pdlua_word;")
+    else
+      ffi.cdef("typedef struct { " .. float .. " w_float; } pdlua_word;")
+    end
+
+    -- the handle's first fields, see t_pdlua_table in pdlua.c
+    ffi.cdef("typedef struct { unsigned int stamp; int length; pdlua_word *vec; } pdlua_table;")
+    local tableptr = ffi.typeof("pdlua_table *")
+    local arraystamp = ffi.cast("unsigned int *", pd._ffi.arraystamp)
+
+    -- a valid handle, or nil; the length is looked up again only when the
+    -- array may have changed
+    local function checktable(self)
+      local t = self._cdata
+      if nil ~= t and t.stamp ~= arraystamp[0] then
+        pd._tablelength(self._table)
+      end
+      if nil ~= t and t.length >= 0 then
+        return t
+      end
+      return nil
+    end
+
+    function pd.Table:sync(name)
+      if name ~= self.name or nil == self._table then
+        self.name = name
+        self._table = pd._tablenew(name)
+        self._cdata = ffi.cast(tableptr, self._table)
+      end
+      if nil == checktable(self) then
+        return nil
+      else
+        return self
+      end
+    end
+
+    function pd.Table:destruct()
+      self._table = nil
+      self._cdata = nil
+    end
+
+    function pd.Table:get(i)
+      local t = checktable(self)
+      if type(i) == "number" and nil ~= t and 0 <= i and i < t.length then
+        return tonumber(t.vec[i].w_float)
+      else
+        return nil
+      end
+    end
+
+    function pd.Table:set(i, f)
+      local t = checktable(self)
+      if type(i) == "number" and type(f) == "number" and nil ~= t and 0 <= i and i < t.length then
+        t.vec[i].w_float = f
+      else
+        return nil
+      end
+    end
+
+    function pd.Table:length()
+      local t = checktable(self)
+      return nil ~= t and t.length or nil
+    end
+
+    local floatptr = ffi.typeof(float .. " *")
+
+    function pd.Value:new(name)
+      local o = pd.Prototype.new(self)
+      o.name = name
+      o._value = pd._valuenew(name)
+      o._cell = ffi.cast(floatptr, o._value)
+      return o
+    end
+
+    function pd.Value:destruct()
+      if nil ~= self._value then
+        pd._valuefree(self.name)
+        self._value = nil
+        self._cell = nil
+      end
+    end
+
+    function pd.Value:get()
+      if nil ~= self._cell then
+        return tonumber(self._cell[0])
+      end
+      return nil
+    end
+
+    function pd.Value:set(f)
+      if nil ~= self._cell then
+        self._cell[0] = f
+      end
+    end
+  end
+end
+
 -- receivers
-function pd._receivedispatch(receive, sel, atoms)
-  if nil ~= pd._receives[receive] then
-    pd._receives[receive]:dispatch(sel, atoms)
+-- All Lua receivers listening on the same name share a single proxy on the
+-- C side, so Pd delivers each message only once and we fan it out here. The
+-- subscriber lists are copied on change (never modified in place) so that a
+-- receiver registered or destroyed during a fan-out doesn't disturb it.
+local function receivefanout(receive, ...)
+  local subscribers = pd._receives[receive]
+  if nil ~= subscribers then
+    for i = 1, #subscribers do
+      local r = subscribers[i]
+      if nil ~= r._target then
+        local ok, err = pcall(r.dispatch, r, ...)
+        if not ok then
+          r._target:error("lua: error in receive dispatcher:\n" .. tostring(err))
+        end
+      end
+    end
   end
 end
 
+function pd._receivedispatch(receive, sel, atoms)
+  receivefanout(receive, sel, atoms)
+end
+
+-- "batch" mode receivers get all messages of a tick as a single array of
+-- { sel = selector, atoms = atoms } tables
+function pd._receivebatchdispatch(receive, msgs)
+  receivefanout(receive, msgs)
+end
+
 pd.Receive = pd.Prototype:new()
 
-function pd.Receive:register(object, name, method)
+-- The optional mode selects how messages are delivered: "immediate" (the
+-- default) calls the method for each message, "last" calls it once per
+-- logical time with the last message received, "batch" calls it once per
+-- logical time with an array of all messages received (see above).
+function pd.Receive:register(object, name, method, mode)
   if nil ~= object then
     if nil ~= object._object then
-      self._receive = pd._createreceive(object._object, name)
+      mode = mode or "immediate"
+      local names = pd._receivenames[mode]
+      if nil == names then
+        names = { }
+        pd._receivenames[mode] = names
+      end
+      local receive = names[name]
+      if nil == receive then
+        receive = pd._createreceive(name, mode)
+        if nil == receive then
+          return nil
+        end
+        names[name] = receive
+        pd._receives[receive] = { }
+      end
+      local subscribers = { }
+      for i, r in ipairs(pd._receives[receive]) do
+        subscribers[i] = r
+      end
+      subscribers[#subscribers + 1] = self
+      pd._receives[receive] = subscribers
+      self._receive = receive
       self._name = name
+      self._mode = mode
       self._target = object
       self._method = method
-      pd._receives[self._receive] = self
       return self
     end
   end
@@ -225,21 +1000,145 @@ function pd.Receive:register(object, name, method)
 end
 
 function pd.Receive:destruct()
-  pd._receives[self._receive] = nil
-  pd._receivefree(self._receive)
+  if nil == self._receive then
+    return
+  end
+  local subscribers = { }
+  for _, r in ipairs(pd._receives[self._receive]) do
+    if r ~= self then
+      subscribers[#subscribers + 1] = r
+    end
+  end
+  if #subscribers > 0 then
+    pd._receives[self._receive] = subscribers
+  else
+    -- last receiver on this name, get rid of the proxy
+    pd._receives[self._receive] = nil
+    pd._receivenames[self._mode][self._name] = nil
+    pd._receivefree(self._receive)
+  end
   self._receive = nil
   self._name = nil
+  self._mode = nil
   self._target = nil
   self._method = nil
 end
 
+-- NOTE: the atoms table (or the message array of "batch" receivers) is
+-- shared by all receivers of the message, so handlers must treat it as
+-- read-only (copy it if you need to modify it)
 function pd.Receive:dispatch(sel, atoms)
   self._target[self._method](self._target, sel, atoms)
 end
 
+-- channels
+-- A channel hands Lua values from another thread (a C external or a Lua
+-- state running there) to a Lua object without taking Pd's lock. Messages
+-- are polled once per scheduler tick and passed to the method as arguments.
+pd._channels = { }
+
+function pd._channeldispatch(c, ...)
+  local ch = pd._channels[c]
+  if nil ~= ch then
+    ch:dispatch(...)
+  end
+end
+
+pd.Channel = pd.Prototype:new()
+
+-- The method may be nil for a channel that is only pushed into. The size
+-- of the ring is in bytes (default 65536), and the name is what C code
+-- uses to find the channel with pdlua_channel_find().
+function pd.Channel:register(object, method, size, name)
+  if nil ~= object then
+    if nil ~= object._object then
+      self._channel = pd._channelnew(object._object, size, name)
+      self._target = object
+      self._method = method
+      pd._channels[self._channel] = self
+      if nil ~= method then
+        pd._channellisten(self._channel)
+      end
+      return self
+    end
+  end
+  return nil
+end
+
+function pd.Channel:destruct()
+  if nil == self._channel then
+    return
+  end
+  pd._channels[self._channel] = nil
+  pd._channelfree(self._channel)
+  self._channel = nil
+end
+
+function pd.Channel:dispatch(...)
+  local m = self._target[self._method]
+  if type(m) == "function" then
+    return m(self._target, ...)
+  else
+    self._target:error("no method for `" .. self._method .. "' at channel")
+  end
+end
+
+-- Push values as one message, from the one thread producing for this
+-- channel. Returns false if the channel is full.
+function pd.Channel:push(...)
+  return pd._channelsend(self._channel, ...)
+end
+
+-- the C pointer, for handing the channel to a producer thread
+function pd.Channel:handle()
+  return self._channel
+end
+
+-- atoms
+-- pd.Atoms is a userdata holding Pd atoms as they are: atoms[i] and #atoms
+-- convert only what is looked at, atoms:table() converts all of them, and
+-- outlets and sends take it as it is. Objects that set self.rawatoms in
+-- initialize get their messages this way.
+pd.Atoms = { }
+
+-- make pd.Atoms from a table of numbers, strings and pointers
+function pd.Atoms:new(t)
+  return pd._atomsnew(t)
+end
+
 -- patchable objects
 pd.Class = pd.Prototype:new()
 
+local function watchclass(class)
+  -- only classes with a script of their own can be reloaded
+  if class._name == "pdlua" or class._scriptname ~= class._name .. ".pd_lua" then
+    return
+  end
+  local path = pd._watchfile(class._loadpath .. class._scriptname)
+  if nil ~= path then
+    pd._watched[path] = class
+  end
+end
+
+-- turn automatic reloading of changed .pd_lua scripts on or off
+function pd.watch(on)
+  if on and not pd._watching then
+    if not pd._canwatch then
+      pd.post("lua: error: watching files is not supported on this platform")
+      return false
+    end
+    pd._watching = true
+    for _, class in pairs(pd._classes) do
+      watchclass(class)
+    end
+  elseif not on and pd._watching then
+    pd._watching = false
+    pd._watched = { }
+    pd._unwatchall()
+  end
+  return pd._watching
+end
+
 function pd.Class:register(name)
   -- if already registered, return existing
   local regname
@@ -264,8 +1163,10 @@ function pd.Class:register(name)
     regname = name
   end
   pd._pathnames[regname] = fullname
+  pd._invalidateclass(regname)      -- creation name may now resolve elsewhere
   pd._classes[fullname] = self       -- record registration
-  self._class = pd._register(name)  -- register new class
+  self._class, self._methods = pd._register(name)  -- register new class
+  self._declared = { }              -- typed method declarations, for reloading
   self._name = name
   self._loadpath = fullpath
   if name == "pdlua" then
@@ -273,6 +1174,9 @@ function pd.Class:register(name)
   else
     self._scriptname = name .. ".pd_lua"
   end -- mrpeach 20111027
+  if pd._watching then
+    watchclass(self)
+  end
   return self                       -- return new
 end
 
@@ -282,7 +1186,10 @@ function pd.Class:construct(sel, atoms)
   self.outlets = 0
   self._canvaspath = pd._canvaspath(self._object) .. "/"
   if self:initialize(sel, atoms) then
-    pd._createinlets(self._object, self.inlets)
+    if self.rawatoms then
+      pd._rawatoms(self._object, true)
+    end
+    pd._createinlets(self._object, self.inlets, self._methods)
     pd._createoutlets(self._object, self.outlets)
     self:postinitialize()
     return self
@@ -293,6 +1200,11 @@ end
 
 function pd.Class:destruct()
   pd._objects[self] = nil
+  if nil ~= self._tasks then
+    for task in pairs(self._tasks) do
+      task:cancel()
+    end
+  end
   self:finalize()
   pd._destroy(self._object)
 end
@@ -330,10 +1242,36 @@ function pd.Class:dispatch(inlet, sel, atoms)
   )
 end
 
+-- Declare the arguments of an inlet method, e.g. self:method(1, "freq", "f")
+-- for in_1_freq. The message is then checked and converted in C, and the
+-- method called with the arguments as they are: "f" is a number, "s" a
+-- string, "p" a pointer, and a final "*" passes the rest as atoms.
+function pd.Class:method(inlet, sel, sig)
+  local ok, err = pd._addmethod(self._methods, inlet, sel, sig or "",
+    string.format("in_%d_%s", inlet, sel))
+  if ok then
+    table.insert(self._declared, { inlet, sel, sig })
+  else
+    pd.post(string.format("lua: error: %s: method in_%d_%s: %s",
+      tostring(self._name), inlet, sel, err))
+  end
+  return ok
+end
+
 function pd.Class:outlet(outlet, sel, atoms)
   pd._outlet(self._object, outlet, sel, atoms)
 end
 
+-- send the atoms one at a time, as float/symbol/pointer messages
+function pd.Class:outlet_drip(outlet, atoms, reverse)
+  pd._outletdrip(self._object, outlet, atoms, reverse)
+end
+
+-- send a sequence of messages given as { sel1, atoms1, sel2, atoms2, ... }
+function pd.Class:outlet_each(outlet, msgs)
+  pd._outleteach(self._object, outlet, msgs)
+end
+
 function pd.Class:initialize(sel, atoms) end
 
 function pd.Class:postinitialize() end
@@ -368,6 +1306,23 @@ function pd.Class:dofile(file)
   return f, path
 end
 
+-- run a task owned by the object, which is cancelled when it is deleted;
+-- f is a function or the name of a method, called with self and ...
+function pd.Class:spawn(f, ...)
+  if type(f) == "string" then
+    f = self[f]
+  end
+  return pd.Task:new():_start(self, f, self, ...)
+end
+
+-- like spawn, but the task starts as deferred work (see pd.defer())
+function pd.Class:defer(f, ...)
+  if type(f) == "string" then
+    f = self[f]
+  end
+  return pd.Task:new():_defer(self, f, self, ...)
+end
+
 function pd.Class:error(msg)
   pd._error(self._object, msg)
 end
@@ -392,6 +1347,34 @@ function lua:in_1_load(atoms)  -- execute a script
   self:dofile(atoms[1])
 end
 
+function lua:in_1_watch(atoms)  -- reload changed scripts automatically
+  pd.watch(atoms[1] == nil or atoms[1] ~= 0)
+end
+
+function lua:in_1_log()  -- show the messages kept in the log
+  pd._logdump()
+end
+
+function lua:in_1_trace(atoms)  -- "trace 1", "trace 0", "trace write <file>"
+  if atoms[1] == "write" then
+    if type(atoms[2]) ~= "string" then
+      self:error("trace write: file name expected")
+    else
+      pd._tracewrite(self._object, atoms[2])
+    end
+  else
+    pd._trace(atoms[1] == nil or atoms[1] ~= 0)
+  end
+end
+
+function lua:in_1_record(atoms)  -- "record <file>" to start, "record" to stop
+  pd._record(self._object, type(atoms[1]) == "string" and atoms[1] or nil)
+end
+
+function lua:in_1_replay(atoms)  -- "replay <file>" to start, "replay" to stop
+  pd._replay(self._object, type(atoms[1]) == "string" and atoms[1] or nil)
+end
+
 
 local luax = pd.Class:new():register("pdluax")  -- classless lua externals (like [pdluax foo])
 
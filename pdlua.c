@@ -25,12 +25,15 @@
  */ 
 
 /* various C stuff, mainly for reading files */
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h> // for open
 #include <sys/stat.h> // for open
 #ifdef _MSC_VER
+#include <windows.h> // for MemoryBarrier
 #include <io.h>
 #include <fcntl.h> // for open
 #define read _read
@@ -41,15 +44,24 @@
 #include <sys/fcntl.h> // for open
 #include <unistd.h>
 #endif
+#ifdef __linux__
+#include <sys/inotify.h> // for hot reloading of changed scripts
+#include <limits.h> // for PATH_MAX
+#define PDLUA_INOTIFY
+#endif
 /* we use Lua */
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
+#ifdef PDLUA_LUAJIT
+#include <luajit.h>
+#endif
 
 /* we use Pd */
 #include "m_pd.h"
 #include "s_stuff.h" // for sys_register_loader()
 #include "m_imp.h" // for struct _class
+#include "g_canvas.h" // for scalars, arrays and templates
 /* BAD: support for Pd < 0.41 */
 
 #if PD_MAJOR_VERSION == 0
@@ -117,6 +129,21 @@ typedef struct pdlua_readerdata
     char        buffer[MAXPDSTRING]; /**< Buffer to read into. */
 } t_pdlua_readerdata;
 
+/** Log ring buffer and console rate limit settings. */
+#define PDLUA_LOG_SIZE      256 /* entries in the ring buffer */
+#define PDLUA_LOG_RATE      10. /* messages per second shown on the console, per object */
+#define PDLUA_LOG_BURST     20. /* messages shown at once before rate limiting starts */
+#define PDLUA_LOG_REPEAT    1000. /* milliseconds between notices about a message repeating */
+
+/** Token bucket limiting how many log messages go to Pd's console. */
+typedef struct pdlua_logbucket
+{
+    double      tokens; /**< Messages that may be shown right now. */
+    double      time; /**< Logical time the tokens were last refilled. */
+    int         dropped; /**< Messages not shown since the last notice about it. */
+    double      noticetime; /**< Logical time of the last notice about dropped messages. */
+} t_pdlua_logbucket;
+
 /** Pd object data. */
 typedef struct pdlua 
 {
@@ -126,22 +153,69 @@ typedef struct pdlua
     int                     outlets; /**< Number of outlets. */
     t_outlet                **out; /**< The outlets themselves. */
     t_canvas                *canvas; /**< The canvas that the object was created on. */
+    t_pdlua_logbucket       log; /**< Console rate limit for this object's messages. */
+    int                     rawatoms; /**< Pass incoming atoms as pd.Atoms instead of tables. */
+    t_symbol                *creator; /**< The name the object was created with. */
+    int                     argc; /**< Number of creation arguments. */
+    t_atom                  *argv; /**< Creation arguments, kept for recordings. */
+    unsigned int            recid; /**< Object id in a recording. */
+    unsigned int            recgen; /**< The recording recid belongs to. */
 } t_pdlua;
 
+#define PDLUA_METHOD_MAXARGS 15 /**< Most arguments in a method signature. */
+
+/** A method declared with pd.Class:method(), whose arguments are checked
+ * and converted in C, so that Lua gets them as plain values. */
+typedef struct pdlua_method
+{
+    t_symbol        *sel; /**< The message selector. */
+    char            sig[PDLUA_METHOD_MAXARGS + 1]; /**< The arguments: 'f', 's' or 'p' each, '*' for the rest. */
+    int             name; /**< Registry reference to the name of the Lua method. */
+} t_pdlua_method;
+
+/** The methods declared for an inlet. */
+typedef struct pdlua_inletmethods
+{
+    t_pdlua_method  *vec; /**< The methods. */
+    int             n; /**< Number of methods. */
+} t_pdlua_inletmethods;
+
+/** The methods declared by a class, per inlet. One is made for each class
+ * (which Pd never frees), so objects and inlets can keep pointers to it. */
+typedef struct pdlua_classmethods
+{
+    t_pdlua_inletmethods    *inlets; /**< Methods by inlet number (0..). */
+    int                     n; /**< Number of inlets that have methods. */
+} t_pdlua_classmethods;
+
 /** Proxy inlet object data. */
 typedef struct pdlua_proxyinlet
 {
-    t_pd            pd; /**< Minimal Pd object. */
-    struct pdlua    *owner; /**< The owning object to forward inlet messages to. */
-    unsigned int    id; /**< The number of this inlet. */
+    t_pd                    pd; /**< Minimal Pd object. */
+    struct pdlua            *owner; /**< The owning object to forward inlet messages to. */
+    unsigned int            id; /**< The number of this inlet. */
+    t_pdlua_classmethods    *methods; /**< The methods declared by the owner's class. */
 } t_pdlua_proxyinlet;
 
+/** Receive delivery modes. */
+#define PDLUA_RECEIVE_IMMEDIATE 0 /**< Deliver each message as it arrives. */
+#define PDLUA_RECEIVE_LAST      1 /**< Deliver only the last message of a tick. */
+#define PDLUA_RECEIVE_BATCH     2 /**< Deliver all messages of a tick at once. */
+
 /** Proxy receive object data. */
 typedef struct pdlua_proxyreceive
 {
     t_pd            pd; /**< Minimal Pd object. */
-    struct pdlua    *owner; /**< The owning object to forward received messages to. */
-    t_symbol        *name; /**< The receive-symbol to bind to. */
+    t_symbol        *name; /**< The receive-symbol to bind to (shared by all Lua receives on it). */
+    int             mode; /**< Delivery mode, one of PDLUA_RECEIVE_*. */
+    t_clock         *clock; /**< Zero-delay clock for coalesced delivery, NULL in immediate mode. */
+    int             pending; /**< Delivery has been scheduled. */
+    int             busy; /**< We're delivering right now. */
+    int             dead; /**< Freed while busy, free when done. */
+    int             nmsgs; /**< Number of queued messages. */
+    int             natoms; /**< Number of queued atoms. */
+    int             atomsize; /**< Allocated size of the queue. */
+    t_atom          *atoms; /**< Queued messages, each stored as selector, atom count, atoms. */
 } t_pdlua_proxyreceive;
 
 /** Proxy clock object data. */
@@ -151,19 +225,31 @@ typedef struct pdlua_proxyclock
     struct pdlua    *owner; /**< Object to forward messages to. */
     t_clock         *clock; /** Pd clock to use. */
 } t_pdlua_proxyclock;
+
+/** Channel to pass Lua values from another thread, see pdlua_channel_new(). */
+typedef struct pdlua_channel t_pdlua_channel;
+
+/** Functions meant to be called by other externals. */
+#ifdef _WIN32
+#define PDLUA_EXPORT __declspec(dllexport)
+#else
+#define PDLUA_EXPORT
+#endif
 /* prototypes*/
 
 static const char *pdlua_reader (lua_State *L, void *rr, size_t *size);
 /** Proxy inlet 'anything' method. */
 static void pdlua_proxyinlet_anything (t_pdlua_proxyinlet *p, t_symbol *s, int argc, t_atom *argv);
 /** Proxy inlet initialization. */
-static void pdlua_proxyinlet_init (t_pdlua_proxyinlet *p, struct pdlua *owner, unsigned int id);
+static void pdlua_proxyinlet_init (t_pdlua_proxyinlet *p, struct pdlua *owner, unsigned int id, t_pdlua_classmethods *methods);
 /** Register the proxy inlet class with Pd. */
 static void pdlua_proxyinlet_setup (void);
 /** Proxy receive 'anything' method. */
 static void pdlua_proxyreceive_anything (t_pdlua_proxyreceive *r, t_symbol *s, int argc, t_atom *argv);
 /** Proxy receive allocation and initialization. */
-static t_pdlua_proxyreceive *pdlua_proxyreceive_new (struct pdlua *owner, t_symbol *name);
+static t_pdlua_proxyreceive *pdlua_proxyreceive_new (t_symbol *name, int mode);
+/** Proxy receive delivery of queued messages. */
+static void pdlua_proxyreceive_flush (t_pdlua_proxyreceive *r);
 /** Proxy receive cleanup and deallocation. */
 static void pdlua_proxyreceive_free (t_pdlua_proxyreceive *r /**< The proxy receive to free. */);
 /** Register the proxy receive class with Pd. */
@@ -176,8 +262,34 @@ static t_pdlua_proxyclock *pdlua_proxyclock_new (struct pdlua *owner);
 static void pdlua_proxyclock_setup (void);
 /** Dump an array of atoms into a Lua table. */
 static void pdlua_pushatomtable (int argc, t_atom *argv);
+/** Copy an array of atoms into a pd.Atoms userdata. */
+static void pdlua_pushatoms (lua_State *L, int argc, t_atom *argv);
+/** Get the pd.Atoms userdata at a stack index, or NULL. */
+static struct pdlua_atoms *pdlua_toatoms (lua_State *L, int idx);
+/** Make a pd.Atoms userdata from a table. */
+static int pdlua_atoms_new (lua_State *L);
+/** Pack values into a byte list, like string.pack. */
+static int pdlua_pack (lua_State *L);
+/** Unpack values from a byte list, like string.unpack. */
+static int pdlua_unpack (lua_State *L);
+/** Encode a message as an OSC packet. */
+static int pdlua_oscencode (lua_State *L);
+/** Decode an OSC packet. */
+static int pdlua_oscdecode (lua_State *L);
+/** Put OSC packets together in a bundle. */
+static int pdlua_oscbundle (lua_State *L);
+/** Parse text in Pd's syntax into atoms. */
+static int pdlua_parse (lua_State *L);
+/** Format atoms as text in Pd's syntax. */
+static int pdlua_format (lua_State *L);
+/** Parse a file in Pd's syntax a chunk at a time, returning an iterator over its messages. */
+static int pdlua_parsefile (lua_State *L);
+/** Make an object pass incoming atoms as pd.Atoms. */
+static int pdlua_object_rawatoms (lua_State *L);
 /** Pd object constructor. */
 static t_pdlua *pdlua_new (t_symbol *s, int argc, t_atom *argv);
+/** Forget the class cached for a creation name. */
+static int pdlua_invalidateclass (lua_State *L);
 /** Pd object destructor. */
 static void pdlua_free (t_pdlua *o );
 //static void pdlua_stack_dump (lua_State *L);
@@ -206,32 +318,147 @@ static int pdlua_clock_set (lua_State *L);
 static int pdlua_clock_unset (lua_State *L);
 /** Lua proxy clock destruction. */
 static int pdlua_clock_free (lua_State *L);
+/** Schedule a sleeping task to wake up at a logical time. */
+static int pdlua_schedule (lua_State *L);
+/** Take a cancelled task out of the queue of sleeping tasks. */
+static int pdlua_unschedule (lua_State *L);
+/** Get Pd's logical time. */
+static int pdlua_systime (lua_State *L);
+/** Get the time elapsed since a logical time. */
+static int pdlua_timesince (lua_State *L);
+/** Make sure deferred work runs in the next scheduler tick. */
+static int pdlua_idlewake (lua_State *L);
+/** Get the real time. */
+static int pdlua_realtime (lua_State *L);
+/** Create a queue of timed messages. */
+static int pdlua_queue_new (lua_State *L);
+/** Add a message to a queue. */
+static int pdlua_queue_push (lua_State *L);
+/** Remove all messages from a queue, or send them all right away. */
+static int pdlua_queue_lclear (lua_State *L);
+/** Number of messages in a queue. */
+static int pdlua_queue_size (lua_State *L);
+/** Destroy a queue. */
+static int pdlua_queue_lfree (lua_State *L);
+/** Create a channel. */
+static int pdlua_channel_new (lua_State *L);
+/** Destroy a channel. */
+static int pdlua_channel_free (lua_State *L);
+/** Start delivering the messages of a channel to Lua. */
+static int pdlua_channel_listen (lua_State *L);
+/** Push values into a channel from Lua. */
+static int pdlua_channel_send (lua_State *L);
+/** C interface of channels, for producer threads in other externals. */
+PDLUA_EXPORT t_pdlua_channel *pdlua_channel_find (const char *name);
+PDLUA_EXPORT void pdlua_channel_release (t_pdlua_channel *ch);
+PDLUA_EXPORT int pdlua_channel_push (t_pdlua_channel *ch, const char *data, size_t len);
+PDLUA_EXPORT int pdlua_channel_pushlua (t_pdlua_channel *ch, lua_State *L, int n);
 /** Lua object destruction. */
 static int pdlua_object_free (lua_State *L);
 /** Dispatch Pd inlet messages to Lua objects. */
 static void pdlua_dispatch (t_pdlua *o, unsigned int inlet, t_symbol *s, int argc, t_atom *argv);
+/** Dispatch a message for a declared method to a Lua object. */
+static void pdlua_methoddispatch (t_pdlua *o, unsigned int inlet, t_pdlua_method *m, int argc, t_atom *argv);
+/** Declare a method. */
+static int pdlua_method_add (lua_State *L);
+/** Forget the methods declared by a class. */
+static int pdlua_method_clear (lua_State *L);
 /** Dispatch Pd receive messages to Lua objects. */
 static void pdlua_receivedispatch (t_pdlua_proxyreceive *r, t_symbol *s, int argc, t_atom *argv);
+/** Dispatch a batch of queued Pd receive messages to Lua objects. */
+static void pdlua_receivebatchdispatch (t_pdlua_proxyreceive *r, int nmsgs, t_atom *atoms);
 /** Dispatch Pd clock messages to Lua objects. */
 static void pdlua_clockdispatch(t_pdlua_proxyclock *clock);
 /** Convert a Lua table into a Pd atom array. */
 static t_atom *pdlua_popatomtable (lua_State *L, int *count, t_pdlua *o);
 /** Send a message from a Lua object outlet. */
 static int pdlua_outlet (lua_State *L);
+/** Send the elements of a list from a Lua object outlet one by one. */
+static int pdlua_outlet_drip (lua_State *L);
+/** Send a sequence of messages from a Lua object outlet. */
+static int pdlua_outlet_each (lua_State *L);
 /** Send a message from a Lua object to a Pd receiver. */
 static int pdlua_send (lua_State *L);
 /** Set a [value] object's value. */
 static int pdlua_setvalue (lua_State *L);
 /** Get a [value] object's value. */
 static int pdlua_getvalue (lua_State *L);
+/** Get a reference to a [value] cell. */
+static int pdlua_value_new (lua_State *L);
+/** Release a reference to a [value] cell. */
+static int pdlua_value_free (lua_State *L);
+/** Read a [value] cell. */
+static int pdlua_readvalue (lua_State *L);
+/** Write a [value] cell. */
+static int pdlua_writevalue (lua_State *L);
 /** Get a [table] object's array. */
 static int pdlua_getarray (lua_State *L);
 /** Read from a [table] object's array. */
 static int pdlua_readarray (lua_State *L);
 /** Write to a [table] object's array. */
 static int pdlua_writearray (lua_State *L);
-/** Redraw a [table] object's graph. */
+/** Create a handle for a [table] object's array. */
+static int pdlua_table_new (lua_State *L);
+/** Get the length of a table handle's array. */
+static int pdlua_table_length (lua_State *L);
+/** Read from a table handle's array. */
+static int pdlua_table_read (lua_State *L);
+/** Write to a table handle's array. */
+static int pdlua_table_write (lua_State *L);
+/** Create a handle for a [text define] object's contents. */
+static int pdlua_text_new (lua_State *L);
+/** Free the line index of a text handle. */
+static int pdlua_text_gc (lua_State *L);
+/** Get the number of lines of a text handle's buffer. */
+static int pdlua_text_length (lua_State *L);
+/** Read lines from a text handle's buffer. */
+static int pdlua_text_read (lua_State *L);
+/** Replace lines of a text handle's buffer. */
+static int pdlua_text_replace (lua_State *L);
+/** Create a handle for a pointer to a scalar. */
+static int pdlua_pointer_new (lua_State *L);
+/** Release the reference of a pointer handle. */
+static int pdlua_pointer_gc (lua_State *L);
+/** Check whether a pointer handle points to something. */
+static int pdlua_pointer_valid (lua_State *L);
+/** Get the template name of what a pointer handle points to. */
+static int pdlua_pointer_template (lua_State *L);
+/** Get a field of what a pointer handle points to. */
+static int pdlua_pointer_get (lua_State *L);
+/** Set a field of what a pointer handle points to. */
+static int pdlua_pointer_set (lua_State *L);
+/** Redraw the scalar a pointer handle points to. */
+static int pdlua_pointer_redraw (lua_State *L);
+/** Move a pointer handle to the next scalar of its canvas. */
+static int pdlua_pointer_next (lua_State *L);
+/** Get a pointer handle to an element of an array field. */
+static int pdlua_pointer_element (lua_State *L);
+/** Read one field of a range of elements of an array field. */
+static int pdlua_pointer_elements (lua_State *L);
+/** Write one field of a range of elements of an array field. */
+static int pdlua_pointer_setelements (lua_State *L);
+/** Get the pointer of a pointer handle, to send it in a message. */
+static int pdlua_pointer_atom (lua_State *L);
+/** Redraw a [table] object's graph, soon. */
 static int pdlua_redrawarray (lua_State *L);
+/** Get or set the minimum time between array redraws. */
+static int pdlua_setredrawinterval (lua_State *L);
+/** Log a message from an object (or NULL) to the ring buffer and the console. */
+static void pdlua_log (t_pdlua *o, int error, const char *msg);
+/** Log a formatted message. */
+static void pdlua_logf (t_pdlua *o, int error, const char *fmt, ...);
+/** Remove an object that is going away from the log. */
+static void pdlua_logforget (t_pdlua *o);
+/** Post all messages in the log ring buffer to Pd's console. */
+static int pdlua_logdump (lua_State *L);
+/** Turn recording of a trace of the Lua message flow on or off. */
+static int pdlua_trace_enable (lua_State *L);
+/** Write the recorded trace to a file, in Chrome's trace event format. */
+static int pdlua_trace_write (lua_State *L);
+/** Start or stop recording the messages to Lua objects. */
+static int pdlua_record (lua_State *L);
+/** Start or stop replaying a recording. */
+static int pdlua_replay (lua_State *L);
 /** Post to Pd's console. */
 static int pdlua_post (lua_State *L);
 /** Report an error from a Lua object to Pd's console. */
@@ -240,6 +467,12 @@ static void pdlua_setrequirepath (lua_State *L, const char *path);
 static void pdlua_clearrequirepath (lua_State *L);
 /** Run a Lua script using Pd's path. */
 static int pdlua_dofile (lua_State *L);
+/** Compile a Lua script using the path of a class, without running it. */
+static int pdlua_loadfilex (lua_State *L);
+/** Start watching a script file for changes. */
+static int pdlua_watchfile (lua_State *L);
+/** Stop watching all script files. */
+static int pdlua_unwatchall (lua_State *L);
 /** Initialize the pd API for Lua. */
 static void pdlua_init (lua_State *L);
 /** Pd loader hook for loading and executing Lua scripts. */
@@ -266,6 +499,288 @@ static t_class *pdlua_proxyreceive_class;
 /** Proxy clock class pointer. */
 static t_class *pdlua_proxyclock_class;
 
+/** Kinds of events in a trace. */
+#define PDLUA_TRACE_DISPATCH    0 /**< A message to an inlet of a Lua object. */
+#define PDLUA_TRACE_OUTLET      1 /**< A message from an outlet of a Lua object. */
+#define PDLUA_TRACE_SEND        2 /**< A message sent with pd.send(). */
+#define PDLUA_TRACE_CLOCK       3 /**< A clock callback. */
+#define PDLUA_TRACE_RECEIVE     4 /**< A message delivered to Lua receivers. */
+
+/** An event in a trace: something that started and ended. */
+typedef struct pdlua_traceevent
+{
+    double      start; /**< Real time it started, in seconds. */
+    double      end; /**< Real time it ended, in seconds. */
+    const void  *obj; /**< The object, used as an id only. */
+    t_symbol    *name; /**< The class name of the object, or the receive name. */
+    t_symbol    *sel; /**< The message selector. */
+    int         kind; /**< One of PDLUA_TRACE_*. */
+    int         port; /**< Inlet or outlet number (1..), or 0. */
+} t_pdlua_traceevent;
+
+#define PDLUA_TRACE_SIZE 65536 /* events kept, must be a power of two */
+
+/** The trace ring buffer, allocated once when tracing is turned on first.
+ * Only Pd's main thread writes to it, so it needs no locking. */
+static t_pdlua_traceevent *pdlua_trace = NULL;
+static unsigned int pdlua_tracenext = 0;
+static int pdlua_tracing = 0;
+static double pdlua_tracestart = 0;
+
+#define PDLUA_CLASSNAME(o) ((*(t_pd *)(o))->c_name)
+
+/** Counts the times control went from Lua to Pd, which is when arrays may
+ * have been resized or deleted. Table handles revalidate when it changed. */
+static unsigned int pdlua_arraystamp = 0;
+#define PDLUA_ARRAYS_MAYCHANGE() (pdlua_arraystamp++)
+
+/** An object that Lua code is running for, on the C stack of the call. */
+typedef struct pdlua_frame
+{
+    t_pdlua             *obj; /**< The object, NULL once it has been freed. */
+    struct pdlua_frame  *prev; /**< The frame of the call this one is nested in. */
+} t_pdlua_frame;
+
+/** The innermost frame, NULL if no object's Lua code is running. */
+static t_pdlua_frame *pdlua_frames = NULL;
+
+/** Note that Lua code runs for an object until pdlua_leave(). Afterwards
+ * f->obj tells whether the object is still there, to log errors to it. */
+static void pdlua_enter(t_pdlua_frame *f, t_pdlua *o)
+{
+    f->obj = o;
+    f->prev = pdlua_frames;
+    pdlua_frames = f;
+}
+
+static void pdlua_leave(t_pdlua_frame *f)
+{
+    pdlua_frames = f->prev;
+}
+
+/** Clear an object that is being freed from the frames of the calls running for it. */
+static void pdlua_frames_forget(t_pdlua *o)
+{
+    t_pdlua_frame   *f;
+
+    for (f = pdlua_frames; f; f = f->prev)
+        if (f->obj == o) f->obj = NULL;
+}
+
+/** Add an event that is ending now to the trace. */
+static void pdlua_trace_add(int kind, const void *obj, t_symbol *name, t_symbol *sel, int port, double start)
+{
+    t_pdlua_traceevent *e = &pdlua_trace[pdlua_tracenext++ & (PDLUA_TRACE_SIZE - 1)];
+
+    e->start = start;
+    e->end = sys_getrealtime();
+    e->obj = obj;
+    e->name = name;
+    e->sel = sel;
+    e->kind = kind;
+    e->port = port;
+}
+
+/** Record types in a recording of the messages to Lua objects. The file
+ * starts with PDLUA_REC_MAGIC, then each record is a type byte followed by
+ * its fields. Counts, ids and inlets are unsigned LEB128 varints, times and
+ * floats little-endian doubles, symbols are ids defined by an earlier
+ * PDLUA_REC_SYMBOL record. Atoms are a count followed by 'f' and a double,
+ * 's' and a symbol id, or 'p' for a pointer (which can't be replayed). */
+#define PDLUA_REC_MAGIC     "PDLUAREC1"
+#define PDLUA_REC_SYMBOL    'S' /**< The next symbol id: length, name. */
+#define PDLUA_REC_NEW       'N' /**< Time, object id, creation name, atoms. */
+#define PDLUA_REC_MESSAGE   'M' /**< Time, object id, inlet (1..), selector, atoms. */
+#define PDLUA_REC_FREE      'F' /**< Time, object id. */
+
+/** An entry of the symbol table of a recording. */
+typedef struct pdlua_recsym
+{
+    t_symbol        *sym; /**< The symbol, or NULL for an empty slot. */
+    unsigned int    id; /**< Its id in the recording. */
+} t_pdlua_recsym;
+
+/** The recording being written, if any. Like the trace, only Pd's main
+ * thread writes to it. */
+static FILE *pdlua_recfile = NULL;
+static unsigned int pdlua_recgen = 0; /* bumped for each recording, invalidating older object ids */
+static unsigned int pdlua_recobjects = 0;
+static double pdlua_recstart = 0;
+static t_symbol *pdlua_recskip = NULL;
+static t_pdlua_recsym *pdlua_recsyms = NULL; /* open addressing hash table, keyed by address */
+static unsigned int pdlua_recsymsize = 0;
+static unsigned int pdlua_recsymcount = 0;
+
+static void pdlua_rec_uint(unsigned int v)
+{
+    while (v >= 0x80)
+    {
+        putc((v & 0x7f) | 0x80, pdlua_recfile);
+        v >>= 7;
+    }
+    putc(v, pdlua_recfile);
+}
+
+static void pdlua_rec_double(double d)
+{
+    uint64_t    u;
+    int         i;
+
+    memcpy(&u, &d, sizeof(u));
+    for (i = 0; i < 8; i++) putc((u >> (8 * i)) & 0xff, pdlua_recfile);
+}
+
+/** Get the id of a symbol in the recording, writing its definition first if
+ * it is new. So this must be called before writing a record using it. */
+static unsigned int pdlua_rec_symid(t_symbol *s)
+{
+    unsigned int    i, j, mask;
+    size_t          len;
+
+    if (2 * (pdlua_recsymcount + 1) > pdlua_recsymsize)
+    {
+        unsigned int    size = pdlua_recsymsize ? 2 * pdlua_recsymsize : 256;
+        t_pdlua_recsym  *syms = getbytes(size * sizeof(t_pdlua_recsym));
+
+        for (i = 0; i < pdlua_recsymsize; i++)
+        {
+            if (!pdlua_recsyms[i].sym) continue;
+            for (j = ((uintptr_t) pdlua_recsyms[i].sym >> 4) & (size - 1); syms[j].sym; j = (j + 1) & (size - 1));
+            syms[j] = pdlua_recsyms[i];
+        }
+        if (pdlua_recsyms) freebytes(pdlua_recsyms, pdlua_recsymsize * sizeof(t_pdlua_recsym));
+        pdlua_recsyms = syms;
+        pdlua_recsymsize = size;
+    }
+    mask = pdlua_recsymsize - 1;
+    for (i = ((uintptr_t) s >> 4) & mask; pdlua_recsyms[i].sym; i = (i + 1) & mask)
+        if (pdlua_recsyms[i].sym == s) return pdlua_recsyms[i].id;
+    pdlua_recsyms[i].sym = s;
+    pdlua_recsyms[i].id = pdlua_recsymcount++;
+    len = strlen(s->s_name);
+    putc(PDLUA_REC_SYMBOL, pdlua_recfile);
+    pdlua_rec_uint(len);
+    fwrite(s->s_name, 1, len, pdlua_recfile);
+    return pdlua_recsyms[i].id;
+}
+
+/** Write the symbol definitions needed by some atoms. */
+static void pdlua_rec_atomsyms(int argc, t_atom *argv)
+{
+    int i;
+
+    for (i = 0; i < argc; i++)
+        if (argv[i].a_type == A_SYMBOL) pdlua_rec_symid(argv[i].a_w.w_symbol);
+}
+
+static void pdlua_rec_atoms(int argc, t_atom *argv)
+{
+    int i;
+
+    pdlua_rec_uint(argc);
+    for (i = 0; i < argc; i++)
+    {
+        if (argv[i].a_type == A_FLOAT)
+        {
+            putc('f', pdlua_recfile);
+            pdlua_rec_double(argv[i].a_w.w_float);
+        }
+        else if (argv[i].a_type == A_SYMBOL)
+        {
+            putc('s', pdlua_recfile);
+            pdlua_rec_uint(pdlua_rec_symid(argv[i].a_w.w_symbol));
+        }
+        else putc('p', pdlua_recfile);
+    }
+}
+
+/** Record the creation of an object. Objects that are older than the
+ * recording are recorded when they get their first message. */
+static void pdlua_rec_new(t_pdlua *o)
+{
+    unsigned int name = pdlua_rec_symid(o->creator);
+
+    pdlua_rec_atomsyms(o->argc, o->argv);
+    o->recid = ++pdlua_recobjects;
+    o->recgen = pdlua_recgen;
+    putc(PDLUA_REC_NEW, pdlua_recfile);
+    pdlua_rec_double(clock_gettimesince(pdlua_recstart));
+    pdlua_rec_uint(o->recid);
+    pdlua_rec_uint(name);
+    pdlua_rec_atoms(o->argc, o->argv);
+}
+
+/** Record a message to an inlet of an object. */
+static void pdlua_rec_message(t_pdlua *o, unsigned int inlet, t_symbol *s, int argc, t_atom *argv)
+{
+    unsigned int sel;
+
+    if (o->recgen != pdlua_recgen) pdlua_rec_new(o);
+    sel = pdlua_rec_symid(s);
+    pdlua_rec_atomsyms(argc, argv);
+    putc(PDLUA_REC_MESSAGE, pdlua_recfile);
+    pdlua_rec_double(clock_gettimesince(pdlua_recstart));
+    pdlua_rec_uint(o->recid);
+    pdlua_rec_uint(inlet + 1);
+    pdlua_rec_uint(sel);
+    pdlua_rec_atoms(argc, argv);
+}
+
+/** Record the destruction of an object, if it is in the recording. */
+static void pdlua_rec_free(t_pdlua *o)
+{
+    if (o->recgen != pdlua_recgen) return;
+    putc(PDLUA_REC_FREE, pdlua_recfile);
+    pdlua_rec_double(clock_gettimesince(pdlua_recstart));
+    pdlua_rec_uint(o->recid);
+}
+
+/** Time spent in the callbacks for one kind of message during a replay. */
+typedef struct pdlua_replaystat
+{
+    t_symbol        *name; /**< Class name of the object. */
+    t_symbol        *sel; /**< Message selector, or "new" for the creation of the object. */
+    unsigned int    inlet; /**< Inlet number (1..), or 0 for the creation. */
+    unsigned int    count; /**< Number of callbacks. */
+    double          total; /**< Real time they took, in seconds. */
+    double          max; /**< Real time the slowest one took, in seconds. */
+} t_pdlua_replaystat;
+
+/** A recording being replayed. Objects are created on the patch of the
+ * [pdlua] object that started it, but aren't part of it, so their outlets
+ * go nowhere and only the time spent in Lua is measured. */
+typedef struct pdlua_replay
+{
+    t_clock             *clock; /**< Wakes us up for the next record that is due. */
+    t_pdlua             *owner; /**< The [pdlua] object replaying. */
+    t_symbol            *path; /**< The file being replayed. */
+    unsigned char       *buf; /**< Contents of the file. */
+    size_t              size; /**< Size of the file. */
+    size_t              pos; /**< Position of the next record. */
+    t_symbol            **syms; /**< Symbols by id. */
+    unsigned int        nsyms; /**< Number of symbols defined. */
+    unsigned int        maxsyms; /**< Allocated size of syms. */
+    t_pdlua             **objs; /**< Objects by id, NULL if not (or no longer) there. */
+    unsigned int        maxobjs; /**< Allocated size of objs. */
+    t_atom              *argv; /**< Atoms of the current record. */
+    int                 maxargs; /**< Allocated size of argv. */
+    t_pdlua_replaystat  *stats; /**< Time spent in callbacks. */
+    int                 nstats; /**< Number of stats. */
+    int                 maxstats; /**< Allocated size of stats. */
+    double              start; /**< Logical time the replay started. */
+    int                 busy; /**< Nonzero while replaying records. */
+    int                 dead; /**< Stopped while busy, to be freed when done. */
+    int                 quiet; /**< Its [pdlua] object is gone, so stop without a word. */
+} t_pdlua_replay;
+
+/** The replay running, if any. */
+static t_pdlua_replay *pdlua_replaying = NULL;
+static void pdlua_replay_stop(t_pdlua_replay *r, int quiet);
+
+/** Whether messages to an object go into the recording. The [pdlua] object
+ * is left out, it is what starts and stops recordings. */
+#define PDLUA_RECORDING(o) (pdlua_recfile && (o)->creator && (o)->creator != pdlua_recskip)
+
 /** Lua file reader callback. */
 static const char *pdlua_reader
 (
@@ -300,6 +815,22 @@ static void pdlua_proxyinlet_anything
     t_atom              *argv /**< The atoms in the message. */
 )
 {
+    t_pdlua_classmethods    *cm = p->methods;
+    int                     i;
+
+    /* declared methods first, it's just a few pointer compares like in Pd */
+    if (cm && p->id < (unsigned int) cm->n)
+    {
+        t_pdlua_inletmethods *im = &cm->inlets[p->id];
+        for (i = 0; i < im->n; i++)
+        {
+            if (im->vec[i].sel == s)
+            {
+                pdlua_methoddispatch(p->owner, p->id, &im->vec[i], argc, argv);
+                return;
+            }
+        }
+    }
     pdlua_dispatch(p->owner, p->id, s, argc, argv);
 }
 
@@ -308,12 +839,14 @@ static void pdlua_proxyinlet_init
 (
     t_pdlua_proxyinlet  *p, /**< The proxy inlet to initialize. */
     struct pdlua        *owner, /**< The owning object. */
-    unsigned int        id /**< The inlet number. */
+    unsigned int        id, /**< The inlet number. */
+    t_pdlua_classmethods *methods /**< The methods declared by the owner's class, or NULL. */
 )
 {
     p->pd = pdlua_proxyinlet_class;
     p->owner = owner;
     p->id = id;
+    p->methods = methods;
 }
 
 /** Register the proxy inlet class with Pd. */
@@ -332,20 +865,95 @@ static void pdlua_proxyreceive_anything(
     t_atom                  *argv /**< The atoms in the message. */
 )
 {
-    pdlua_receivedispatch(r, s, argc, argv);
+    int n;
+
+    if (r->mode == PDLUA_RECEIVE_IMMEDIATE)
+    {
+        pdlua_receivedispatch(r, s, argc, argv);
+        return;
+    }
+    /* coalesced delivery, queue the message until the clock fires */
+    if (r->mode == PDLUA_RECEIVE_LAST) r->natoms = r->nmsgs = 0;
+    n = r->natoms + argc + 2;
+    if (n > r->atomsize)
+    {
+        int     size = r->atomsize ? r->atomsize : 64;
+        t_atom  *atoms;
+        while (size < n) size *= 2;
+        atoms = realloc(r->atoms, size * sizeof(t_atom));
+        if (!atoms)
+        {
+            pd_error(NULL, "lua: error: out of memory in receive queue for `%s'", r->name->s_name);
+            return;
+        }
+        r->atoms = atoms;
+        r->atomsize = size;
+    }
+    SETSYMBOL(&r->atoms[r->natoms], s);
+    SETFLOAT(&r->atoms[r->natoms + 1], argc);
+    if (argc > 0) memcpy(&r->atoms[r->natoms + 2], argv, argc * sizeof(t_atom));
+    r->natoms = n;
+    r->nmsgs++;
+    if (!r->pending)
+    {
+        r->pending = 1;
+        clock_delay(r->clock, 0);
+    }
+}
+
+/** Proxy receive delivery of queued messages. */
+static void pdlua_proxyreceive_flush(t_pdlua_proxyreceive *r /**< The proxy receive whose clock fired. */)
+{
+    /* Take the queue out of the proxy while we deliver it, so that messages
+       sent to the receiver by the Lua handlers are queued for the next
+       delivery instead of clobbering this one. */
+    t_atom  *atoms = r->atoms;
+    int     nmsgs = r->nmsgs;
+    int     atomsize = r->atomsize;
+
+    r->atoms = NULL;
+    r->nmsgs = r->natoms = r->atomsize = 0;
+    r->pending = 0;
+    r->busy = 1;
+    if (nmsgs > 0)
+    {
+        if (r->mode == PDLUA_RECEIVE_LAST)
+            pdlua_receivedispatch(r, atoms[0].a_w.w_symbol, atom_getfloat(&atoms[1]), &atoms[2]);
+        else
+            pdlua_receivebatchdispatch(r, nmsgs, atoms);
+    }
+    r->busy = 0;
+    if (r->dead || r->atoms)
+        free(atoms);
+    else
+    {
+        /* give the buffer back for reuse */
+        r->atoms = atoms;
+        r->atomsize = atomsize;
+    }
+    if (r->dead)
+    {
+        free(r->atoms);
+        free(r);
+    }
 }
 
 /** Proxy receive allocation and initialization. */
 static t_pdlua_proxyreceive *pdlua_proxyreceive_new
 (
-    struct pdlua    *owner, /**< The owning object. */
-    t_symbol        *name /**< The symbol to bind to. */
+    t_symbol        *name, /**< The symbol to bind to. */
+    int             mode /**< The delivery mode. */
 )
 {
     t_pdlua_proxyreceive *r = malloc(sizeof(t_pdlua_proxyreceive));
     r->pd = pdlua_proxyreceive_class;
-    r->owner = owner;
     r->name = name;
+    r->mode = mode;
+    r->clock = (mode == PDLUA_RECEIVE_IMMEDIATE) ? NULL :
+        clock_new(r, (t_method) pdlua_proxyreceive_flush);
+    r->pending = r->busy = r->dead = 0;
+    r->nmsgs = r->natoms = r->atomsize = 0;
+    r->atoms = NULL;
     pd_bind(&r->pd, r->name);
     return r;
 }
@@ -354,9 +962,18 @@ static t_pdlua_proxyreceive *pdlua_proxyreceive_new
 static void pdlua_proxyreceive_free(t_pdlua_proxyreceive *r /**< The proxy receive to free. */)
 {
     pd_unbind(&r->pd, r->name);
+    if (r->clock) clock_free(r->clock);
+    r->clock = NULL;
     r->pd = NULL;
-    r->owner = NULL;
     r->name = NULL;
+    if (r->busy)
+    {
+        /* we're being freed from a Lua handler, pdlua_proxyreceive_flush()
+           will finish the job */
+        r->dead = 1;
+        return;
+    }
+    free(r->atoms);
     free(r);
 }
 
@@ -428,1006 +1045,5515 @@ static void pdlua_pushatomtable
     PDLUA_DEBUG("pdlua_pushatomtable: end. stack top %d", lua_gettop(__L));
 }
 
-static const char *basename(const char *name)
+/** Atoms kept as they are, in a Lua userdata (pd.Atoms). Messages that are
+ * only stored and sent on again don't need converting to a table and back. */
+typedef struct pdlua_atoms
 {
-  /* strip dir from name : */
-  const char *basenamep = strrchr(name, '/');
-#ifdef _WIN32
-  if (!basenamep)
-    basenamep = strrchr(name, '\\');
-#endif
-  if (!basenamep)
-    basenamep = name;
-  else basenamep++;   /* strip last '/' */
-  return basenamep;
-}
+    int     argc; /**< Number of atoms. */
+    t_atom  argv[1]; /**< The atoms, argc of them. */
+} t_pdlua_atoms;
 
-/** Pd object constructor. */
-static t_pdlua *pdlua_new
-(
-    t_symbol    *s, /**< The construction message selector. */
-    int         argc, /**< The construction message atom count. */
-    t_atom      *argv /**< The construction message atoms. */
-)
+#define PDLUA_ATOMS_META "pdlua.Atoms" /* registry name of the pd.Atoms metatable */
+
+/** Push one atom as a Lua value. */
+static void pdlua_pushatom(lua_State *L, t_atom *a)
 {
-    int i;
-    PDLUA_DEBUG("pdlua_new: s->s_name is %s", s->s_name);
-    for (i = 0; i < argc; ++i)
+    switch (a->a_type)
     {
-        switch (argv[i].a_type)
-        {
         case A_FLOAT:
-            PDLUA_DEBUG2("argv[%d]: %f", i, argv[i].a_w.w_float);
+            lua_pushnumber(L, a->a_w.w_float);
             break;
         case A_SYMBOL:
-            PDLUA_DEBUG2("argv[%d]: %s", i, argv[i].a_w.w_symbol->s_name);
+            lua_pushstring(L, a->a_w.w_symbol->s_name);
             break;
-        default:
-            pd_error(NULL, "pdlua_new: bad argument type"); // should never happen
-            return NULL;
-        }
-    }
-    PDLUA_DEBUG("pdlua_new: start with stack top %d", lua_gettop(__L));
-    lua_getglobal(__L, "pd");
-    lua_getfield(__L, -1, "_checkbase");
-    lua_pushstring(__L, s->s_name);
-    lua_pcall(__L, 1, 1, 0);
-    int needs_base = lua_toboolean(__L, -1);
-    lua_pop(__L, 1); /* pop boolean */
-    /* have to load the .pd_lua file for basename if another class is owning it */
-    if(needs_base) {
-        char                buf[MAXPDSTRING];
-        char                *ptr;
-        t_pdlua_readerdata  reader;
-        t_canvas* current = canvas_getcurrent();
-        int fd = canvas_open(current, s->s_name, ".pd_lua", buf, &ptr, MAXPDSTRING, 1);
-        if (fd >= 0)
+        case A_POINTER:
+            lua_pushlightuserdata(L, a->a_w.w_gpointer);
+            break;
+        case A_SEMI: case A_COMMA: case A_DOLLAR: case A_DOLLSYM:
         {
-            PDLUA_DEBUG("basename open: stack top %d", lua_gettop(__L));
-            /* save old loadname, restore later in case of
-             * nested loading */ 
-            int n, load_name_save, load_path_save;
-            lua_getfield(__L, -1, "_loadname");
-            load_name_save = luaL_ref(__L, LUA_REGISTRYINDEX);
-            lua_pushnil(__L);
-            lua_setfield(__L, -2, "_loadname");
-            lua_getfield(__L, -1, "_loadpath");
-            load_path_save = luaL_ref(__L, LUA_REGISTRYINDEX);
-            lua_pushstring(__L, buf);
-            lua_setfield(__L, -2, "_loadpath");
-            
-            PDLUA_DEBUG("pdlua_new (basename load) path is %s", buf);
-            //pdlua_setpathname(o, buf);/* change the scriptname to include its path 
-            pdlua_setrequirepath(__L, buf);
-            class_set_extern_dir(gensym(buf));
-            strncpy(buf, s->s_name, MAXPDSTRING - 8);
-            strcat(buf, ".pd_lua");
-            reader.fd = fd;
-            n = lua_gettop(__L);
-#if LUA_VERSION_NUM	< 502
-            if (lua_load(__L, pdlua_reader, &reader, buf))
-#else // 5.2 style
-            if (lua_load(__L, pdlua_reader, &reader, buf, NULL))
-#endif // LUA_VERSION_NUM	< 502
-            {
-                close(fd);
-                pdlua_clearrequirepath(__L);
-                lua_error(__L);
-            }
-            else
-            {
-                if (lua_pcall(__L, 0, LUA_MULTRET, 0))
-                {
-                    pd_error(NULL, "lua: error running `%s':\n%s", buf, lua_tostring(__L, -1));
-                    lua_pop(__L, 1);
-                    close(fd);
-                    pdlua_clearrequirepath(__L);
-                }
-                else
-                {
-                    /* succeeded */
-                    close(fd);
-                    pdlua_clearrequirepath(__L);
-                }
-            }
-            class_set_extern_dir(&s_);
-            lua_settop(__L, n); /* discard results of load */
-            lua_rawgeti(__L, LUA_REGISTRYINDEX, load_path_save);
-            lua_setfield(__L, -2, "_loadpath");
-            luaL_unref(__L, LUA_REGISTRYINDEX, load_path_save);
-            lua_rawgeti(__L, LUA_REGISTRYINDEX, load_name_save);
-            lua_setfield(__L, -2, "_loadname");
-            luaL_unref(__L, LUA_REGISTRYINDEX, load_name_save);
-        }
-        else pd_error(NULL, "lua: error loading `%s': canvas_open() failed", buf);
-    }
-    PDLUA_DEBUG("pdlua_new: after load script. stack top %d", lua_gettop(__L));
-    lua_getfield(__L, -1, "_constructor");
-    lua_pushstring(__L, s->s_name);
-    pdlua_pushatomtable(argc, argv);
-    PDLUA_DEBUG("pdlua_new: before lua_pcall(L, 2, 1, 0) stack top %d", lua_gettop(__L));
-    if (lua_pcall(__L, 2, 1, 0))
-    {
-        pd_error(NULL, "pdlua_new: error in constructor for `%s':\n%s", s->s_name, lua_tostring(__L, -1));
-        lua_pop(__L, 2); /* pop the error string and the global "pd" */
-        return NULL;
-    }
-    else
-    {
-        t_pdlua *object = NULL;
-        PDLUA_DEBUG("pdlua_new: done lua_pcall(L, 2, 1, 0) stack top %d", lua_gettop(__L));
-        if (lua_islightuserdata(__L, -1))
-        {
-            object = lua_touserdata(__L, -1);
-            lua_pop(__L, 2);/* pop the userdata and the global "pd" */
-            PDLUA_DEBUG2("pdlua_new: before returning object %p stack top %d", object, lua_gettop(__L));
-             return object;
-        }
-        else
-        {
-            lua_pop(__L, 2);/* pop the userdata and the global "pd" */
-            PDLUA_DEBUG("pdlua_new: done FALSE lua_islightuserdata(L, -1)", 0);
-            return NULL;
+            /* only found in parsed text, as they would be written */
+            char buf[MAXPDSTRING];
+            atom_string(a, buf, MAXPDSTRING);
+            lua_pushstring(L, buf);
+            break;
         }
+        default:
+            lua_pushnil(L);
+            break;
     }
 }
 
-/** Pd object destructor. */
-static void pdlua_free( t_pdlua *o /**< The object to destruct. */)
+/** Push a new pd.Atoms userdata for argc atoms, which the caller fills in. */
+static t_pdlua_atoms *pdlua_newatoms(lua_State *L, int argc)
 {
-    PDLUA_DEBUG("pdlua_free: stack top %d", lua_gettop(__L));
-    lua_getglobal(__L, "pd");
-    lua_getfield (__L, -1, "_destructor");
-    lua_pushlightuserdata(__L, o);
-    if (lua_pcall(__L, 1, 0, 0))
-    {
-        pd_error(NULL, "lua: error in destructor:\n%s", lua_tostring(__L, -1));
-        lua_pop(__L, 1); /* pop the error string */
-    }
-    lua_pop(__L, 1); /* pop the global "pd" */
-    PDLUA_DEBUG("pdlua_free: end. stack top %d", lua_gettop(__L));
-    return;
+    t_pdlua_atoms *a = lua_newuserdata(L, sizeof(t_pdlua_atoms) + (argc > 0 ? argc - 1 : 0) * sizeof(t_atom));
+
+    a->argc = argc;
+    luaL_getmetatable(L, PDLUA_ATOMS_META);
+    lua_setmetatable(L, -2);
+    return a;
 }
 
-#if 0
-static void pdlua_stack_dump (lua_State *L)
+static void pdlua_pushatoms
+(
+    lua_State   *L, /**< Lua interpreter state. */
+    int         argc, /**< The number of atoms in the array. */
+    t_atom      *argv /**< The array of atoms. */
+)
 {
-    int i;
-    int top = lua_gettop(L);
+    t_pdlua_atoms *a = pdlua_newatoms(L, argc);
 
-    for (i = 1; i <= top; i++)
-    {  /* repeat for each level */
-        int t = lua_type(L, i);
-        switch (t)
-        {
-            case LUA_TSTRING:  /* strings */
-                printf("`%s'", lua_tostring(L, i));
-                break;
-    
-            case LUA_TBOOLEAN:  /* booleans */
-                printf(lua_toboolean(L, i) ? "true" : "false");
-                break;
-    
-            case LUA_TNUMBER:  /* numbers */
-                printf("%g", lua_tonumber(L, i));
-                break;
-    
-            default:  /* other values */
-                printf("%s", lua_typename(L, t));
-                break;
-        }
-        printf("  ");  /* put a separator */
-    }
-    printf("\n");  /* end the listing */
+    if (argc > 0) memcpy(a->argv, argv, argc * sizeof(t_atom));
 }
-#endif
-
-/* nw.js support. If this is non-NULL then we're running inside Jonathan
-   Wilkes' Pd-L2Ork variant and access to the GUI uses JavaScript. */
-static void (*nw_gui_vmess)(const char *sel, char *fmt, ...) = NULL;
 
-/** a handler for the open item in the right-click menu (mrpeach 20111025) */
-/** Here we find the lua code for the object and open it in an editor */
-static void pdlua_menu_open(t_pdlua *o)
+static t_pdlua_atoms *pdlua_toatoms(lua_State *L, int idx)
 {
-    const char  *name;
-    const char  *path;
-    char        pathname[FILENAME_MAX];
-    t_class     *class;
+    t_pdlua_atoms *a = NULL;
 
-    PDLUA_DEBUG("pdlua_menu_open stack top is %d", lua_gettop(__L));
-    /** Get the scriptname of the object */
-    lua_getglobal(__L, "pd");
-    lua_getfield(__L, -1, "_whoami");
-    lua_pushlightuserdata(__L, o);
-    if (lua_pcall(__L, 1, 1, 0))
-    {
-        pd_error(NULL, "lua: error in whoami:\n%s", lua_tostring(__L, -1));
-        lua_pop(__L, 2); /* pop the error string and the global "pd" */
-        return;
-    }
-    name = luaL_checkstring(__L, -1);
-    PDLUA_DEBUG3("pdlua_menu_open: L is %p, name is %s stack top is %d", __L, name, lua_gettop(__L));
-    if (name)
+    if (lua_type(L, idx) == LUA_TUSERDATA && lua_getmetatable(L, idx))
     {
-        if (name[strlen(name)-1] == 'x')
-        {
-            /* pdluax is a class, the particular file should loadable by name alone, we hope */
-            sprintf(pathname, "%s", name);
-            lua_pop(__L, 2); /* pop name and the global "pd" */
-        }
-        else
-        {
-            lua_getglobal(__L, "pd");
-            lua_getfield(__L, -1, "_get_class");
-            lua_pushlightuserdata(__L, o);
-            if (lua_pcall(__L, 1, 1, 0))
-            {
-                pd_error(NULL, "lua: error in get_class:\n%s", lua_tostring(__L, -1));
-                lua_pop(__L, 4); /* pop the error string, global "pd", name, global "pd"*/
-                return;
-            }
-            class = (t_class *)lua_touserdata(__L, -1);
-#if PLUGDATA
-            if (!*class->c_externdir->s_name)
-                path = plugdata_datadir;
-            else
-#endif
-            path = class->c_externdir->s_name;
-            sprintf(pathname, "%s/%s", path, name);
-            lua_pop(__L, 4); /* pop class, global "pd", name, global "pd"*/
-        }
-#if PD_MAJOR_VERSION==0 && PD_MINOR_VERSION<43
-        post("Opening %s for editing", pathname);
-#else
-        logpost(NULL, 3, "Opening %s for editing", pathname);
-#endif
-        if (nw_gui_vmess)
-          nw_gui_vmess("open_textfile", "s", pathname);
-        else
-          sys_vgui("::pd_menucommands::menu_openfile {%s}\n", pathname);
+        luaL_getmetatable(L, PDLUA_ATOMS_META);
+        if (lua_rawequal(L, -1, -2)) a = lua_touserdata(L, idx);
+        lua_pop(L, 2); /* pop both metatables */
     }
-    PDLUA_DEBUG("pdlua_menu_open end. stack top is %d", lua_gettop(__L));
+    return a;
 }
 
-/** Lua class registration. This is equivalent to the "setup" method for an ordinary Pd class */
-static int pdlua_class_new(lua_State *L)
+/** pd.Atoms indexing: atoms[i] converts the i-th atom, other keys are methods. */
+static int pdlua_atoms_index(lua_State *L)
 /**< Lua interpreter state.
   * \par Inputs:
-  * \li \c 1 Class name string.
+  * \li \c 1 pd.Atoms.
+  * \li \c 2 Index number (from 1), or method name.
   * \par Outputs:
-  * \li \c 1 Pd class pointer.
+  * \li \c 1 The atom as a number, string or pointer, nil if out of range, or the method.
   * */
 {
-    const char  *name;
-    t_class     *c;
-
-    name = luaL_checkstring(L, 1);
-    PDLUA_DEBUG3("pdlua_class_new: L is %p, name is %s stack top is %d", L, name, lua_gettop(L));
-    c = class_new(gensym((char *) name), (t_newmethod) pdlua_new,
-        (t_method) pdlua_free, sizeof(t_pdlua), CLASS_NOINLET, A_GIMME, 0);
-
-/* a class with a "menu-open" method will have the "Open" item highlighted in the right-click menu */
-    if (c)
-        class_addmethod(c, (t_method)pdlua_menu_open, gensym("menu-open"), A_NULL);/* (mrpeach 20111025) */
-/**/
+    t_pdlua_atoms *a = luaL_checkudata(L, 1, PDLUA_ATOMS_META);
 
-    lua_pushlightuserdata(L, c);
-    PDLUA_DEBUG("pdlua_class_new: end stack top is %d", lua_gettop(L));
+    if (lua_type(L, 2) == LUA_TNUMBER)
+    {
+        int i = lua_tonumber(L, 2);
+        if (1 <= i && i <= a->argc) pdlua_pushatom(L, &a->argv[i - 1]);
+        else lua_pushnil(L);
+    }
+    else
+    {
+        lua_pushvalue(L, 2);
+        lua_rawget(L, lua_upvalueindex(1)); /* the methods table */
+    }
     return 1;
 }
 
-/** Lua object creation. */
-static int pdlua_object_new(lua_State *L)
+/** pd.Atoms length. */
+static int pdlua_atoms_len(lua_State *L)
 /**< Lua interpreter state.
   * \par Inputs:
-  * \li \c 1 Pd class pointer.
+  * \li \c 1 pd.Atoms.
   * \par Outputs:
-  * \li \c 2 Pd object pointer.
+  * \li \c 1 Number of atoms.
   * */
 {
-    PDLUA_DEBUG("pdlua_object_new: stack top is %d", lua_gettop(L));
-    if (lua_islightuserdata(L, 1))
-    {
-        t_class *c = lua_touserdata(L, 1);
-        if (c)
-        {
-            PDLUA_DEBUG("pdlua_object_new: path is %s", c->c_externdir->s_name);
-            t_pdlua *o = (t_pdlua *) pd_new(c);
-            if (o)
-            {
-                o->inlets = 0;
-                o->in = NULL;
-                o->outlets = 0;
-                o->out = NULL;
-                o->canvas = canvas_getcurrent();
-                lua_pushlightuserdata(L, o);
-                PDLUA_DEBUG("pdlua_object_new: success end. stack top is %d", lua_gettop(L));
-                return 1;
-            }
-        }
-    }
-    PDLUA_DEBUG("pdlua_object_new: fail end. stack top is %d", lua_gettop(L));
-    return 0;
+    t_pdlua_atoms *a = luaL_checkudata(L, 1, PDLUA_ATOMS_META);
+
+    lua_pushnumber(L, a->argc);
+    return 1;
 }
 
-/** Lua object inlet creation. */
-static int pdlua_object_createinlets(lua_State *L)
+/** Convert pd.Atoms to a table, for when all of them are needed in Lua. */
+static int pdlua_atoms_table(lua_State *L)
 /**< Lua interpreter state.
   * \par Inputs:
-  * \li \c 1 Pd object pointer.
-  * \li \c 2 Number of inlets.
+  * \li \c 1 pd.Atoms.
+  * \par Outputs:
+  * \li \c 1 A new table of the atoms, as from a method without pd.Atoms.
   * */
 {
-    int i;
+    t_pdlua_atoms   *a = luaL_checkudata(L, 1, PDLUA_ATOMS_META);
+    int             i;
 
-    PDLUA_DEBUG("pdlua_object_createinlets: stack top is %d", lua_gettop(L));
-    if (lua_islightuserdata(L, 1))
+    lua_createtable(L, a->argc, 0);
+    for (i = 0; i < a->argc; i++)
     {
-        t_pdlua *o = lua_touserdata(L, 1);
-        if (o)
-        {
-            o->inlets = luaL_checknumber(L, 2);
-            o->in = malloc(o->inlets * sizeof(t_pdlua_proxyinlet));
-            for (i = 0; i < o->inlets; ++i)
-            {
-                pdlua_proxyinlet_init(&o->in[i], o, i);
-                inlet_new(&o->pd, &o->in[i].pd, 0, 0);
-            }
-        }
+        pdlua_pushatom(L, &a->argv[i]);
+        lua_rawseti(L, -2, i + 1);
     }
-    PDLUA_DEBUG("pdlua_object_createinlets: end. stack top is %d", lua_gettop(L));
-    return 0;
+    return 1;
 }
 
-/** Lua object outlet creation. */
-static int pdlua_object_createoutlets(lua_State *L)
+/** pd.Atoms as a string, like Pd prints a message. */
+static int pdlua_atoms_tostring(lua_State *L)
 /**< Lua interpreter state.
   * \par Inputs:
-  * \li \c 1 Pd object pointer.
-  * \li \c 2 Number of outlets.
+  * \li \c 1 pd.Atoms.
+  * \par Outputs:
+  * \li \c 1 The atoms separated by spaces.
   * */
 {
-    int i;
+    t_pdlua_atoms   *a = luaL_checkudata(L, 1, PDLUA_ATOMS_META);
+    luaL_Buffer     b;
+    char            buf[MAXPDSTRING];
+    int             i;
 
-    PDLUA_DEBUG("pdlua_object_createoutlets: stack top is %d", lua_gettop(L));
-    if (lua_islightuserdata(L, 1))
+    luaL_buffinit(L, &b);
+    for (i = 0; i < a->argc; i++)
     {
-        t_pdlua *o = lua_touserdata(L, 1);
-        if (o)
-        {
-            o->outlets = luaL_checknumber(L, 2);
-            if (o->outlets > 0)
-            {
-                o->out = malloc(o->outlets * sizeof(t_outlet *));
-                for (i = 0; i < o->outlets; ++i) o->out[i] = outlet_new(&o->pd, 0);
-            }
-            else o->out = NULL;
-        }
+        if (i) luaL_addchar(&b, ' ');
+        atom_string(&a->argv[i], buf, MAXPDSTRING);
+        luaL_addstring(&b, buf);
     }
-    PDLUA_DEBUG("pdlua_object_createoutlets: end stack top is %d", lua_gettop(L));
-    return 0;
+    luaL_pushresult(&b);
+    return 1;
 }
 
-/* get canvas path of an object */
-static int pdlua_object_canvaspath(lua_State *L)
+static int pdlua_atoms_new(lua_State *L)
 /**< Lua interpreter state.
   * \par Inputs:
-  * \li \c 1 Pd object pointer.
+  * \li \c 1 Table of numbers, strings and pointers (or pd.Atoms, which is copied).
   * \par Outputs:
-  * \li \c 1 Canvas path string.
+  * \li \c 1 pd.Atoms, or nothing if the table has other things in it.
   * */
 {
-    PDLUA_DEBUG("pdlua_object_canvaspath: stack top is %d", lua_gettop(L));
-    if (lua_islightuserdata(L, 1))
+    int     count = 0;
+    t_atom  *atoms;
+
+    PDLUA_DEBUG("pdlua_atoms_new: stack top is %d", lua_gettop(L));
+    lua_settop(L, 1);
+    atoms = pdlua_popatomtable(L, &count, NULL);
+    if (count > 0 && !atoms)
     {
-        t_pdlua *o = lua_touserdata(L, 1);
-        if (o)
-        {
-           lua_pushstring(L, canvas_getdir(o->canvas)->s_name);
-        }
+        PDLUA_DEBUG("pdlua_atoms_new: fail end. stack top is %d", lua_gettop(L));
+        return 0;
     }
-    PDLUA_DEBUG("pdlua_object_canvaspath: end stack top is %d", lua_gettop(L));
+    pdlua_pushatoms(L, count, atoms);
+    if (atoms) free(atoms);
+    PDLUA_DEBUG("pdlua_atoms_new: end. stack top is %d", lua_gettop(L));
     return 1;
 }
 
-/** Lua object receive creation. */
-static int pdlua_receive_new(lua_State *L)
-/**< Lua interpreter state.
-  * \par Inputs:
-  * \li \c 1 Pd object pointer.
-  * \li \c 2 Receive name string.
-  * \par Outputs:
-  * \li \c 1 Pd receive pointer.
-  * */
+/** Create the pd.Atoms metatable. */
+static void pdlua_atoms_setup(lua_State *L)
 {
-    PDLUA_DEBUG("pdlua_receive_new: stack top is %d", lua_gettop(L));
-    if (lua_islightuserdata(L, 1))
+    luaL_newmetatable(L, PDLUA_ATOMS_META);
+    lua_newtable(L); /* methods */
+    lua_pushcfunction(L, pdlua_atoms_table);
+    lua_setfield(L, -2, "table");
+    lua_pushcclosure(L, pdlua_atoms_index, 1);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, pdlua_atoms_len);
+    lua_setfield(L, -2, "__len");
+    lua_pushcfunction(L, pdlua_atoms_tostring);
+    lua_setfield(L, -2, "__tostring");
+    lua_pop(L, 1); /* pop the metatable */
+}
+
+/** Bytes for the OSC and binary packing functions. */
+typedef struct pdlua_bytes
+{
+    unsigned char   *buf; /**< The bytes. */
+    size_t          size; /**< Allocated size of buf. */
+    size_t          n; /**< Number of bytes in use. */
+} t_pdlua_bytes;
+
+/* kept from call to call, so that encoding a packet doesn't allocate */
+static t_pdlua_bytes pdlua_inbytes; /* byte list argument, unless it's a string */
+static t_pdlua_bytes pdlua_outbytes; /* result being put together */
+
+/** Append n bytes to a buffer, returning where they go. */
+static unsigned char *pdlua_bytes_add(t_pdlua_bytes *b, size_t n)
+{
+    unsigned char *p;
+
+    if (b->n + n > b->size)
     {
-        t_pdlua *o = lua_touserdata(L, 1);
-        if (o)
-        {
-            const char *name = luaL_checkstring(L, 2);
-            if (name)
-            {
-                t_pdlua_proxyreceive *r =  pdlua_proxyreceive_new(o, gensym((char *) name)); /* const cast */
-                lua_pushlightuserdata(L, r);
-                PDLUA_DEBUG("pdlua_receive_new: success end. stack top is %d", lua_gettop(L));
-                return 1;
-            }
-        }
+        size_t size = b->size ? b->size : 256;
+        while (size < b->n + n) size *= 2;
+        b->buf = b->buf ? resizebytes(b->buf, b->size, size) : getbytes(size);
+        b->size = size;
     }
-    PDLUA_DEBUG("pdlua_receive_new: fail end. stack top is %d", lua_gettop(L));
-    return 0;
+    p = b->buf + b->n;
+    b->n += n;
+    return p;
 }
 
-/** Lua object receive destruction. */
-static int pdlua_receive_free(lua_State *L)
-/**< Lua interpreter state.
-  * \par Inputs:
-  * \li \c 1 Pd recieve pointer.
-  * */
+static int pdlua_littleendian(void)
 {
-    PDLUA_DEBUG("pdlua_receive_free: stack top is %d", lua_gettop(L));
-    if (lua_islightuserdata(L, 1))
+    const uint16_t one = 1;
+    return *(const unsigned char *) &one;
+}
+
+/** Append an n byte integer. */
+static void pdlua_bytes_putint(t_pdlua_bytes *b, uint64_t v, size_t n, int little)
+{
+    unsigned char   *p = pdlua_bytes_add(b, n);
+    size_t          i;
+
+    for (i = 0; i < n; i++, v >>= 8) p[little ? i : n - 1 - i] = v & 0xff;
+}
+
+/** Read an n byte integer, sign extended if asked for. */
+static uint64_t pdlua_bytes_getint(const unsigned char *p, size_t n, int little, int sign)
+{
+    uint64_t    v = 0;
+    size_t      i;
+
+    for (i = 0; i < n; i++) v = (v << 8) | p[little ? n - 1 - i : i];
+    if (sign && n < 8 && (v >> (8 * n - 1)) & 1) v |= ~(uint64_t) 0 << (8 * n);
+    return v;
+}
+
+/** Append a 4 or 8 byte IEEE floating point number. */
+static void pdlua_bytes_putfloat(t_pdlua_bytes *b, double f, size_t n, int little)
+{
+    if (n == 4)
     {
-        t_pdlua_proxyreceive *r = lua_touserdata(L, 1);
-        if (r) pdlua_proxyreceive_free(r);
+        float       x = f;
+        uint32_t    u;
+        memcpy(&u, &x, 4);
+        pdlua_bytes_putint(b, u, 4, little);
+    }
+    else
+    {
+        uint64_t    u;
+        memcpy(&u, &f, 8);
+        pdlua_bytes_putint(b, u, 8, little);
     }
-    PDLUA_DEBUG("pdlua_receive_free: end. stack top is %d", lua_gettop(L));
-    return 0;
 }
 
-/** Lua object clock creation. */
-static int pdlua_clock_new(lua_State *L)
-/**< Lua interpreter state.
-  * \par Inputs:
-  * \li \c 1 Pd object pointer.
-  * \par Outputs:
-  * \li \c 1 Pd clock pointer.
-  * */
+/** Read a 4 or 8 byte IEEE floating point number. */
+static double pdlua_bytes_getfloat(const unsigned char *p, size_t n, int little)
 {
-    PDLUA_DEBUG("pdlua_clock_new: stack top is %d", lua_gettop(L));
-    if (lua_islightuserdata(L, 1))
+    uint64_t    u = pdlua_bytes_getint(p, n, little, 0);
+
+    if (n == 4)
     {
-        t_pdlua *o = lua_touserdata(L, 1);
-        if (o)
-        {
-            t_pdlua_proxyclock *c =  pdlua_proxyclock_new(o);
-            lua_pushlightuserdata(L, c);
-            PDLUA_DEBUG("pdlua_clock_new: success end. stack top is %d", lua_gettop(L));
-            return 1;
-        }
+        uint32_t    v = u;
+        float       x;
+        memcpy(&x, &v, 4);
+        return x;
+    }
+    else
+    {
+        double      x;
+        memcpy(&x, &u, 8);
+        return x;
     }
-    PDLUA_DEBUG("pdlua_clock_new: fail end. stack top is %d", lua_gettop(L));
-    return 0;
 }
 
-/** Lua proxy clock delay. */
-static int pdlua_clock_delay(lua_State *L)
-/**< Lua interpreter state.
-  * \par Inputs:
-  * \li \c 1 Pd clock pointer.
-  * \li \c 2 Number of milliseconds to delay.
-  * */
+/** Whether a number is a byte, an integer 0..255. */
+static int pdlua_isbyte(double v)
 {
-    PDLUA_DEBUG("pdlua_clock_delay: stack top is %d", lua_gettop(L));
-    if (lua_islightuserdata(L, 1))
+    return v >= 0 && v <= 255 && v == (int) v;
+}
+
+/** Get the bytes of a byte list argument: pd.Atoms or a table of numbers
+ * 0..255, or a string. Returns NULL (after an error message) if it's none
+ * of these. Tables and pd.Atoms go through pdlua_inbytes, strings are
+ * used as they are. */
+static const unsigned char *pdlua_checkbytes
+(
+    lua_State   *L, /**< Lua interpreter state. */
+    int         idx, /**< Stack index (> 0) of the byte list. */
+    size_t      *n, /**< Where to store the number of bytes. */
+    const char  *fn /**< Function name for error messages. */
+)
+{
+    t_pdlua_atoms   *a;
+    unsigned char   *p;
+    size_t          i;
+
+    if ((a = pdlua_toatoms(L, idx)))
     {
-        t_pdlua_proxyclock *c = lua_touserdata(L, 1);
-        if (c)
+        pdlua_inbytes.n = 0;
+        p = pdlua_bytes_add(&pdlua_inbytes, a->argc);
+        for (i = 0; i < (size_t) a->argc; i++)
         {
-            double delaytime = luaL_checknumber(L, 2);
-            clock_delay(c->clock, delaytime);
+            if (a->argv[i].a_type != A_FLOAT)
+            {
+                pd_error(NULL, "lua: error: %s: byte %lu is not a float", fn, (unsigned long) i + 1);
+                return NULL;
+            }
+            if (!pdlua_isbyte(a->argv[i].a_w.w_float))
+            {
+                pd_error(NULL, "lua: error: %s: byte %lu is out of range", fn, (unsigned long) i + 1);
+                return NULL;
+            }
+            p[i] = (int) a->argv[i].a_w.w_float;
         }
+        *n = a->argc;
+        return pdlua_inbytes.buf;
     }
-    PDLUA_DEBUG("pdlua_clock_delay: end. stack top is %d", lua_gettop(L));
-    return 0;
+    else if (lua_type(L, idx) == LUA_TTABLE)
+    {
+#if LUA_VERSION_NUM	< 502
+        *n = lua_objlen(L, idx);
+#else // 5.2 style
+        *n = lua_rawlen(L, idx);
+#endif // LUA_VERSION_NUM	< 502
+        pdlua_inbytes.n = 0;
+        p = pdlua_bytes_add(&pdlua_inbytes, *n);
+        for (i = 0; i < *n; i++)
+        {
+            lua_rawgeti(L, idx, i + 1);
+            if (lua_type(L, -1) != LUA_TNUMBER)
+            {
+                lua_pop(L, 1);
+                pd_error(NULL, "lua: error: %s: byte %lu is not a number", fn, (unsigned long) i + 1);
+                return NULL;
+            }
+            if (!pdlua_isbyte(lua_tonumber(L, -1)))
+            {
+                lua_pop(L, 1);
+                pd_error(NULL, "lua: error: %s: byte %lu is out of range", fn, (unsigned long) i + 1);
+                return NULL;
+            }
+            p[i] = (int) lua_tonumber(L, -1);
+            lua_pop(L, 1);
+        }
+        return pdlua_inbytes.buf;
+    }
+    else if (lua_type(L, idx) == LUA_TSTRING)
+        return (const unsigned char *) lua_tolstring(L, idx, n);
+    pd_error(NULL, "lua: error: %s: expected a byte list (pd.Atoms, table or string)", fn);
+    return NULL;
 }
 
-/** Lua proxy clock set. */
-static int pdlua_clock_set(lua_State *L)
-/**< Lua interpreter state.
-  * \par Inputs:
-  * \li \c 1 Pd clock pointer.
-  * \li \c 2 Number to set the clock.
-  * */
+/** Push bytes as pd.Atoms of floats 0..255. */
+static void pdlua_pushbytes(lua_State *L, const unsigned char *p, size_t n)
 {
-    PDLUA_DEBUG("pdlua_clock_set: stack top is %d", lua_gettop(L));
-    if (lua_islightuserdata(L, 1))
+    t_pdlua_atoms   *a = pdlua_newatoms(L, n);
+    size_t          i;
+
+    for (i = 0; i < n; i++) SETFLOAT(&a->argv[i], p[i]);
+}
+
+/** Get the number after a pack format option, or def if there is none. */
+static size_t pdlua_packsize(const char **fmt, size_t def)
+{
+    size_t  n = 0;
+
+    if (**fmt < '0' || **fmt > '9') return def;
+    while (**fmt >= '0' && **fmt <= '9' && n < 0x10000000) n = n * 10 + *(*fmt)++ - '0';
+    return n;
+}
+
+/** Get the next option of a pack format, setting its size in bytes and the
+ * byte order. Returns 0 at the end of the format, and -1 (after an error
+ * message) for options that aren't supported. */
+static int pdlua_packoption(const char **fmt, int *little, size_t *size, const char *fn)
+{
+    int     c;
+
+    for (;;)
     {
-        t_pdlua_proxyclock *c = lua_touserdata(L, 1);
-        if (c)
+        switch ((c = *(*fmt)++))
         {
-            double systime = luaL_checknumber(L, 2);
-            clock_set(c->clock, systime);
+            case 0:
+                (*fmt)--;
+                return 0;
+            case ' ':
+                break;
+            case '<':
+                *little = 1;
+                break;
+            case '>':
+                *little = 0;
+                break;
+            case '=':
+                *little = pdlua_littleendian();
+                break;
+            case '!': /* nothing is aligned, so the maximum alignment doesn't matter */
+                pdlua_packsize(fmt, 0);
+                break;
+            case 'b': case 'B': case 'x':
+                *size = 1;
+                return c;
+            case 'h': case 'H':
+                *size = 2;
+                return c;
+            case 'l': case 'L':
+                *size = sizeof(long);
+                return c;
+            case 'j': case 'J':
+                *size = 8;
+                return c;
+            case 'T':
+                *size = sizeof(size_t);
+                return c;
+            case 'f':
+                *size = 4;
+                return c;
+            case 'd':
+                *size = 8;
+                return c;
+            case 'n':
+                *size = sizeof(lua_Number) == 4 ? 4 : 8;
+                return c;
+            case 'z':
+                *size = 0;
+                return c;
+            case 'i': case 'I': case 's':
+                *size = pdlua_packsize(fmt, c == 's' ? sizeof(size_t) : sizeof(int));
+                if (*size < 1 || *size > 8)
+                {
+                    pd_error(NULL, "lua: error: %s: size of '%c' must be 1 to 8 bytes", fn, c);
+                    return -1;
+                }
+                return c;
+            case 'c':
+                *size = pdlua_packsize(fmt, (size_t) -1);
+                if (*size == (size_t) -1)
+                {
+                    pd_error(NULL, "lua: error: %s: missing size for format option 'c'", fn);
+                    return -1;
+                }
+                return c;
+            default:
+                pd_error(NULL, "lua: error: %s: invalid format option '%c'", fn, c);
+                return -1;
         }
     }
-    PDLUA_DEBUG("pdlua_clock_set: end. stack top is %d", lua_gettop(L));
-    return 0;
 }
 
-/** Lua proxy clock unset. */
-static int pdlua_clock_unset(lua_State *L)
+/** Pack values into bytes, like string.pack. */
+static int pdlua_pack(lua_State *L)
 /**< Lua interpreter state.
   * \par Inputs:
-  * \li \c 1 Pd clock pointer.
+  * \li \c 1 Format string, with string.pack's options.
+  * \li \c 2... The values to pack.
+  * \par Outputs:
+  * \li \c 1 pd.Atoms of floats 0..255, or nil for failure.
   * */
 {
-    PDLUA_DEBUG("pdlua_clock_unset: stack top is %d", lua_gettop(L));
-    if (lua_islightuserdata(L, 1))
+    const char      *fmt = luaL_checkstring(L, 1);
+    t_pdlua_bytes   *b = &pdlua_outbytes;
+    int             little = pdlua_littleendian();
+    int             arg = 2, opt;
+    size_t          size, len;
+    const char      *s;
+    unsigned char   *p;
+
+    PDLUA_DEBUG("pdlua_pack: stack top %d", lua_gettop(L));
+    b->n = 0;
+    while ((opt = pdlua_packoption(&fmt, &little, &size, "pack")) > 0)
     {
-        t_pdlua_proxyclock *c = lua_touserdata(L, 1);
-        if (c) clock_unset(c->clock);
+        switch (opt)
+        {
+            case 'x':
+                *pdlua_bytes_add(b, 1) = 0;
+                continue;
+            case 'f': case 'd': case 'n':
+                if (lua_type(L, arg) != LUA_TNUMBER) goto bad;
+                pdlua_bytes_putfloat(b, lua_tonumber(L, arg++), size, little);
+                continue;
+            case 's': case 'z': case 'c':
+                if (!lua_isstring(L, arg)) goto bad;
+                s = lua_tolstring(L, arg++, &len);
+                if (opt == 's')
+                {
+                    if (size < 8 && len >> (8 * size))
+                    {
+                        pd_error(NULL, "lua: error: pack: string too long for its length prefix");
+                        return 0;
+                    }
+                    pdlua_bytes_putint(b, len, size, little);
+                    memcpy(pdlua_bytes_add(b, len), s, len);
+                }
+                else if (opt == 'z')
+                {
+                    if (strlen(s) != len)
+                    {
+                        pd_error(NULL, "lua: error: pack: string for format option 'z' contains zeros");
+                        return 0;
+                    }
+                    memcpy(pdlua_bytes_add(b, len + 1), s, len + 1);
+                }
+                else
+                {
+                    if (len > size)
+                    {
+                        pd_error(NULL, "lua: error: pack: string longer than the size of 'c%lu'", (unsigned long) size);
+                        return 0;
+                    }
+                    p = pdlua_bytes_add(b, size);
+                    memcpy(p, s, len);
+                    memset(p + len, 0, size - len);
+                }
+                continue;
+            default: /* integers, the unsigned ones are in upper case */
+            {
+                int64_t     v;
+                int         big = 0; /* v is unsigned 64 bit, beyond int64_t */
+                int         isunsigned = opt < 'a';
+                if (lua_type(L, arg) != LUA_TNUMBER) goto bad;
+#if LUA_VERSION_NUM	>= 503
+                if (lua_isinteger(L, arg)) v = lua_tointeger(L, arg);
+                else
+#endif // LUA_VERSION_NUM	>= 503
+                {
+                    lua_Number  d = lua_tonumber(L, arg);
+                    if (d >= 9223372036854775808.0 && d < 18446744073709551616.0)
+                        v = (int64_t) (uint64_t) d, big = 1;
+                    else if (d >= -9223372036854775808.0 && d < 9223372036854775808.0)
+                        v = (int64_t) d;
+                    else goto overflow;
+                }
+                /* the same ranges as string.pack, but no negative unsigned ones */
+                if (isunsigned ? !big && (v < 0 || (size < 8 && v >= (int64_t) 1 << (8 * size)))
+                    : big || (size < 8 && (v < -((int64_t) 1 << (8 * size - 1)) || v >= (int64_t) 1 << (8 * size - 1))))
+                    goto overflow;
+                pdlua_bytes_putint(b, (uint64_t) v, size, little);
+                arg++;
+                continue;
+            }
+        }
     }
-    PDLUA_DEBUG("pdlua_clock_unset: end. stack top is %d", lua_gettop(L));
+    if (opt < 0) return 0;
+    pdlua_pushbytes(L, b->buf, b->n);
+    PDLUA_DEBUG("pdlua_pack: end. stack top %d", lua_gettop(L));
+    return 1;
+bad:
+    pd_error(NULL, "lua: error: pack: bad value #%d for format option '%c'", arg - 1, opt);
+    return 0;
+overflow:
+    pd_error(NULL, "lua: error: pack: value #%d doesn't fit in a%s %lu byte integer", arg - 1,
+        opt < 'a' ? "n unsigned" : " signed", (unsigned long) size);
     return 0;
 }
 
-/** Lua proxy clock destruction. */
-static int pdlua_clock_free(lua_State *L)
+/** Unpack values from bytes, like string.unpack. */
+static int pdlua_unpack(lua_State *L)
 /**< Lua interpreter state.
   * \par Inputs:
-  * \li \c 1 Pd clock pointer.
+  * \li \c 1 Format string, with string.pack's options.
+  * \li \c 2 Byte list: pd.Atoms, table of numbers 0..255, or string.
+  * \li \c 3 Optional position (from 1) to start at.
+  * \par Outputs:
+  * \li \c 1... The values, then the position after the last byte read, or
+  * nothing for failure.
   * */
 {
-    PDLUA_DEBUG("pdlua_clock_free: stack top is %d", lua_gettop(L));
-    if (lua_islightuserdata(L, 1))
+    const char          *fmt = luaL_checkstring(L, 1);
+    const unsigned char *p;
+    const unsigned char *z;
+    int                 little = pdlua_littleendian();
+    int                 opt, nres = 0;
+    size_t              n, pos, size, len;
+    lua_Number          start = luaL_optnumber(L, 3, 1);
+    uint64_t            v;
+
+    PDLUA_DEBUG("pdlua_unpack: stack top %d", lua_gettop(L));
+    if (!(p = pdlua_checkbytes(L, 2, &n, "unpack"))) return 0;
+    if (start < 1 || start > n + 1)
     {
-        t_pdlua_proxyclock *c = lua_touserdata(L, 1);
-        if (c)
+        pd_error(NULL, "lua: error: unpack: position %g out of range", (double) start);
+        return 0;
+    }
+    pos = start - 1;
+    while ((opt = pdlua_packoption(&fmt, &little, &size, "unpack")) > 0)
+    {
+        if (n - pos < size) goto short_data;
+        luaL_checkstack(L, 2, "too many values to unpack");
+        switch (opt)
         {
-            clock_free(c->clock);
-            free(c);
+            case 'x':
+                break;
+            case 'f': case 'd': case 'n':
+                lua_pushnumber(L, pdlua_bytes_getfloat(p + pos, size, little));
+                nres++;
+                break;
+            case 'c':
+                lua_pushlstring(L, (const char *) p + pos, size);
+                nres++;
+                break;
+            case 's':
+                v = pdlua_bytes_getint(p + pos, size, little, 0);
+                pos += size;
+                if (v > n - pos) goto short_data;
+                lua_pushlstring(L, (const char *) p + pos, v);
+                nres++;
+                pos += v;
+                continue;
+            case 'z':
+                if (!(z = memchr(p + pos, 0, n - pos))) goto short_data;
+                len = z - (p + pos);
+                lua_pushlstring(L, (const char *) p + pos, len);
+                nres++;
+                pos += len + 1;
+                continue;
+            default: /* integers, signed ones in lower case */
+                v = pdlua_bytes_getint(p + pos, size, little, opt >= 'a');
+#if LUA_VERSION_NUM	>= 503
+                lua_pushinteger(L, (lua_Integer) v);
+#else // lua_Integer may be too small
+                if (opt >= 'a') lua_pushnumber(L, (lua_Number) (int64_t) v);
+                else lua_pushnumber(L, (lua_Number) v);
+#endif // LUA_VERSION_NUM	>= 503
+                nres++;
+                break;
         }
+        pos += size;
     }
-    PDLUA_DEBUG("pdlua_clock_free: end. stack top is %d", lua_gettop(L));
+    if (opt < 0)
+    {
+        lua_pop(L, nres);
+        return 0;
+    }
+    lua_pushnumber(L, pos + 1);
+    PDLUA_DEBUG("pdlua_unpack: end. stack top %d", lua_gettop(L));
+    return nres + 1;
+short_data:
+    lua_pop(L, nres);
+    pd_error(NULL, "lua: error: unpack: data too short for format option '%c'", opt);
     return 0;
 }
 
-/** Lua object destruction. */
-static int pdlua_object_free(lua_State *L)
+/** Append an OSC string, with its terminating zero and padding. */
+static void pdlua_osc_putstring(t_pdlua_bytes *b, const char *s, size_t len)
+{
+    size_t          padded = (len + 4) & ~(size_t) 3;
+    unsigned char   *p = pdlua_bytes_add(b, padded);
+
+    memcpy(p, s, len);
+    memset(p + len, 0, padded - len);
+}
+
+/** Read an OSC string, returning where it ends (with the padding), or NULL
+ * if it isn't terminated in the packet. */
+static const unsigned char *pdlua_osc_getstring(const unsigned char *p, const unsigned char *end, size_t *len)
+{
+    const unsigned char *z = memchr(p, 0, end - p);
+
+    if (!z) return NULL;
+    *len = z - p;
+    p += (*len + 4) & ~(size_t) 3;
+    return p > end ? NULL : p;
+}
+
+/** Whether a number is an unsigned 32 bit integer, like the words of a time tag. */
+static int pdlua_isword(double v)
+{
+    return v >= 0 && v < 4294967296.0 && v == (double) (uint64_t) v;
+}
+
+/** Append an OSC time tag, from seconds since 1900 (0 for immediately). */
+static void pdlua_osc_puttime(t_pdlua_bytes *b, double t)
+{
+    if (t <= 0)
+        pdlua_bytes_putint(b, 1, 8, 0);
+    else
+    {
+        uint64_t    sec = t;
+        pdlua_bytes_putint(b, sec, 4, 0);
+        pdlua_bytes_putint(b, (uint64_t) ((t - sec) * 4294967296.0), 4, 0);
+    }
+}
+
+/** Read an OSC time tag, as seconds since 1900 (0 for immediately). */
+static double pdlua_osc_gettime(const unsigned char *p)
+{
+    uint64_t    v = pdlua_bytes_getint(p, 8, 0, 0);
+
+    return v == 1 ? 0 : (v >> 32) + (v & 0xffffffff) / 4294967296.0;
+}
+
+/** Encode a message as an OSC packet. */
+static int pdlua_oscencode(lua_State *L)
 /**< Lua interpreter state.
   * \par Inputs:
-  * \li \c 1 Pd object pointer.
+  * \li \c 1 OSC address string.
+  * \li \c 2 Arguments: pd.Atoms or a table of numbers and strings.
+  * \li \c 3 Optional type tag string (without the comma), default is "f"
+  * for each float and "s" for each symbol.
+  * \par Outputs:
+  * \li \c 1 The packet as pd.Atoms of floats 0..255, or nil for failure.
   * */
 {
-    int i;
+    size_t          len;
+    const char      *address = luaL_checklstring(L, 1, &len);
+    const char      *types = lua_isstring(L, 3) ? lua_tostring(L, 3) : NULL;
+    t_pdlua_bytes   *b = &pdlua_outbytes;
+    t_pdlua_atoms   *a = pdlua_toatoms(L, 2);
+    t_atom          *at;
+    int             i, t, tag;
+    unsigned char   *p;
 
-    PDLUA_DEBUG("pdlua_object_free: stack top is %d", lua_gettop(L));
-    if (lua_islightuserdata(L, 1))
+    PDLUA_DEBUG("pdlua_oscencode: stack top %d", lua_gettop(L));
+    if (!a)
     {
-        t_pdlua *o = lua_touserdata(L, 1);
-        if (o)
+        /* tables are converted to pd.Atoms first, which the GC takes care of */
+        int     count = 0;
+        t_atom  *atoms;
+        lua_pushvalue(L, 2);
+        atoms = pdlua_popatomtable(L, &count, NULL);
+        if (count > 0 && !atoms) return 0;
+        pdlua_pushatoms(L, count, atoms);
+        if (atoms) free(atoms);
+        a = lua_touserdata(L, -1);
+    }
+    b->n = 0;
+    pdlua_osc_putstring(b, address, len);
+    if (types)
+    {
+        if (*types == ',') types++;
+        len = strlen(types);
+        p = pdlua_bytes_add(b, (len + 5) & ~(size_t) 3);
+        *p++ = ',';
+        memcpy(p, types, len);
+        memset(p + len, 0, 4 - (len + 1) % 4);
+    }
+    else
+    {
+        p = pdlua_bytes_add(b, (a->argc + 5) & ~3);
+        *p++ = ',';
+        for (i = 0; i < a->argc; i++)
         {
-            if (o->in) free(o->in);
-            if(o->out)
+            if (a->argv[i].a_type == A_FLOAT) *p++ = 'f';
+            else if (a->argv[i].a_type == A_SYMBOL) *p++ = 's';
+            else
             {
-                for (i = 0; i < o->outlets; ++i) outlet_free(o->out[i]);
-                free(o->out);
-                o->out = NULL;
+                pd_error(NULL, "lua: error: oscencode: argument %d is neither a float nor a symbol", i + 1);
+                return 0;
             }
         }
+        memset(p, 0, 4 - (a->argc + 1) % 4);
     }
-    PDLUA_DEBUG("pdlua_object_free: end. stack top is %d", lua_gettop(L));
+    for (i = t = 0; (tag = types ? types[t] : (t < a->argc ? (a->argv[t].a_type == A_FLOAT ? 'f' : 's') : 0)); t++)
+    {
+        if (strchr("TFNI[]", tag)) continue; /* no data */
+        if (i >= a->argc)
+        {
+            pd_error(NULL, "lua: error: oscencode: no argument left for type tag '%c'", tag);
+            return 0;
+        }
+        at = &a->argv[i++];
+        if (tag == 's' || tag == 'S')
+        {
+            if (at->a_type != A_SYMBOL) goto bad;
+            pdlua_osc_putstring(b, at->a_w.w_symbol->s_name, strlen(at->a_w.w_symbol->s_name));
+            continue;
+        }
+        if (at->a_type != A_FLOAT) goto bad;
+        switch (tag)
+        {
+            case 'i': case 'c': case 'r':
+                pdlua_bytes_putint(b, (uint64_t) (int64_t) at->a_w.w_float, 4, 0);
+                break;
+            case 'h':
+                pdlua_bytes_putint(b, (uint64_t) (int64_t) at->a_w.w_float, 8, 0);
+                break;
+            case 'f':
+                pdlua_bytes_putfloat(b, at->a_w.w_float, 4, 0);
+                break;
+            case 'd':
+                pdlua_bytes_putfloat(b, at->a_w.w_float, 8, 0);
+                break;
+            case 't': /* seconds since 1900, then the fraction of a second in 1/2^32 */
+                if (i >= a->argc || a->argv[i].a_type != A_FLOAT) goto bad;
+                if (!pdlua_isword(at->a_w.w_float) || !pdlua_isword(a->argv[i].a_w.w_float))
+                {
+                    pd_error(NULL, "lua: error: oscencode: time tag words must be integers 0..2^32-1");
+                    return 0;
+                }
+                pdlua_bytes_putint(b, (uint64_t) at->a_w.w_float, 4, 0);
+                pdlua_bytes_putint(b, (uint64_t) a->argv[i++].a_w.w_float, 4, 0);
+                break;
+            case 'b': /* byte count, then the bytes */
+            {
+                int     n = at->a_w.w_float, j;
+                if (n < 0 || n > a->argc - i)
+                {
+                    pd_error(NULL, "lua: error: oscencode: blob of %d bytes doesn't match the arguments", n);
+                    return 0;
+                }
+                pdlua_bytes_putint(b, n, 4, 0);
+                p = pdlua_bytes_add(b, (n + 3) & ~3);
+                for (j = 0; j < n; j++, i++)
+                {
+                    if (a->argv[i].a_type != A_FLOAT) goto bad;
+                    if (!pdlua_isbyte(a->argv[i].a_w.w_float))
+                    {
+                        pd_error(NULL, "lua: error: oscencode: byte %d of blob is out of range", j + 1);
+                        return 0;
+                    }
+                    p[j] = (int) a->argv[i].a_w.w_float;
+                }
+                memset(p + n, 0, ((n + 3) & ~3) - n);
+                break;
+            }
+            default:
+                pd_error(NULL, "lua: error: oscencode: unsupported type tag '%c'", tag);
+                return 0;
+        }
+    }
+    if (i < a->argc)
+    {
+        pd_error(NULL, "lua: error: oscencode: more arguments than type tags");
+        return 0;
+    }
+    pdlua_pushbytes(L, b->buf, b->n);
+    PDLUA_DEBUG("pdlua_oscencode: end. stack top %d", lua_gettop(L));
+    return 1;
+bad:
+    pd_error(NULL, "lua: error: oscencode: argument %d doesn't match type tag '%c'", i, tag);
     return 0;
 }
 
-/** Dispatch Pd inlet messages to Lua objects. */
-static void pdlua_dispatch
+/** Convert the arguments of an OSC message to atoms, or just count them if
+ * argv is NULL. Returns the number of atoms, or -1 (after an error message)
+ * for a damaged packet. */
+static int pdlua_osc_getargs
 (
-    t_pdlua         *o, /**< The object that received the message. */
-    unsigned int    inlet, /**< The inlet that the message arrived at. */
-    t_symbol        *s, /**< The message selector. */
-    int             argc, /**< The message length. */
-    t_atom          *argv /**< The atoms in the message. */
+    const char          *tags, /**< Type tags, without the comma. */
+    size_t              ntags, /**< Number of type tags. */
+    const unsigned char *p, /**< Start of the argument data. */
+    const unsigned char *end, /**< End of the packet. */
+    t_atom              *argv /**< Where to store the atoms, or NULL. */
 )
 {
-    PDLUA_DEBUG("pdlua_dispatch: stack top %d", lua_gettop(__L));
-    lua_getglobal(__L, "pd");
-    lua_getfield (__L, -1, "_dispatcher");
-    lua_pushlightuserdata(__L, o);
-    lua_pushnumber(__L, inlet + 1); /* C has 0.., Lua has 1.. */
+    int                 argc = 0;
+    size_t              t, len;
+    const unsigned char *q;
+
+    for (t = 0; t < ntags; t++)
+    {
+        switch (tags[t])
+        {
+            case 'i': case 'c': case 'r': case 'f':
+                if (end - p < 4) goto damaged;
+                if (argv)
+                {
+                    if (tags[t] == 'f') SETFLOAT(&argv[argc], pdlua_bytes_getfloat(p, 4, 0));
+                    else SETFLOAT(&argv[argc], (int64_t) pdlua_bytes_getint(p, 4, 0, tags[t] != 'r'));
+                }
+                argc++;
+                p += 4;
+                break;
+            case 'h': case 'd':
+                if (end - p < 8) goto damaged;
+                if (argv)
+                {
+                    if (tags[t] == 'h') SETFLOAT(&argv[argc], (int64_t) pdlua_bytes_getint(p, 8, 0, 1));
+                    else SETFLOAT(&argv[argc], pdlua_bytes_getfloat(p, 8, 0));
+                }
+                argc++;
+                p += 8;
+                break;
+            case 't': /* the seconds and the fraction, one float won't do */
+                if (end - p < 8) goto damaged;
+                if (argv)
+                {
+                    SETFLOAT(&argv[argc], pdlua_bytes_getint(p, 4, 0, 0));
+                    SETFLOAT(&argv[argc + 1], pdlua_bytes_getint(p + 4, 4, 0, 0));
+                }
+                argc += 2;
+                p += 8;
+                break;
+            case 's': case 'S':
+                if (!(q = pdlua_osc_getstring(p, end, &len))) goto damaged;
+                if (argv) SETSYMBOL(&argv[argc], gensym((const char *) p));
+                argc++;
+                p = q;
+                break;
+            case 'b': /* byte count, then the bytes */
+                if (end - p < 4) goto damaged;
+                len = pdlua_bytes_getint(p, 4, 0, 0);
+                p += 4;
+                if ((size_t) (end - p) < ((len + 3) & ~(size_t) 3)) goto damaged;
+                if (argv)
+                {
+                    size_t  j;
+                    SETFLOAT(&argv[argc], len);
+                    for (j = 0; j < len; j++) SETFLOAT(&argv[argc + 1 + j], p[j]);
+                }
+                argc += 1 + len;
+                p += (len + 3) & ~(size_t) 3;
+                break;
+            case 'T': case 'F':
+                if (argv) SETFLOAT(&argv[argc], tags[t] == 'T');
+                argc++;
+                break;
+            case 'N': case 'I': case '[': case ']':
+                break;
+            default:
+                pd_error(NULL, "lua: error: oscdecode: unsupported type tag '%c'", tags[t]);
+                return -1;
+        }
+    }
+    return argc;
+damaged:
+    pd_error(NULL, "lua: error: oscdecode: packet too short for its type tags");
+    return -1;
+}
+
+/** Decode an OSC packet. */
+static int pdlua_oscdecode(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 The packet: pd.Atoms, table of numbers 0..255, or string.
+  * \par Outputs:
+  * \li \c 1 The OSC address, or "#bundle".
+  * \li \c 2 The arguments as pd.Atoms, or for a bundle its time tag.
+  * \li \c 3 For a bundle, a table of its packets as pd.Atoms.
+  * Nothing for failure.
+  * */
+{
+    size_t              n, len, ntags = 0;
+    const unsigned char *p = pdlua_checkbytes(L, 1, &n, "oscdecode");
+    const unsigned char *end;
+    const unsigned char *q;
+    const char          *tags = "";
+    t_pdlua_atoms       *a;
+    int                 argc, i;
+
+    PDLUA_DEBUG("pdlua_oscdecode: stack top %d", lua_gettop(L));
+    if (!p) return 0;
+    end = p + n;
+    if (n >= 16 && !memcmp(p, "#bundle", 8))
+    {
+        lua_pushstring(L, "#bundle");
+        lua_pushnumber(L, pdlua_osc_gettime(p + 8));
+        lua_newtable(L);
+        for (p += 16, i = 1; p < end; p += len, i++)
+        {
+            if (end - p < 4 || (len = pdlua_bytes_getint(p, 4, 0, 0)) > (size_t) (end - p - 4))
+            {
+                lua_pop(L, 3);
+                pd_error(NULL, "lua: error: oscdecode: bundle element too short");
+                return 0;
+            }
+            p += 4;
+            pdlua_pushbytes(L, p, len);
+            lua_rawseti(L, -2, i);
+        }
+        return 3;
+    }
+    if (!(q = pdlua_osc_getstring(p, end, &len)))
+    {
+        pd_error(NULL, "lua: error: oscdecode: no address in packet");
+        return 0;
+    }
+    if (q < end && *q == ',')
+    {
+        tags = (const char *) q + 1;
+        if (!(q = pdlua_osc_getstring(q, end, &ntags)))
+        {
+            pd_error(NULL, "lua: error: oscdecode: type tags not terminated");
+            return 0;
+        }
+        ntags--;
+    }
+    if ((argc = pdlua_osc_getargs(tags, ntags, q, end, NULL)) < 0) return 0;
+    lua_pushlstring(L, (const char *) p, len);
+    a = pdlua_newatoms(L, argc);
+    pdlua_osc_getargs(tags, ntags, q, end, a->argv);
+    PDLUA_DEBUG("pdlua_oscdecode: end. stack top %d", lua_gettop(L));
+    return 2;
+}
+
+/** Put OSC packets together in a bundle. */
+static int pdlua_oscbundle(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Time tag, in seconds since 1900 (0 for immediately).
+  * \li \c 2 Table of packets (pd.Atoms, tables of numbers 0..255, or strings).
+  * \par Outputs:
+  * \li \c 1 The bundle as pd.Atoms of floats 0..255, or nil for failure.
+  * */
+{
+    t_pdlua_bytes       *b = &pdlua_outbytes;
+    const unsigned char *p;
+    size_t              len;
+    int                 i;
+
+    PDLUA_DEBUG("pdlua_oscbundle: stack top %d", lua_gettop(L));
+    luaL_checktype(L, 2, LUA_TTABLE);
+    b->n = 0;
+    memcpy(pdlua_bytes_add(b, 8), "#bundle", 8);
+    pdlua_osc_puttime(b, lua_tonumber(L, 1));
+    for (i = 1; lua_rawgeti(L, 2, i), !lua_isnil(L, -1); i++)
+    {
+        if (!(p = pdlua_checkbytes(L, lua_gettop(L), &len, "oscbundle"))) return 0;
+        if (len % 4)
+        {
+            pd_error(NULL, "lua: error: oscbundle: packet %d isn't a multiple of 4 bytes", i);
+            return 0;
+        }
+        pdlua_bytes_putint(b, len, 4, 0);
+        memcpy(pdlua_bytes_add(b, len), p, len);
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    pdlua_pushbytes(L, b->buf, b->n);
+    PDLUA_DEBUG("pdlua_oscbundle: end. stack top %d", lua_gettop(L));
+    return 1;
+}
+
+/* reused by pd.parse() and pd.format() */
+static t_binbuf *pdlua_textbuf;
+
+/** Push parsed atoms as a table, or pd.Atoms if raw. */
+static void pdlua_pushbinbuf(lua_State *L, t_atom *argv, int argc, int raw)
+{
+    int i;
+
+    if (raw)
+    {
+        pdlua_pushatoms(L, argc, argv);
+        return;
+    }
+    lua_createtable(L, argc, 0);
+    for (i = 0; i < argc; i++)
+    {
+        pdlua_pushatom(L, &argv[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+}
+
+/** Parse text in Pd's syntax into atoms. */
+static int pdlua_parse(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 The text.
+  * \li \c 2 Optional flag, true to get pd.Atoms.
+  * \par Outputs:
+  * \li \c 1 Table of the atoms (pd.Atoms if asked for), with semicolons
+  * and commas as the strings ";" and ",".
+  * */
+{
+    size_t      len;
+    const char  *text = luaL_checklstring(L, 1, &len);
+
+    PDLUA_DEBUG("pdlua_parse: stack top %d", lua_gettop(L));
+    if (!pdlua_textbuf) pdlua_textbuf = binbuf_new();
+    binbuf_text(pdlua_textbuf, text, len);
+    pdlua_pushbinbuf(L, binbuf_getvec(pdlua_textbuf), binbuf_getnatom(pdlua_textbuf), lua_toboolean(L, 2));
+    binbuf_clear(pdlua_textbuf);
+    PDLUA_DEBUG("pdlua_parse: end. stack top %d", lua_gettop(L));
+    return 1;
+}
+
+/** Format atoms as text in Pd's syntax. */
+static int pdlua_format(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 pd.Atoms, or a table of numbers and strings (where ";", ","
+  * and $ arguments are taken as in a patch file).
+  * \par Outputs:
+  * \li \c 1 The text, or nil for failure.
+  * */
+{
+    t_pdlua_atoms   *a;
+    t_atom          *atoms;
+    int             count = 0, len;
+    char            *buf;
+
+    PDLUA_DEBUG("pdlua_format: stack top %d", lua_gettop(L));
+    if (!pdlua_textbuf) pdlua_textbuf = binbuf_new();
+    if ((a = pdlua_toatoms(L, 1))) binbuf_add(pdlua_textbuf, a->argc, a->argv);
+    else
+    {
+        lua_settop(L, 1);
+        atoms = pdlua_popatomtable(L, &count, NULL);
+        if (count > 0 && !atoms) return 0;
+        binbuf_restore(pdlua_textbuf, count, atoms);
+        if (atoms) free(atoms);
+    }
+    binbuf_gettext(pdlua_textbuf, &buf, &len);
+    binbuf_clear(pdlua_textbuf);
+    lua_pushlstring(L, buf, len);
+    freebytes(buf, len);
+    PDLUA_DEBUG("pdlua_format: end. stack top %d", lua_gettop(L));
+    return 1;
+}
+
+#define PDLUA_TEXTREADER_META "pdlua.TextReader" /* registry name of the metatable for pd.parsefile() */
+#define PDLUA_TEXTREADER_CHUNK 65536 /* bytes read from the file at once */
+
+/** State of pd.parsefile(): the file, what was read of it but not parsed
+ * yet, and the messages parsed but not returned yet. */
+typedef struct pdlua_textreader
+{
+    FILE        *fp; /**< The file, NULL once it's all read. */
+    char        *buf; /**< Text read but not parsed, an incomplete message. */
+    size_t      size; /**< Allocated size of buf. */
+    size_t      n; /**< Bytes in buf. */
+    size_t      scanned; /**< Bytes in buf known not to end a message. */
+    int         escaped; /**< The last byte scanned was an unescaped backslash. */
+    t_binbuf    *messages; /**< Parsed messages. */
+    int         pos; /**< Index of the next atom in messages. */
+    int         raw; /**< Return pd.Atoms instead of tables. */
+} t_pdlua_textreader;
+
+/** Close the file and free the buffers of a pd.parsefile() reader. */
+static int pdlua_textreader_gc(lua_State *L)
+{
+    t_pdlua_textreader *r = luaL_checkudata(L, 1, PDLUA_TEXTREADER_META);
+
+    if (r->fp) fclose(r->fp);
+    if (r->buf) freebytes(r->buf, r->size);
+    if (r->messages) binbuf_free(r->messages);
+    r->fp = NULL;
+    r->buf = NULL;
+    r->messages = NULL;
+    return 0;
+}
+
+/** Read from the file up to the end of the last complete message in it, and
+ * parse that. Returns 0 when there's nothing left. */
+static int pdlua_textreader_fill(t_pdlua_textreader *r)
+{
+    size_t  cut = 0, got, i;
+
+    while (r->fp && !cut)
+    {
+        if (r->n + PDLUA_TEXTREADER_CHUNK > r->size)
+        {
+            size_t size = r->size ? r->size * 2 : PDLUA_TEXTREADER_CHUNK;
+            while (size < r->n + PDLUA_TEXTREADER_CHUNK) size *= 2;
+            r->buf = r->buf ? resizebytes(r->buf, r->size, size) : getbytes(size);
+            r->size = size;
+        }
+        got = fread(r->buf + r->n, 1, PDLUA_TEXTREADER_CHUNK, r->fp);
+        r->n += got;
+        if (got < PDLUA_TEXTREADER_CHUNK)
+        {
+            /* end of file (or an error), the rest goes in whatever it is */
+            fclose(r->fp);
+            r->fp = NULL;
+            cut = r->n;
+            break;
+        }
+        /* only the new bytes are scanned, so long messages stay linear */
+        for (i = r->scanned; i < r->n; i++)
+        {
+            if (r->escaped) r->escaped = 0;
+            else if (r->buf[i] == '\\') r->escaped = 1;
+            else if (r->buf[i] == ';') cut = i + 1;
+        }
+        r->scanned = r->n;
+    }
+    if (!cut) return 0;
+    binbuf_text(r->messages, r->buf, cut);
+    r->pos = 0;
+    memmove(r->buf, r->buf + cut, r->n - cut);
+    r->n -= cut;
+    r->scanned = r->n;
+    return 1;
+}
+
+/** Get the next message of a pd.parsefile() reader. */
+static int pdlua_textreader_next(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c upvalue 1 The reader.
+  * \par Outputs:
+  * \li \c 1 The atoms of the next message (without the semicolon), as a
+  * table or pd.Atoms, or nil at the end of the file.
+  * */
+{
+    t_pdlua_textreader  *r = lua_touserdata(L, lua_upvalueindex(1));
+    t_atom              *vec;
+    int                 natoms, end;
+
+    if (!r->messages) return 0; /* collected already */
+    for (;;)
+    {
+        vec = binbuf_getvec(r->messages);
+        natoms = binbuf_getnatom(r->messages);
+        while (r->pos < natoms)
+        {
+            for (end = r->pos; end < natoms && vec[end].a_type != A_SEMI; end++);
+            if (end > r->pos)
+            {
+                pdlua_pushbinbuf(L, vec + r->pos, end - r->pos, r->raw);
+                r->pos = end + 1;
+                return 1;
+            }
+            r->pos = end + 1; /* skip empty messages */
+        }
+        if (!pdlua_textreader_fill(r)) return 0;
+    }
+}
+
+/** Parse a file in Pd's syntax, a chunk at a time. */
+static int pdlua_parsefile(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 File name.
+  * \li \c 2 Optional flag, true to get pd.Atoms.
+  * \par Outputs:
+  * \li \c 1 Iterator function returning each message in turn, or nil if
+  * the file can't be opened.
+  * */
+{
+    const char          *path = luaL_checkstring(L, 1);
+    t_pdlua_textreader  *r;
+    FILE                *fp;
+
+    PDLUA_DEBUG("pdlua_parsefile: stack top %d", lua_gettop(L));
+    if (!(fp = fopen(path, "rb")))
+    {
+        pd_error(NULL, "lua: error: can't open `%s'", path);
+        return 0;
+    }
+    r = lua_newuserdata(L, sizeof(t_pdlua_textreader));
+    memset(r, 0, sizeof(t_pdlua_textreader));
+    r->fp = fp;
+    r->messages = binbuf_new();
+    r->raw = lua_toboolean(L, 2);
+    luaL_getmetatable(L, PDLUA_TEXTREADER_META);
+    lua_setmetatable(L, -2);
+    lua_pushcclosure(L, pdlua_textreader_next, 1);
+    PDLUA_DEBUG("pdlua_parsefile: end. stack top %d", lua_gettop(L));
+    return 1;
+}
+
+/** Create the metatable for pd.parsefile() readers. */
+static void pdlua_textreader_setup(lua_State *L)
+{
+    luaL_newmetatable(L, PDLUA_TEXTREADER_META);
+    lua_pushcfunction(L, pdlua_textreader_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1); /* pop the metatable */
+}
+
+static const char *basename(const char *name)
+{
+  /* strip dir from name : */
+  const char *basenamep = strrchr(name, '/');
+#ifdef _WIN32
+  if (!basenamep)
+    basenamep = strrchr(name, '\\');
+#endif
+  if (!basenamep)
+    basenamep = name;
+  else basenamep++;   /* strip last '/' */
+  return basenamep;
+}
+
+/** An entry in the cache of classes resolved by creation name. */
+typedef struct pdlua_classentry
+{
+    t_symbol                *name; /**< The creation name. */
+    int                     ref; /**< Registry reference to the Lua class table. */
+    struct pdlua_classentry *next; /**< Next entry in the same bucket. */
+} t_pdlua_classentry;
+
+#define PDLUA_CLASSCACHE_SIZE 256 /* number of buckets, a power of two */
+
+/** Classes resolved by creation name, so that pdlua_new() only needs to
+ * call into Lua once for every object after the first of its class. */
+static t_pdlua_classentry *pdlua_classcache[PDLUA_CLASSCACHE_SIZE];
+
+static unsigned int pdlua_classcache_hash(t_symbol *s)
+{
+    /* symbols are unique, so the address is as good as the name */
+    return (unsigned int)(((size_t)s >> 3) * 2654435761u) & (PDLUA_CLASSCACHE_SIZE - 1);
+}
+
+/** Find the cached class of a creation name. */
+static t_pdlua_classentry *pdlua_classcache_find(t_symbol *s)
+{
+    t_pdlua_classentry *e;
+
+    for (e = pdlua_classcache[pdlua_classcache_hash(s)]; e; e = e->next)
+    {
+        if (e->name == s) return e;
+    }
+    return NULL;
+}
+
+/** Cache the class table on top of the Lua stack for a creation name (pops it). */
+static void pdlua_classcache_add(t_symbol *s)
+{
+    t_pdlua_classentry *e = pdlua_classcache_find(s);
+    unsigned int       h;
+
+    if (e) luaL_unref(__L, LUA_REGISTRYINDEX, e->ref);
+    else
+    {
+        h = pdlua_classcache_hash(s);
+        e = getbytes(sizeof(t_pdlua_classentry));
+        e->name = s;
+        e->next = pdlua_classcache[h];
+        pdlua_classcache[h] = e;
+    }
+    e->ref = luaL_ref(__L, LUA_REGISTRYINDEX);
+}
+
+/** Forget the class cached for a creation name. */
+static int pdlua_invalidateclass(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Creation name string.
+  * \par Outputs:
+  * None.
+  * */
+{
+    t_symbol           *s = gensym(luaL_checkstring(L, 1));
+    t_pdlua_classentry **p;
+    t_pdlua_classentry *e;
+
+    PDLUA_DEBUG("pdlua_invalidateclass: stack top %d", lua_gettop(L));
+    for (p = &pdlua_classcache[pdlua_classcache_hash(s)]; (e = *p); p = &e->next)
+    {
+        if (e->name == s)
+        {
+            *p = e->next;
+            luaL_unref(L, LUA_REGISTRYINDEX, e->ref);
+            freebytes(e, sizeof(t_pdlua_classentry));
+            break;
+        }
+    }
+    PDLUA_DEBUG("pdlua_invalidateclass: end. stack top %d", lua_gettop(L));
+    return 0;
+}
+
+/** Remember how an object was created, for recordings. */
+static t_pdlua *pdlua_setcreator(t_pdlua *o, t_symbol *s, int argc, t_atom *argv)
+{
+    if (!o) return NULL;
+    o->creator = s;
+    o->argc = argc;
+    o->argv = argc ? copybytes(argv, argc * sizeof(t_atom)) : NULL;
+    if (PDLUA_RECORDING(o)) pdlua_rec_new(o);
+    return o;
+}
+
+/** Pd object constructor. */
+static t_pdlua *pdlua_new
+(
+    t_symbol    *s, /**< The construction message selector. */
+    int         argc, /**< The construction message atom count. */
+    t_atom      *argv /**< The construction message atoms. */
+)
+{
+    int i;
+    PDLUA_DEBUG("pdlua_new: s->s_name is %s", s->s_name);
+    PDLUA_ARRAYS_MAYCHANGE();
+    for (i = 0; i < argc; ++i)
+    {
+        switch (argv[i].a_type)
+        {
+        case A_FLOAT:
+            PDLUA_DEBUG2("argv[%d]: %f", i, argv[i].a_w.w_float);
+            break;
+        case A_SYMBOL:
+            PDLUA_DEBUG2("argv[%d]: %s", i, argv[i].a_w.w_symbol->s_name);
+            break;
+        default:
+            pd_error(NULL, "pdlua_new: bad argument type"); // should never happen
+            return NULL;
+        }
+    }
+    PDLUA_DEBUG("pdlua_new: start with stack top %d", lua_gettop(__L));
+    lua_getglobal(__L, "pd");
+    t_pdlua_classentry *cached = pdlua_classcache_find(s);
+    if (cached)
+    {
+        /* class already resolved, construct directly */
+        lua_getfield(__L, -1, "_construct");
+        lua_rawgeti(__L, LUA_REGISTRYINDEX, cached->ref);
+        lua_pushstring(__L, s->s_name);
+        pdlua_pushatomtable(argc, argv);
+        if (lua_pcall(__L, 3, 1, 0))
+        {
+            pd_error(NULL, "pdlua_new: error in constructor for `%s':\n%s", s->s_name, lua_tostring(__L, -1));
+            lua_pop(__L, 2); /* pop the error string and the global "pd" */
+            return NULL;
+        }
+        t_pdlua *object = lua_islightuserdata(__L, -1) ? lua_touserdata(__L, -1) : NULL;
+        lua_pop(__L, 2); /* pop the userdata and the global "pd" */
+        PDLUA_DEBUG("pdlua_new: end (cached class). stack top %d", lua_gettop(__L));
+        return pdlua_setcreator(object, s, argc, argv);
+    }
+    lua_getfield(__L, -1, "_checkbase");
     lua_pushstring(__L, s->s_name);
-    pdlua_pushatomtable(argc, argv);
-    if (lua_pcall(__L, 4, 0, 0))
+    lua_pcall(__L, 1, 1, 0);
+    int needs_base = lua_toboolean(__L, -1);
+    lua_pop(__L, 1); /* pop boolean */
+    /* have to load the .pd_lua file for basename if another class is owning it */
+    if(needs_base) {
+        char                buf[MAXPDSTRING];
+        char                *ptr;
+        t_pdlua_readerdata  reader;
+        t_canvas* current = canvas_getcurrent();
+        int fd = canvas_open(current, s->s_name, ".pd_lua", buf, &ptr, MAXPDSTRING, 1);
+        if (fd >= 0)
+        {
+            PDLUA_DEBUG("basename open: stack top %d", lua_gettop(__L));
+            /* save old loadname, restore later in case of
+             * nested loading */ 
+            int n, load_name_save, load_path_save;
+            lua_getfield(__L, -1, "_loadname");
+            load_name_save = luaL_ref(__L, LUA_REGISTRYINDEX);
+            lua_pushnil(__L);
+            lua_setfield(__L, -2, "_loadname");
+            lua_getfield(__L, -1, "_loadpath");
+            load_path_save = luaL_ref(__L, LUA_REGISTRYINDEX);
+            lua_pushstring(__L, buf);
+            lua_setfield(__L, -2, "_loadpath");
+            
+            PDLUA_DEBUG("pdlua_new (basename load) path is %s", buf);
+            //pdlua_setpathname(o, buf);/* change the scriptname to include its path 
+            pdlua_setrequirepath(__L, buf);
+            class_set_extern_dir(gensym(buf));
+            strncpy(buf, s->s_name, MAXPDSTRING - 8);
+            strcat(buf, ".pd_lua");
+            reader.fd = fd;
+            n = lua_gettop(__L);
+#if LUA_VERSION_NUM	< 502
+            if (lua_load(__L, pdlua_reader, &reader, buf))
+#else // 5.2 style
+            if (lua_load(__L, pdlua_reader, &reader, buf, NULL))
+#endif // LUA_VERSION_NUM	< 502
+            {
+                close(fd);
+                pdlua_clearrequirepath(__L);
+                lua_error(__L);
+            }
+            else
+            {
+                if (lua_pcall(__L, 0, LUA_MULTRET, 0))
+                {
+                    pd_error(NULL, "lua: error running `%s':\n%s", buf, lua_tostring(__L, -1));
+                    lua_pop(__L, 1);
+                    close(fd);
+                    pdlua_clearrequirepath(__L);
+                }
+                else
+                {
+                    /* succeeded */
+                    close(fd);
+                    pdlua_clearrequirepath(__L);
+                }
+            }
+            class_set_extern_dir(&s_);
+            lua_settop(__L, n); /* discard results of load */
+            lua_rawgeti(__L, LUA_REGISTRYINDEX, load_path_save);
+            lua_setfield(__L, -2, "_loadpath");
+            luaL_unref(__L, LUA_REGISTRYINDEX, load_path_save);
+            lua_rawgeti(__L, LUA_REGISTRYINDEX, load_name_save);
+            lua_setfield(__L, -2, "_loadname");
+            luaL_unref(__L, LUA_REGISTRYINDEX, load_name_save);
+        }
+        else pd_error(NULL, "lua: error loading `%s': canvas_open() failed", buf);
+    }
+    PDLUA_DEBUG("pdlua_new: after load script. stack top %d", lua_gettop(__L));
+    lua_getfield(__L, -1, "_constructor");
+    lua_pushstring(__L, s->s_name);
+    pdlua_pushatomtable(argc, argv);
+    PDLUA_DEBUG("pdlua_new: before lua_pcall(L, 2, 2, 0) stack top %d", lua_gettop(__L));
+    if (lua_pcall(__L, 2, 2, 0))
+    {
+        pd_error(NULL, "pdlua_new: error in constructor for `%s':\n%s", s->s_name, lua_tostring(__L, -1));
+        lua_pop(__L, 2); /* pop the error string and the global "pd" */
+        return NULL;
+    }
+    else
+    {
+        t_pdlua *object = NULL;
+        PDLUA_DEBUG("pdlua_new: done lua_pcall(L, 2, 2, 0) stack top %d", lua_gettop(__L));
+        /* the second result is the class the name resolved to, if any */
+        if (lua_istable(__L, -1)) pdlua_classcache_add(s);
+        else lua_pop(__L, 1);
+        if (lua_islightuserdata(__L, -1))
+        {
+            object = lua_touserdata(__L, -1);
+            lua_pop(__L, 2);/* pop the userdata and the global "pd" */
+            PDLUA_DEBUG2("pdlua_new: before returning object %p stack top %d", object, lua_gettop(__L));
+            return pdlua_setcreator(object, s, argc, argv);
+        }
+        else
+        {
+            lua_pop(__L, 2);/* pop the userdata and the global "pd" */
+            PDLUA_DEBUG("pdlua_new: done FALSE lua_islightuserdata(L, -1)", 0);
+            return NULL;
+        }
+    }
+}
+
+/** Pd object destructor. */
+static void pdlua_free( t_pdlua *o /**< The object to destruct. */)
+{
+    PDLUA_DEBUG("pdlua_free: stack top %d", lua_gettop(__L));
+    PDLUA_ARRAYS_MAYCHANGE();
+    lua_getglobal(__L, "pd");
+    lua_getfield (__L, -1, "_destructor");
+    lua_pushlightuserdata(__L, o);
+    if (lua_pcall(__L, 1, 0, 0))
+    {
+        pdlua_logf(NULL, 1, "lua: error in destructor:\n%s", lua_tostring(__L, -1));
+        lua_pop(__L, 1); /* pop the error string */
+    }
+    lua_pop(__L, 1); /* pop the global "pd" */
+    /* nothing may log to the object from now on */
+    pdlua_logforget(o);
+    pdlua_frames_forget(o);
+    if (PDLUA_RECORDING(o)) pdlua_rec_free(o);
+    if (o->argv) freebytes(o->argv, o->argc * sizeof(t_atom));
+    if (pdlua_replaying && pdlua_replaying->owner == o) pdlua_replay_stop(pdlua_replaying, 1);
+    PDLUA_DEBUG("pdlua_free: end. stack top %d", lua_gettop(__L));
+    return;
+}
+
+#if 0
+static void pdlua_stack_dump (lua_State *L)
+{
+    int i;
+    int top = lua_gettop(L);
+
+    for (i = 1; i <= top; i++)
+    {  /* repeat for each level */
+        int t = lua_type(L, i);
+        switch (t)
+        {
+            case LUA_TSTRING:  /* strings */
+                printf("`%s'", lua_tostring(L, i));
+                break;
+    
+            case LUA_TBOOLEAN:  /* booleans */
+                printf(lua_toboolean(L, i) ? "true" : "false");
+                break;
+    
+            case LUA_TNUMBER:  /* numbers */
+                printf("%g", lua_tonumber(L, i));
+                break;
+    
+            default:  /* other values */
+                printf("%s", lua_typename(L, t));
+                break;
+        }
+        printf("  ");  /* put a separator */
+    }
+    printf("\n");  /* end the listing */
+}
+#endif
+
+/* nw.js support. If this is non-NULL then we're running inside Jonathan
+   Wilkes' Pd-L2Ork variant and access to the GUI uses JavaScript. */
+static void (*nw_gui_vmess)(const char *sel, char *fmt, ...) = NULL;
+
+/** a handler for the open item in the right-click menu (mrpeach 20111025) */
+/** Here we find the lua code for the object and open it in an editor */
+static void pdlua_menu_open(t_pdlua *o)
+{
+    const char  *name;
+    const char  *path;
+    char        pathname[FILENAME_MAX];
+    t_class     *class;
+
+    PDLUA_DEBUG("pdlua_menu_open stack top is %d", lua_gettop(__L));
+    /** Get the scriptname of the object */
+    lua_getglobal(__L, "pd");
+    lua_getfield(__L, -1, "_whoami");
+    lua_pushlightuserdata(__L, o);
+    if (lua_pcall(__L, 1, 1, 0))
+    {
+        pd_error(NULL, "lua: error in whoami:\n%s", lua_tostring(__L, -1));
+        lua_pop(__L, 2); /* pop the error string and the global "pd" */
+        return;
+    }
+    name = luaL_checkstring(__L, -1);
+    PDLUA_DEBUG3("pdlua_menu_open: L is %p, name is %s stack top is %d", __L, name, lua_gettop(__L));
+    if (name)
+    {
+        if (name[strlen(name)-1] == 'x')
+        {
+            /* pdluax is a class, the particular file should loadable by name alone, we hope */
+            sprintf(pathname, "%s", name);
+            lua_pop(__L, 2); /* pop name and the global "pd" */
+        }
+        else
+        {
+            lua_getglobal(__L, "pd");
+            lua_getfield(__L, -1, "_get_class");
+            lua_pushlightuserdata(__L, o);
+            if (lua_pcall(__L, 1, 1, 0))
+            {
+                pd_error(NULL, "lua: error in get_class:\n%s", lua_tostring(__L, -1));
+                lua_pop(__L, 4); /* pop the error string, global "pd", name, global "pd"*/
+                return;
+            }
+            class = (t_class *)lua_touserdata(__L, -1);
+#if PLUGDATA
+            if (!*class->c_externdir->s_name)
+                path = plugdata_datadir;
+            else
+#endif
+            path = class->c_externdir->s_name;
+            sprintf(pathname, "%s/%s", path, name);
+            lua_pop(__L, 4); /* pop class, global "pd", name, global "pd"*/
+        }
+#if PD_MAJOR_VERSION==0 && PD_MINOR_VERSION<43
+        post("Opening %s for editing", pathname);
+#else
+        logpost(NULL, 3, "Opening %s for editing", pathname);
+#endif
+        if (nw_gui_vmess)
+          nw_gui_vmess("open_textfile", "s", pathname);
+        else
+          sys_vgui("::pd_menucommands::menu_openfile {%s}\n", pathname);
+    }
+    PDLUA_DEBUG("pdlua_menu_open end. stack top is %d", lua_gettop(__L));
+}
+
+/** Lua class registration. This is equivalent to the "setup" method for an ordinary Pd class */
+static int pdlua_class_new(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Class name string.
+  * \par Outputs:
+  * \li \c 1 Pd class pointer.
+  * \li \c 2 Pointer to the methods declared by the class, see pdlua_method_add().
+  * */
+{
+    const char  *name;
+    t_class     *c;
+
+    name = luaL_checkstring(L, 1);
+    PDLUA_DEBUG3("pdlua_class_new: L is %p, name is %s stack top is %d", L, name, lua_gettop(L));
+    c = class_new(gensym((char *) name), (t_newmethod) pdlua_new,
+        (t_method) pdlua_free, sizeof(t_pdlua), CLASS_NOINLET, A_GIMME, 0);
+
+/* a class with a "menu-open" method will have the "Open" item highlighted in the right-click menu */
+    if (c)
+        class_addmethod(c, (t_method)pdlua_menu_open, gensym("menu-open"), A_NULL);/* (mrpeach 20111025) */
+/**/
+
+    lua_pushlightuserdata(L, c);
+    lua_pushlightuserdata(L, getbytes(sizeof(t_pdlua_classmethods)));
+    PDLUA_DEBUG("pdlua_class_new: end stack top is %d", lua_gettop(L));
+    return 2;
+}
+
+/** Lua object creation. */
+static int pdlua_object_new(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Pd class pointer.
+  * \par Outputs:
+  * \li \c 2 Pd object pointer.
+  * */
+{
+    PDLUA_DEBUG("pdlua_object_new: stack top is %d", lua_gettop(L));
+    if (lua_islightuserdata(L, 1))
+    {
+        t_class *c = lua_touserdata(L, 1);
+        if (c)
+        {
+            PDLUA_DEBUG("pdlua_object_new: path is %s", c->c_externdir->s_name);
+            t_pdlua *o = (t_pdlua *) pd_new(c);
+            if (o)
+            {
+                o->inlets = 0;
+                o->in = NULL;
+                o->outlets = 0;
+                o->out = NULL;
+                o->canvas = canvas_getcurrent();
+                o->log.tokens = PDLUA_LOG_BURST;
+                o->log.time = clock_getlogicaltime();
+                o->log.dropped = 0;
+                o->log.noticetime = 0;
+                o->rawatoms = 0;
+                o->creator = NULL;
+                o->argc = 0;
+                o->argv = NULL;
+                o->recid = 0;
+                o->recgen = 0;
+                lua_pushlightuserdata(L, o);
+                PDLUA_DEBUG("pdlua_object_new: success end. stack top is %d", lua_gettop(L));
+                return 1;
+            }
+        }
+    }
+    PDLUA_DEBUG("pdlua_object_new: fail end. stack top is %d", lua_gettop(L));
+    return 0;
+}
+
+/** Lua object inlet creation. */
+static int pdlua_object_createinlets(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Pd object pointer.
+  * \li \c 2 Number of inlets.
+  * \li \c 3 Methods declared by the class (pointer), or nil.
+  * */
+{
+    t_pdlua_classmethods    *methods = lua_islightuserdata(L, 3) ? lua_touserdata(L, 3) : NULL;
+    int                     i;
+
+    PDLUA_DEBUG("pdlua_object_createinlets: stack top is %d", lua_gettop(L));
+    if (lua_islightuserdata(L, 1))
+    {
+        t_pdlua *o = lua_touserdata(L, 1);
+        if (o)
+        {
+            o->inlets = luaL_checknumber(L, 2);
+            o->in = malloc(o->inlets * sizeof(t_pdlua_proxyinlet));
+            for (i = 0; i < o->inlets; ++i)
+            {
+                pdlua_proxyinlet_init(&o->in[i], o, i, methods);
+                inlet_new(&o->pd, &o->in[i].pd, 0, 0);
+            }
+        }
+    }
+    PDLUA_DEBUG("pdlua_object_createinlets: end. stack top is %d", lua_gettop(L));
+    return 0;
+}
+
+/** Lua object outlet creation. */
+static int pdlua_object_createoutlets(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Pd object pointer.
+  * \li \c 2 Number of outlets.
+  * */
+{
+    int i;
+
+    PDLUA_DEBUG("pdlua_object_createoutlets: stack top is %d", lua_gettop(L));
+    if (lua_islightuserdata(L, 1))
+    {
+        t_pdlua *o = lua_touserdata(L, 1);
+        if (o)
+        {
+            o->outlets = luaL_checknumber(L, 2);
+            if (o->outlets > 0)
+            {
+                o->out = malloc(o->outlets * sizeof(t_outlet *));
+                for (i = 0; i < o->outlets; ++i) o->out[i] = outlet_new(&o->pd, 0);
+            }
+            else o->out = NULL;
+        }
+    }
+    PDLUA_DEBUG("pdlua_object_createoutlets: end stack top is %d", lua_gettop(L));
+    return 0;
+}
+
+/* get canvas path of an object */
+static int pdlua_object_canvaspath(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Pd object pointer.
+  * \par Outputs:
+  * \li \c 1 Canvas path string.
+  * */
+{
+    PDLUA_DEBUG("pdlua_object_canvaspath: stack top is %d", lua_gettop(L));
+    if (lua_islightuserdata(L, 1))
+    {
+        t_pdlua *o = lua_touserdata(L, 1);
+        if (o)
+        {
+           lua_pushstring(L, canvas_getdir(o->canvas)->s_name);
+        }
+    }
+    PDLUA_DEBUG("pdlua_object_canvaspath: end stack top is %d", lua_gettop(L));
+    return 1;
+}
+
+/** Lua object receive creation. */
+static int pdlua_receive_new(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Receive name string.
+  * \li \c 2 Optional delivery mode string ("immediate", "last" or "batch").
+  * \par Outputs:
+  * \li \c 1 Pd receive pointer.
+  *
+  * One proxy is created per receive name and mode, pd.lua shares it between
+  * all the Lua receivers listening on that name and fans out to them itself.
+  * */
+{
+    int         mode;
+    PDLUA_DEBUG("pdlua_receive_new: stack top is %d", lua_gettop(L));
+    const char  *name = luaL_checkstring(L, 1);
+    const char  *modename = luaL_optstring(L, 2, "immediate");
+    if (!strcmp(modename, "immediate")) mode = PDLUA_RECEIVE_IMMEDIATE;
+    else if (!strcmp(modename, "last")) mode = PDLUA_RECEIVE_LAST;
+    else if (!strcmp(modename, "batch")) mode = PDLUA_RECEIVE_BATCH;
+    else
+    {
+        pd_error(NULL, "lua: error: unknown receive mode `%s'", modename);
+        return 0;
+    }
+    if (name)
+    {
+        t_pdlua_proxyreceive *r =  pdlua_proxyreceive_new(gensym((char *) name), mode); /* const cast */
+        lua_pushlightuserdata(L, r);
+        PDLUA_DEBUG("pdlua_receive_new: success end. stack top is %d", lua_gettop(L));
+        return 1;
+    }
+    PDLUA_DEBUG("pdlua_receive_new: fail end. stack top is %d", lua_gettop(L));
+    return 0;
+}
+
+/** Lua object receive destruction. */
+static int pdlua_receive_free(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Pd recieve pointer.
+  * */
+{
+    PDLUA_DEBUG("pdlua_receive_free: stack top is %d", lua_gettop(L));
+    if (lua_islightuserdata(L, 1))
+    {
+        t_pdlua_proxyreceive *r = lua_touserdata(L, 1);
+        if (r) pdlua_proxyreceive_free(r);
+    }
+    PDLUA_DEBUG("pdlua_receive_free: end. stack top is %d", lua_gettop(L));
+    return 0;
+}
+
+/** Lua object clock creation. */
+static int pdlua_clock_new(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Pd object pointer.
+  * \par Outputs:
+  * \li \c 1 Pd clock pointer.
+  * */
+{
+    PDLUA_DEBUG("pdlua_clock_new: stack top is %d", lua_gettop(L));
+    if (lua_islightuserdata(L, 1))
+    {
+        t_pdlua *o = lua_touserdata(L, 1);
+        if (o)
+        {
+            t_pdlua_proxyclock *c =  pdlua_proxyclock_new(o);
+            lua_pushlightuserdata(L, c);
+            PDLUA_DEBUG("pdlua_clock_new: success end. stack top is %d", lua_gettop(L));
+            return 1;
+        }
+    }
+    PDLUA_DEBUG("pdlua_clock_new: fail end. stack top is %d", lua_gettop(L));
+    return 0;
+}
+
+/** Lua proxy clock delay. */
+static int pdlua_clock_delay(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Pd clock pointer.
+  * \li \c 2 Number of milliseconds to delay.
+  * */
+{
+    PDLUA_DEBUG("pdlua_clock_delay: stack top is %d", lua_gettop(L));
+    if (lua_islightuserdata(L, 1))
+    {
+        t_pdlua_proxyclock *c = lua_touserdata(L, 1);
+        if (c)
+        {
+            double delaytime = luaL_checknumber(L, 2);
+            clock_delay(c->clock, delaytime);
+        }
+    }
+    PDLUA_DEBUG("pdlua_clock_delay: end. stack top is %d", lua_gettop(L));
+    return 0;
+}
+
+/** Lua proxy clock set. */
+static int pdlua_clock_set(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Pd clock pointer.
+  * \li \c 2 Number to set the clock.
+  * */
+{
+    PDLUA_DEBUG("pdlua_clock_set: stack top is %d", lua_gettop(L));
+    if (lua_islightuserdata(L, 1))
+    {
+        t_pdlua_proxyclock *c = lua_touserdata(L, 1);
+        if (c)
+        {
+            double systime = luaL_checknumber(L, 2);
+            clock_set(c->clock, systime);
+        }
+    }
+    PDLUA_DEBUG("pdlua_clock_set: end. stack top is %d", lua_gettop(L));
+    return 0;
+}
+
+/** Lua proxy clock unset. */
+static int pdlua_clock_unset(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Pd clock pointer.
+  * */
+{
+    PDLUA_DEBUG("pdlua_clock_unset: stack top is %d", lua_gettop(L));
+    if (lua_islightuserdata(L, 1))
+    {
+        t_pdlua_proxyclock *c = lua_touserdata(L, 1);
+        if (c) clock_unset(c->clock);
+    }
+    PDLUA_DEBUG("pdlua_clock_unset: end. stack top is %d", lua_gettop(L));
+    return 0;
+}
+
+/** Lua proxy clock destruction. */
+static int pdlua_clock_free(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Pd clock pointer.
+  * */
+{
+    PDLUA_DEBUG("pdlua_clock_free: stack top is %d", lua_gettop(L));
+    if (lua_islightuserdata(L, 1))
+    {
+        t_pdlua_proxyclock *c = lua_touserdata(L, 1);
+        if (c)
+        {
+            clock_free(c->clock);
+            free(c);
+        }
+    }
+    PDLUA_DEBUG("pdlua_clock_free: end. stack top is %d", lua_gettop(L));
+    return 0;
+}
+
+/** A task sleeping until a logical time, in the queue of sleeping tasks. */
+typedef struct pdlua_sleeper
+{
+    double          time; /**< Logical time to wake up at. */
+    unsigned int    seq; /**< Scheduling order, tasks due at the same time wake up first come first served. */
+    int             id; /**< Key of the sleeping task in Lua. */
+} t_pdlua_sleeper;
+
+/** Sleeping tasks, as a binary min-heap on (time, seq).
+ * All of them share a single clock, set to the earliest wake up time. */
+static t_pdlua_sleeper *pdlua_sleepers = NULL;
+static int pdlua_nsleepers = 0;
+static int pdlua_sleepersize = 0;
+static unsigned int pdlua_sleeperseq = 0;
+static t_clock *pdlua_sleepclock = NULL;
+
+static int pdlua_sleeper_before(const t_pdlua_sleeper *a, const t_pdlua_sleeper *b)
+{
+    return a->time < b->time || (a->time == b->time && (int)(a->seq - b->seq) < 0);
+}
+
+/** Remove a task from the queue, by its index in the heap. */
+static void pdlua_sleepers_remove(int i)
+{
+    int             child, parent;
+    t_pdlua_sleeper last = pdlua_sleepers[--pdlua_nsleepers];
+
+    if (i == pdlua_nsleepers) return;
+    /* the last one takes its place, and moves up or down from there */
+    for (; i > 0; i = parent)
+    {
+        parent = (i - 1) / 2;
+        if (!pdlua_sleeper_before(&last, &pdlua_sleepers[parent])) break;
+        pdlua_sleepers[i] = pdlua_sleepers[parent];
+    }
+    while ((child = 2 * i + 1) < pdlua_nsleepers)
+    {
+        if (child + 1 < pdlua_nsleepers &&
+            pdlua_sleeper_before(&pdlua_sleepers[child + 1], &pdlua_sleepers[child]))
+                child++;
+        if (!pdlua_sleeper_before(&pdlua_sleepers[child], &last)) break;
+        pdlua_sleepers[i] = pdlua_sleepers[child];
+        i = child;
+    }
+    pdlua_sleepers[i] = last;
+}
+
+/** Remove the earliest task from the queue. */
+static void pdlua_sleepers_pop(void)
+{
+    pdlua_sleepers_remove(0);
+}
+
+/** Wake up the tasks that are due, called from the shared clock. */
+static void pdlua_sleepclock_tick(void *dummy)
+{
+    double  now = clock_getlogicaltime();
+    int     id;
+
+    PDLUA_DEBUG("pdlua_sleepclock_tick: stack top %d", lua_gettop(__L));
+    PDLUA_ARRAYS_MAYCHANGE();
+    lua_getglobal(__L, "pd");
+    /* tasks scheduled for now by the ones woken up here run in this tick too */
+    while (pdlua_nsleepers && pdlua_sleepers[0].time <= now)
+    {
+        id = pdlua_sleepers[0].id;
+        pdlua_sleepers_pop();
+        lua_getfield(__L, -1, "_wake");
+        lua_pushnumber(__L, id);
+        if (lua_pcall(__L, 1, 0, 0))
+        {
+            pdlua_logf(NULL, 1, "lua: error in task dispatcher:\n%s", lua_tostring(__L, -1));
+            lua_pop(__L, 1); /* pop the error string */
+        }
+    }
+    lua_pop(__L, 1); /* pop the global "pd" */
+    if (pdlua_nsleepers) clock_set(pdlua_sleepclock, pdlua_sleepers[0].time);
+    PDLUA_DEBUG("pdlua_sleepclock_tick: end. stack top %d", lua_gettop(__L));
+}
+
+/** Schedule a sleeping task to wake up at a logical time. */
+static int pdlua_schedule(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Logical time to wake up at.
+  * \li \c 2 Task key number, passed back to pd._wake().
+  * */
+{
+    t_pdlua_sleeper s;
+    int             i, parent;
+
+    PDLUA_DEBUG("pdlua_schedule: stack top is %d", lua_gettop(L));
+    s.time = luaL_checknumber(L, 1);
+    s.id = luaL_checknumber(L, 2);
+    s.seq = pdlua_sleeperseq++;
+    if (!pdlua_sleepclock) pdlua_sleepclock = clock_new(NULL, (t_method) pdlua_sleepclock_tick);
+    if (pdlua_nsleepers == pdlua_sleepersize)
+    {
+        int newsize = pdlua_sleepersize ? 2 * pdlua_sleepersize : 64;
+        pdlua_sleepers = resizebytes(pdlua_sleepers,
+            pdlua_sleepersize * sizeof(t_pdlua_sleeper), newsize * sizeof(t_pdlua_sleeper));
+        pdlua_sleepersize = newsize;
+    }
+    for (i = pdlua_nsleepers++; i > 0; i = parent)
+    {
+        parent = (i - 1) / 2;
+        if (!pdlua_sleeper_before(&s, &pdlua_sleepers[parent])) break;
+        pdlua_sleepers[i] = pdlua_sleepers[parent];
+    }
+    pdlua_sleepers[i] = s;
+    if (i == 0) clock_set(pdlua_sleepclock, s.time);
+    PDLUA_DEBUG("pdlua_schedule: end. stack top is %d", lua_gettop(L));
+    return 0;
+}
+
+/** Take a cancelled task out of the queue of sleeping tasks, so that
+ * tasks that are cancelled and started again don't pile up in it. */
+static int pdlua_unschedule(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Task key number, as given to pdlua_schedule().
+  * */
+{
+    int id = luaL_checknumber(L, 1);
+    int i;
+
+    PDLUA_DEBUG("pdlua_unschedule: stack top is %d", lua_gettop(L));
+    for (i = 0; i < pdlua_nsleepers && pdlua_sleepers[i].id != id; i++);
+    if (i < pdlua_nsleepers)
+    {
+        pdlua_sleepers_remove(i);
+        if (i == 0)
+        {
+            if (pdlua_nsleepers) clock_set(pdlua_sleepclock, pdlua_sleepers[0].time);
+            else clock_unset(pdlua_sleepclock);
+        }
+    }
+    PDLUA_DEBUG("pdlua_unschedule: end. stack top is %d", lua_gettop(L));
+    return 0;
+}
+
+/** Get Pd's logical time. */
+static int pdlua_systime(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Delay in milliseconds (optional).
+  * \par Outputs:
+  * \li \c 1 Logical time now, or after the delay.
+  * */
+{
+    PDLUA_DEBUG("pdlua_systime: stack top is %d", lua_gettop(L));
+    if (lua_isnoneornil(L, 1)) lua_pushnumber(L, clock_getlogicaltime());
+    else lua_pushnumber(L, clock_getsystimeafter(luaL_checknumber(L, 1)));
+    PDLUA_DEBUG("pdlua_systime: end. stack top is %d", lua_gettop(L));
+    return 1;
+}
+
+/** Get the time elapsed since a logical time. */
+static int pdlua_timesince(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Logical time.
+  * \par Outputs:
+  * \li \c 1 Milliseconds elapsed since then.
+  * */
+{
+    PDLUA_DEBUG("pdlua_timesince: stack top is %d", lua_gettop(L));
+    lua_pushnumber(L, clock_gettimesince(luaL_checknumber(L, 1)));
+    PDLUA_DEBUG("pdlua_timesince: end. stack top is %d", lua_gettop(L));
+    return 1;
+}
+
+/** A message waiting in a pd.Queue. */
+typedef struct pdlua_queueentry
+{
+    double          time; /**< Logical time it is due at. */
+    unsigned int    seq; /**< Order of pushing, messages due at the same time go out first come first served. */
+    int             outlet; /**< Outlet (from 0), or -1 for the queue's Lua method. */
+    t_symbol        *sel; /**< Message selector. */
+    int             argc; /**< Number of atoms. */
+    t_atom          *argv; /**< The atoms, from getbytes(). */
+} t_pdlua_queueentry;
+
+/** Queue of timed messages (pd.Queue), a binary min-heap on (time, seq)
+ * driven by a single clock, so pending messages cost no clock each. */
+typedef struct pdlua_queue
+{
+    t_pdlua             *owner; /**< Object whose outlets the messages go to. */
+    int                 outlet; /**< Default outlet (from 0), or -1 for the Lua method. */
+    t_clock             *clock; /**< Set to the earliest message. */
+    t_pdlua_queueentry  *heap; /**< The messages. */
+    int                 n; /**< Number of messages. */
+    int                 size; /**< Allocated size of heap. */
+    unsigned int        seq; /**< Counter for t_pdlua_queueentry.seq. */
+    int                 busy; /**< We're sending messages right now (nested flushes count). */
+    int                 dead; /**< Freed while busy, free when done. */
+} t_pdlua_queue;
+
+static int pdlua_queueentry_before(const t_pdlua_queueentry *a, const t_pdlua_queueentry *b)
+{
+    return a->time < b->time || (a->time == b->time && (int)(a->seq - b->seq) < 0);
+}
+
+/** Remove the earliest message from a queue, the caller takes its atoms. */
+static t_pdlua_queueentry pdlua_queue_pop(t_pdlua_queue *q)
+{
+    t_pdlua_queueentry  first = q->heap[0], last = q->heap[--q->n];
+    int                 i = 0, child;
+
+    while ((child = 2 * i + 1) < q->n)
+    {
+        if (child + 1 < q->n && pdlua_queueentry_before(&q->heap[child + 1], &q->heap[child])) child++;
+        if (!pdlua_queueentry_before(&q->heap[child], &last)) break;
+        q->heap[i] = q->heap[child];
+        i = child;
+    }
+    q->heap[i] = last;
+    return first;
+}
+
+/** Free the atoms of all messages in a queue. */
+static void pdlua_queue_clear(t_pdlua_queue *q)
+{
+    int i;
+
+    for (i = 0; i < q->n; i++)
+        if (q->heap[i].argv) freebytes(q->heap[i].argv, q->heap[i].argc * sizeof(t_atom));
+    q->n = 0;
+    clock_unset(q->clock);
+}
+
+/** Send a message taken from a queue. */
+static void pdlua_queue_send(t_pdlua_queue *q, t_pdlua_queueentry *e)
+{
+    if (e->outlet >= 0)
+    {
+        if (e->outlet < q->owner->outlets) outlet_anything(q->owner->out[e->outlet], e->sel, e->argc, e->argv);
+        else pd_error(q->owner, "lua: error: queue outlet out of range");
+    }
+    else
+    {
+        lua_getglobal(__L, "pd");
+        lua_getfield(__L, -1, "_queuedispatch");
+        lua_pushlightuserdata(__L, q);
+        lua_pushstring(__L, e->sel->s_name);
+        if (q->owner->rawatoms) pdlua_pushatoms(__L, e->argc, e->argv);
+        else pdlua_pushatomtable(e->argc, e->argv);
+        t_pdlua_frame f;
+        pdlua_enter(&f, q->owner);
+        if (lua_pcall(__L, 3, 0, 0))
+        {
+            pdlua_logf(f.obj, 1, "lua: error in queue dispatcher:\n%s", lua_tostring(__L, -1));
+            lua_pop(__L, 1); /* pop the error string */
+        }
+        pdlua_leave(&f);
+        lua_pop(__L, 1); /* pop the global "pd" */
+    }
+    if (e->argv) freebytes(e->argv, e->argc * sizeof(t_atom));
+}
+
+static void pdlua_queue_free(t_pdlua_queue *q);
+
+/** Send all messages that are due (or all of them), called from the queue's clock. */
+static void pdlua_queue_flush(t_pdlua_queue *q, int all)
+{
+    double              now = clock_getlogicaltime();
+    t_pdlua_queueentry  e;
+
+    PDLUA_DEBUG("pdlua_queue_flush: stack top %d", lua_gettop(__L));
+    q->busy++;
+    /* messages pushed for now by the ones sent here go out in this tick too */
+    while (q->n && (all || q->heap[0].time <= now) && !q->dead)
+    {
+        e = pdlua_queue_pop(q);
+        /* each message may change arrays, before Lua sees the next one */
+        PDLUA_ARRAYS_MAYCHANGE();
+        pdlua_queue_send(q, &e);
+    }
+    q->busy--;
+    if (q->dead)
+    {
+        if (!q->busy) pdlua_queue_free(q);
+    }
+    else if (q->n) clock_set(q->clock, q->heap[0].time);
+    PDLUA_DEBUG("pdlua_queue_flush: end. stack top %d", lua_gettop(__L));
+}
+
+static void pdlua_queue_tick(t_pdlua_queue *q)
+{
+    pdlua_queue_flush(q, 0);
+}
+
+static void pdlua_queue_free(t_pdlua_queue *q)
+{
+    pdlua_queue_clear(q);
+    if (q->busy)
+    {
+        /* we're being freed while sending, pdlua_queue_flush() will finish the job */
+        q->dead = 1;
+        return;
+    }
+    clock_free(q->clock);
+    if (q->heap) freebytes(q->heap, q->size * sizeof(t_pdlua_queueentry));
+    freebytes(q, sizeof(t_pdlua_queue));
+}
+
+/** Lua queue creation. */
+static int pdlua_queue_new(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Pd object pointer.
+  * \li \c 2 Default outlet number (from 1), or nil to call the Lua method.
+  * \par Outputs:
+  * \li \c 1 Queue pointer.
+  * */
+{
+    t_pdlua         *o = lua_islightuserdata(L, 1) ? lua_touserdata(L, 1) : NULL;
+    t_pdlua_queue   *q;
+
+    PDLUA_DEBUG("pdlua_queue_new: stack top is %d", lua_gettop(L));
+    if (!o)
+    {
+        PDLUA_DEBUG("pdlua_queue_new: fail end. stack top is %d", lua_gettop(L));
+        return 0;
+    }
+    q = getbytes(sizeof(t_pdlua_queue));
+    q->owner = o;
+    q->outlet = lua_isnumber(L, 2) ? (int) lua_tonumber(L, 2) - 1 : -1;
+    q->clock = clock_new(q, (t_method) pdlua_queue_tick);
+    lua_pushlightuserdata(L, q);
+    PDLUA_DEBUG("pdlua_queue_new: end. stack top is %d", lua_gettop(L));
+    return 1;
+}
+
+/** Add a message to a queue. */
+static int pdlua_queue_push(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Queue pointer.
+  * \li \c 2 Delay in milliseconds.
+  * \li \c 3 Message selector string.
+  * \li \c 4 Message atoms table or pd.Atoms.
+  * \li \c 5 Outlet number (from 1), or nil for the queue's default.
+  * */
+{
+    t_pdlua_queue       *q = lua_islightuserdata(L, 1) ? lua_touserdata(L, 1) : NULL;
+    t_pdlua_queueentry  e;
+    t_atom              *atoms;
+    int                 i, parent, count = 0;
+
+    PDLUA_DEBUG("pdlua_queue_push: stack top is %d", lua_gettop(L));
+    if (!q) return 0;
+    e.time = clock_getsystimeafter(luaL_checknumber(L, 2));
+    e.sel = gensym((char *) luaL_checkstring(L, 3));
+    e.outlet = lua_isnumber(L, 5) ? (int) lua_tonumber(L, 5) - 1 : q->outlet;
+    e.seq = q->seq++;
+    lua_pushvalue(L, 4);
+    atoms = pdlua_popatomtable(L, &count, q->owner);
+    if (count > 0 && !atoms) return 0;
+    e.argc = count;
+    e.argv = count ? copybytes(atoms, count * sizeof(t_atom)) : NULL;
+    if (atoms) free(atoms);
+    if (q->n == q->size)
+    {
+        int size = q->size ? 2 * q->size : 16;
+        q->heap = resizebytes(q->heap, q->size * sizeof(t_pdlua_queueentry), size * sizeof(t_pdlua_queueentry));
+        q->size = size;
+    }
+    for (i = q->n++; i > 0; i = parent)
+    {
+        parent = (i - 1) / 2;
+        if (!pdlua_queueentry_before(&e, &q->heap[parent])) break;
+        q->heap[i] = q->heap[parent];
+    }
+    q->heap[i] = e;
+    if (i == 0 && !q->busy) clock_set(q->clock, e.time);
+    PDLUA_DEBUG("pdlua_queue_push: end. stack top is %d", lua_gettop(L));
+    return 0;
+}
+
+/** Remove all messages from a queue, or send them all right away. */
+static int pdlua_queue_lclear(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Queue pointer.
+  * \li \c 2 Boolean, true to send the messages (like [pipe]'s flush) instead of dropping them.
+  * */
+{
+    t_pdlua_queue *q = lua_islightuserdata(L, 1) ? lua_touserdata(L, 1) : NULL;
+
+    PDLUA_DEBUG("pdlua_queue_lclear: stack top is %d", lua_gettop(L));
+    if (q)
+    {
+        if (lua_toboolean(L, 2)) pdlua_queue_flush(q, 1);
+        else pdlua_queue_clear(q);
+    }
+    PDLUA_DEBUG("pdlua_queue_lclear: end. stack top is %d", lua_gettop(L));
+    return 0;
+}
+
+/** Number of messages in a queue. */
+static int pdlua_queue_size(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Queue pointer.
+  * \par Outputs:
+  * \li \c 1 Number of messages waiting.
+  * */
+{
+    t_pdlua_queue *q = lua_islightuserdata(L, 1) ? lua_touserdata(L, 1) : NULL;
+
+    lua_pushnumber(L, q ? q->n : 0);
+    return 1;
+}
+
+/** Lua queue destruction. */
+static int pdlua_queue_lfree(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Queue pointer.
+  * */
+{
+    t_pdlua_queue *q = lua_islightuserdata(L, 1) ? lua_touserdata(L, 1) : NULL;
+
+    PDLUA_DEBUG("pdlua_queue_lfree: stack top is %d", lua_gettop(L));
+    if (q) pdlua_queue_free(q);
+    PDLUA_DEBUG("pdlua_queue_lfree: end. stack top is %d", lua_gettop(L));
+    return 0;
+}
+
+/** Time of one scheduler tick (a DSP block) in milliseconds. */
+static double pdlua_ticktime(void)
+{
+    t_float sr = sys_getsr();
+
+    return sr > 0 ? 1000. * sys_getblksize() / sr : 1000. * 64 / 44100;
+}
+
+static void pdlua_idleclock_tick(void *dummy);
+
+/** The clock running deferred work, and whether it is set. */
+static t_clock *pdlua_idleclock = NULL;
+static int pdlua_idlepending = 0;
+
+/** Set the deferred work clock to the next scheduler tick. */
+static void pdlua_idleclock_set(void)
+{
+    if (!pdlua_idleclock) pdlua_idleclock = clock_new(NULL, (t_method) pdlua_idleclock_tick);
+    clock_delay(pdlua_idleclock, pdlua_ticktime());
+    pdlua_idlepending = 1;
+}
+
+/** Run a slice of deferred work, called from the deferred work clock. */
+static void pdlua_idleclock_tick(void *dummy)
+{
+    int more = 0;
+
+    PDLUA_DEBUG("pdlua_idleclock_tick: stack top %d", lua_gettop(__L));
+    PDLUA_ARRAYS_MAYCHANGE();
+    pdlua_idlepending = 0;
+    lua_getglobal(__L, "pd");
+    lua_getfield(__L, -1, "_idle");
+    if (lua_pcall(__L, 0, 1, 0))
+    {
+        pdlua_logf(NULL, 1, "lua: error in deferred work dispatcher:\n%s", lua_tostring(__L, -1));
+    }
+    else more = lua_toboolean(__L, -1);
+    lua_pop(__L, 2); /* pop the result or error string, and the global "pd" */
+    /* more work may have been deferred from the slice, which set the clock already */
+    if (more && !pdlua_idlepending) pdlua_idleclock_set();
+    PDLUA_DEBUG("pdlua_idleclock_tick: end. stack top %d", lua_gettop(__L));
+}
+
+/** Make sure deferred work runs in the next scheduler tick. */
+static int pdlua_idlewake(lua_State *L)
+/**< Lua interpreter state. */
+{
+    PDLUA_DEBUG("pdlua_idlewake: stack top is %d", lua_gettop(L));
+    if (!pdlua_idlepending) pdlua_idleclock_set();
+    PDLUA_DEBUG("pdlua_idlewake: end. stack top is %d", lua_gettop(L));
+    return 0;
+}
+
+/** Get the real time. */
+static int pdlua_realtime(lua_State *L)
+/**< Lua interpreter state.
+  * \par Outputs:
+  * \li \c 1 Real time in seconds, from sys_getrealtime().
+  * */
+{
+    PDLUA_DEBUG("pdlua_realtime: stack top is %d", lua_gettop(L));
+    lua_pushnumber(L, sys_getrealtime());
+    PDLUA_DEBUG("pdlua_realtime: end. stack top is %d", lua_gettop(L));
+    return 1;
+}
+
+/* Channels: lock-free single-producer/single-consumer rings of serialized
+ * Lua values, for handing data from another thread to Lua objects. The
+ * producer only ever changes head, the consumer (Pd's thread) only ever
+ * changes tail, so neither needs Pd's lock to push or drain. */
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#define PDLUA_LOAD_ACQUIRE(p) pdlua_load_acquire(p)
+#define PDLUA_STORE_RELEASE(p, v) pdlua_store_release(p, v)
+static size_t pdlua_load_acquire(volatile size_t *p) { size_t v = *p; MemoryBarrier(); return v; }
+static void pdlua_store_release(volatile size_t *p, size_t v) { MemoryBarrier(); *p = v; }
+#else
+#define PDLUA_LOAD_ACQUIRE(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define PDLUA_STORE_RELEASE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#endif
+
+#define PDLUA_CHANNEL_SIZE  65536 /* default ring size in bytes */
+#define PDLUA_CHANNEL_DEPTH 32 /* maximum nesting of tables in a message */
+
+/** Tags of serialized Lua values. */
+#define PDLUA_CHANNEL_NIL       0
+#define PDLUA_CHANNEL_FALSE     1
+#define PDLUA_CHANNEL_TRUE      2
+#define PDLUA_CHANNEL_NUMBER    3 /**< Followed by a double. */
+#define PDLUA_CHANNEL_STRING    4 /**< Followed by a uint32_t length and the bytes. */
+#define PDLUA_CHANNEL_TABLE     5 /**< Followed by key, value pairs and PDLUA_CHANNEL_END. */
+#define PDLUA_CHANNEL_END       6
+
+/** Channel data. Messages in the ring are a uint32_t length followed by
+ * that many bytes of serialized values. */
+struct pdlua_channel
+{
+    volatile size_t head; /**< Bytes ever written, changed by the producer only. */
+    char            pad1[64 - sizeof(size_t)]; /* keep head and tail on separate cache lines */
+    volatile size_t tail; /**< Bytes ever read, changed by the consumer only. */
+    char            pad2[64 - sizeof(size_t)];
+    volatile size_t dropped; /**< Messages dropped because the ring was full. */
+    size_t          reported; /**< Dropped messages already reported. */
+    volatile int    closed; /**< Destroyed on the Lua side, refuses new messages. */
+    char            *buf; /**< The ring itself. */
+    size_t          size; /**< Size of the ring, a power of two. */
+    int             refs; /**< References, changed with Pd's lock held only. */
+    int             listening; /**< Deliver messages to Lua. */
+    t_symbol        *name; /**< Name to find the channel with from C, or NULL. */
+    t_pdlua         *owner; /**< Object for error messages. */
+};
+
+/** Serialization buffer, which starts out on the stack. */
+typedef struct pdlua_channelbuf
+{
+    char    *data;
+    size_t  n;
+    size_t  size;
+    char    small[256];
+} t_pdlua_channelbuf;
+
+/** All open channels, and how many of them deliver messages to Lua. */
+static t_pdlua_channel **pdlua_channels = NULL;
+static int pdlua_nchannels = 0;
+static int pdlua_nlisteners = 0;
+static t_clock *pdlua_channelclock = NULL;
+static int pdlua_channelpending = 0;
+/** Consumer side buffer for one message, used on Pd's thread only. */
+static char *pdlua_channelscratch = NULL;
+static size_t pdlua_channelscratchsize = 0;
+
+/** Append bytes to a serialization buffer. Uses malloc(), not getbytes(),
+ * because it runs on the producer's thread. */
+static int pdlua_channelbuf_put(t_pdlua_channelbuf *b, const void *p, size_t n)
+{
+    if (b->n + n > b->size)
+    {
+        size_t  size = b->size * 2;
+        char    *data;
+
+        while (size < b->n + n) size *= 2;
+        data = (b->data == b->small) ? malloc(size) : realloc(b->data, size);
+        if (!data) return 0;
+        if (b->data == b->small) memcpy(data, b->small, b->n);
+        b->data = data;
+        b->size = size;
+    }
+    memcpy(b->data + b->n, p, n);
+    b->n += n;
+    return 1;
+}
+
+/** Serialize the Lua value at an absolute stack index.
+ * Returns NULL, or an error message if the value can't be sent. */
+static const char *pdlua_channel_serialize(lua_State *L, int idx, t_pdlua_channelbuf *b, int depth)
+{
+    unsigned char   tag;
+    const char      *err = NULL;
+
+    switch (lua_type(L, idx))
+    {
+        case LUA_TNIL:
+            tag = PDLUA_CHANNEL_NIL;
+            break;
+        case LUA_TBOOLEAN:
+            tag = lua_toboolean(L, idx) ? PDLUA_CHANNEL_TRUE : PDLUA_CHANNEL_FALSE;
+            break;
+        case LUA_TNUMBER:
+        {
+            double f = lua_tonumber(L, idx);
+
+            tag = PDLUA_CHANNEL_NUMBER;
+            if (!pdlua_channelbuf_put(b, &tag, 1) || !pdlua_channelbuf_put(b, &f, sizeof f)) return "out of memory";
+            return NULL;
+        }
+        case LUA_TSTRING:
+        {
+            size_t      len;
+            const char  *s = lua_tolstring(L, idx, &len);
+            uint32_t    n = len;
+
+            tag = PDLUA_CHANNEL_STRING;
+            if (!pdlua_channelbuf_put(b, &tag, 1) || !pdlua_channelbuf_put(b, &n, sizeof n)
+                || !pdlua_channelbuf_put(b, s, len)) return "out of memory";
+            return NULL;
+        }
+        case LUA_TTABLE:
+            if (depth >= PDLUA_CHANNEL_DEPTH) return "tables nested too deeply (or a cycle)";
+            if (!lua_checkstack(L, 3)) return "stack overflow";
+            tag = PDLUA_CHANNEL_TABLE;
+            if (!pdlua_channelbuf_put(b, &tag, 1)) return "out of memory";
+            lua_pushnil(L);
+            while (lua_next(L, idx))
+            {
+                int top = lua_gettop(L);
+
+                if ((err = pdlua_channel_serialize(L, top - 1, b, depth + 1))
+                    || (err = pdlua_channel_serialize(L, top, b, depth + 1)))
+                {
+                    lua_pop(L, 2); /* pop key and value */
+                    return err;
+                }
+                lua_pop(L, 1); /* pop the value, keep the key for lua_next() */
+            }
+            tag = PDLUA_CHANNEL_END;
+            break;
+        default:
+            return "only nil, booleans, numbers, strings and tables can be sent through a channel";
+    }
+    return pdlua_channelbuf_put(b, &tag, 1) ? NULL : "out of memory";
+}
+
+/** Push a serialized value onto the Lua stack. Returns 0 if the data is bad. */
+static int pdlua_channel_deserialize(lua_State *L, const char **p, const char *end, int depth)
+{
+    unsigned char tag;
+
+    if (*p >= end || !lua_checkstack(L, 3)) return 0;
+    tag = *(*p)++;
+    switch (tag)
+    {
+        case PDLUA_CHANNEL_NIL: lua_pushnil(L); return 1;
+        case PDLUA_CHANNEL_FALSE: lua_pushboolean(L, 0); return 1;
+        case PDLUA_CHANNEL_TRUE: lua_pushboolean(L, 1); return 1;
+        case PDLUA_CHANNEL_NUMBER:
+        {
+            double f;
+
+            if ((size_t)(end - *p) < sizeof f) return 0;
+            memcpy(&f, *p, sizeof f);
+            *p += sizeof f;
+            lua_pushnumber(L, f);
+            return 1;
+        }
+        case PDLUA_CHANNEL_STRING:
+        {
+            uint32_t n;
+
+            if ((size_t)(end - *p) < sizeof n) return 0;
+            memcpy(&n, *p, sizeof n);
+            *p += sizeof n;
+            if ((size_t)(end - *p) < n) return 0;
+            lua_pushlstring(L, *p, n);
+            *p += n;
+            return 1;
+        }
+        case PDLUA_CHANNEL_TABLE:
+            if (depth >= PDLUA_CHANNEL_DEPTH) return 0;
+            lua_newtable(L);
+            while (*p < end && **p != PDLUA_CHANNEL_END)
+            {
+                if (!pdlua_channel_deserialize(L, p, end, depth + 1)) return 0;
+                if (lua_isnil(L, -1) || !pdlua_channel_deserialize(L, p, end, depth + 1)) return 0;
+                lua_settable(L, -3);
+            }
+            if (*p >= end) return 0;
+            (*p)++; /* skip the end tag */
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/** Copy bytes into the ring, wrapping around at its end. */
+static void pdlua_channel_copyin(t_pdlua_channel *ch, size_t pos, const void *p, size_t n)
+{
+    size_t off = pos & (ch->size - 1), first = n < ch->size - off ? n : ch->size - off;
+
+    memcpy(ch->buf + off, p, first);
+    memcpy(ch->buf, (const char *)p + first, n - first);
+}
+
+/** Copy bytes out of the ring, wrapping around at its end. */
+static void pdlua_channel_copyout(t_pdlua_channel *ch, size_t pos, void *p, size_t n)
+{
+    size_t off = pos & (ch->size - 1), first = n < ch->size - off ? n : ch->size - off;
+
+    memcpy(p, ch->buf + off, first);
+    memcpy((char *)p + first, ch->buf, n - first);
+}
+
+/** Producer side: add a message of serialized values to the ring.
+ * Returns 0 if the channel is closed or full. */
+static int pdlua_channel_write(t_pdlua_channel *ch, const char *data, size_t len)
+{
+    size_t      head = ch->head, tail = PDLUA_LOAD_ACQUIRE(&ch->tail);
+    uint32_t    n = len;
+
+    if (ch->closed) return 0;
+    if (len > ch->size || sizeof n + len > ch->size - (head - tail))
+    {
+        PDLUA_STORE_RELEASE(&ch->dropped, ch->dropped + 1);
+        return 0;
+    }
+    pdlua_channel_copyin(ch, head, &n, sizeof n);
+    pdlua_channel_copyin(ch, head + sizeof n, data, len);
+    PDLUA_STORE_RELEASE(&ch->head, head + sizeof n + len);
+    return 1;
+}
+
+/** Serialize the top n values of a Lua state and add them to the ring as
+ * one message. Returns 1 on success, 0 if the channel is closed or full,
+ * and -1 (with *err set) if a value can't be sent. */
+static int pdlua_channel_writelua(t_pdlua_channel *ch, lua_State *L, int n, const char **err)
+{
+    t_pdlua_channelbuf  b;
+    int                 i, top = lua_gettop(L), result = -1;
+
+    b.data = b.small;
+    b.n = 0;
+    b.size = sizeof b.small;
+    for (i = top - n + 1; i <= top; i++)
+        if ((*err = pdlua_channel_serialize(L, i, &b, 0))) goto done;
+    result = pdlua_channel_write(ch, b.data, b.n);
+done:
+    if (b.data != b.small) free(b.data);
+    return result;
+}
+
+/** Drop a reference to a channel, freeing it with the last one. */
+static void pdlua_channel_unref(t_pdlua_channel *ch)
+{
+    if (--ch->refs > 0) return;
+    freebytes(ch->buf, ch->size);
+    freebytes(ch, sizeof *ch);
+}
+
+static void pdlua_channelclock_tick(void *dummy);
+
+/** Consumer side: deliver all messages in the ring to Lua. */
+static void pdlua_channel_drain(t_pdlua_channel *ch)
+{
+    size_t      tail = ch->tail, head = PDLUA_LOAD_ACQUIRE(&ch->head);
+    size_t      dropped;
+    uint32_t    n;
+    const char  *p, *end;
+    int         count, base;
+    t_pdlua_frame f;
+
+    PDLUA_ARRAYS_MAYCHANGE();
+    ch->refs++; /* the callback may destroy the channel */
+    pdlua_enter(&f, ch->owner); /* and its owner */
+    while (tail != head && ch->listening)
+    {
+        pdlua_channel_copyout(ch, tail, &n, sizeof n);
+        if (n > pdlua_channelscratchsize)
+        {
+            pdlua_channelscratch = resizebytes(pdlua_channelscratch, pdlua_channelscratchsize, n);
+            pdlua_channelscratchsize = n;
+        }
+        pdlua_channel_copyout(ch, tail + sizeof n, pdlua_channelscratch, n);
+        tail += sizeof n + n;
+        PDLUA_STORE_RELEASE(&ch->tail, tail); /* make room for the producer right away */
+        base = lua_gettop(__L);
+        lua_getglobal(__L, "pd");
+        lua_getfield(__L, -1, "_channeldispatch");
+        lua_pushlightuserdata(__L, ch);
+        p = pdlua_channelscratch;
+        end = p + n;
+        for (count = 1; p < end; count++)
+        {
+            if (!pdlua_channel_deserialize(__L, &p, end, 0))
+            {
+                pdlua_logf(f.obj, 1, "lua: error: bad message in channel, dropped");
+                break;
+            }
+        }
+        if (p == end && lua_pcall(__L, count, 0, 0))
+        {
+            pdlua_logf(f.obj, 1, "lua: error in channel dispatcher:\n%s", lua_tostring(__L, -1));
+        }
+        lua_settop(__L, base); /* pop the global "pd", and the rest of a bad message */
+    }
+    dropped = PDLUA_LOAD_ACQUIRE(&ch->dropped);
+    if (dropped != ch->reported && !ch->closed)
+    {
+        pdlua_logf(f.obj, 1, "lua: error: channel full, %u messages dropped",
+            (unsigned int)(dropped - ch->reported));
+        ch->reported = dropped;
+    }
+    pdlua_leave(&f);
+    pdlua_channel_unref(ch);
+}
+
+/** Poll the listening channels, once per scheduler tick. */
+static void pdlua_channelclock_tick(void *dummy)
+{
+    int i;
+
+    PDLUA_DEBUG("pdlua_channelclock_tick: stack top %d", lua_gettop(__L));
+    pdlua_channelpending = 0;
+    /* a channel removed while we're at it may be skipped until the next tick */
+    for (i = 0; i < pdlua_nchannels; i++)
+        if (pdlua_channels[i]->listening) pdlua_channel_drain(pdlua_channels[i]);
+    if (pdlua_nlisteners > 0 && !pdlua_channelpending)
+    {
+        clock_delay(pdlua_channelclock, pdlua_ticktime());
+        pdlua_channelpending = 1;
+    }
+    PDLUA_DEBUG("pdlua_channelclock_tick: end. stack top %d", lua_gettop(__L));
+}
+
+/** Lua channel creation. */
+static int pdlua_channel_new(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Pd object pointer, for error messages.
+  * \li \c 2 Size of the ring in bytes, or nil for the default.
+  * \li \c 3 Name to find the channel with from C, or nil.
+  * \par Outputs:
+  * \li \c 1 Channel pointer.
+  * */
+{
+    t_pdlua_channel *ch;
+    size_t          size = 1024;
+    lua_Number      want = luaL_optnumber(L, 2, PDLUA_CHANNEL_SIZE);
+
+    PDLUA_DEBUG("pdlua_channel_new: stack top is %d", lua_gettop(L));
+    while (size < want && size < ((size_t)1 << 30)) size *= 2;
+    ch = getbytes(sizeof *ch);
+    ch->buf = getbytes(size);
+    ch->size = size;
+    ch->refs = 1;
+    ch->owner = lua_islightuserdata(L, 1) ? lua_touserdata(L, 1) : NULL;
+    ch->name = lua_isstring(L, 3) ? gensym((char *) lua_tostring(L, 3)) : NULL;
+    pdlua_channels = resizebytes(pdlua_channels, pdlua_nchannels * sizeof *pdlua_channels,
+        (pdlua_nchannels + 1) * sizeof *pdlua_channels);
+    pdlua_channels[pdlua_nchannels++] = ch;
+    lua_pushlightuserdata(L, ch);
+    PDLUA_DEBUG("pdlua_channel_new: end. stack top is %d", lua_gettop(L));
+    return 1;
+}
+
+/** Lua channel destruction. The memory is freed when C code holding it
+ * has called pdlua_channel_release(), too. */
+static int pdlua_channel_free(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Channel pointer.
+  * */
+{
+    t_pdlua_channel *ch = lua_touserdata(L, 1);
+    int             i;
+
+    PDLUA_DEBUG("pdlua_channel_free: stack top is %d", lua_gettop(L));
+    if (ch && !ch->closed)
+    {
+        ch->closed = 1;
+        if (ch->listening) pdlua_nlisteners--;
+        ch->listening = 0;
+        for (i = 0; i < pdlua_nchannels; i++)
+        {
+            if (pdlua_channels[i] == ch)
+            {
+                pdlua_channels[i] = pdlua_channels[--pdlua_nchannels];
+                break;
+            }
+        }
+        pdlua_channel_unref(ch);
+    }
+    PDLUA_DEBUG("pdlua_channel_free: end. stack top is %d", lua_gettop(L));
+    return 0;
+}
+
+/** Start delivering the messages of a channel to Lua. */
+static int pdlua_channel_listen(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Channel pointer.
+  * */
+{
+    t_pdlua_channel *ch = lua_touserdata(L, 1);
+
+    PDLUA_DEBUG("pdlua_channel_listen: stack top is %d", lua_gettop(L));
+    if (ch && !ch->closed && !ch->listening)
+    {
+        ch->listening = 1;
+        pdlua_nlisteners++;
+        if (!pdlua_channelclock) pdlua_channelclock = clock_new(NULL, (t_method) pdlua_channelclock_tick);
+        if (!pdlua_channelpending)
+        {
+            clock_delay(pdlua_channelclock, pdlua_ticktime());
+            pdlua_channelpending = 1;
+        }
+    }
+    PDLUA_DEBUG("pdlua_channel_listen: end. stack top is %d", lua_gettop(L));
+    return 0;
+}
+
+/** Push values into a channel from Lua. Like any producer, this must be
+ * the only one pushing into the channel. */
+static int pdlua_channel_send(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Channel pointer.
+  * \li \c 2... Values to send, as one message.
+  * \par Outputs:
+  * \li \c 1 True if the message was sent, false if the channel is full or closed.
+  * */
+{
+    t_pdlua_channel *ch = lua_touserdata(L, 1);
+    const char      *err = NULL;
+    int             result = 0;
+
+    PDLUA_DEBUG("pdlua_channel_send: stack top is %d", lua_gettop(L));
+    if (ch)
+    {
+        result = pdlua_channel_writelua(ch, L, lua_gettop(L) - 1, &err);
+        if (result < 0) pd_error(ch->owner, "lua: error: %s", err);
+    }
+    lua_pushboolean(L, result > 0);
+    PDLUA_DEBUG("pdlua_channel_send: end. stack top is %d", lua_gettop(L));
+    return 1;
+}
+
+/* The C interface for producer threads. Find the channel (and release it
+ * when done) with Pd's lock held, push without it. */
+
+/** Find a named channel and take a reference to it, or return NULL.
+ * Call with Pd's lock held (sys_lock()) when not on Pd's thread. */
+PDLUA_EXPORT t_pdlua_channel *pdlua_channel_find(const char *name)
+{
+    int i;
+
+    for (i = 0; i < pdlua_nchannels; i++)
+    {
+        t_pdlua_channel *ch = pdlua_channels[i];
+        if (ch->name && !strcmp(ch->name->s_name, name))
+        {
+            ch->refs++;
+            return ch;
+        }
+    }
+    return NULL;
+}
+
+/** Release a channel found with pdlua_channel_find().
+ * Call with Pd's lock held (sys_lock()) when not on Pd's thread. */
+PDLUA_EXPORT void pdlua_channel_release(t_pdlua_channel *ch)
+{
+    if (ch) pdlua_channel_unref(ch);
+}
+
+/** Push a string into a channel, it arrives as a Lua string.
+ * Returns 0 if the channel is full or has been destroyed on the Lua side. */
+PDLUA_EXPORT int pdlua_channel_push(t_pdlua_channel *ch, const char *data, size_t len)
+{
+    t_pdlua_channelbuf  b;
+    unsigned char       tag = PDLUA_CHANNEL_STRING;
+    uint32_t            n = len;
+    int                 result = 0;
+
+    b.data = b.small;
+    b.n = 0;
+    b.size = sizeof b.small;
+    if (pdlua_channelbuf_put(&b, &tag, 1) && pdlua_channelbuf_put(&b, &n, sizeof n)
+        && pdlua_channelbuf_put(&b, data, len))
+        result = pdlua_channel_write(ch, b.data, b.n);
+    if (b.data != b.small) free(b.data);
+    return result;
+}
+
+/** Push the top n values of a Lua state (of the same Lua pdlua was built
+ * with, usually one running on the producer's thread) into a channel, as
+ * one message. The values stay on the stack. Returns 1 on success, 0 if
+ * the channel is full or destroyed, -1 if a value can't be sent. */
+PDLUA_EXPORT int pdlua_channel_pushlua(t_pdlua_channel *ch, lua_State *L, int n)
+{
+    const char *err;
+
+    return pdlua_channel_writelua(ch, L, n, &err);
+}
+
+/** Make an object pass incoming atoms to its methods as pd.Atoms. */
+static int pdlua_object_rawatoms(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Pd object pointer.
+  * \li \c 2 Boolean, true for pd.Atoms, false for tables.
+  * */
+{
+    t_pdlua *o = lua_islightuserdata(L, 1) ? lua_touserdata(L, 1) : NULL;
+
+    PDLUA_DEBUG("pdlua_object_rawatoms: stack top is %d", lua_gettop(L));
+    if (o) o->rawatoms = lua_toboolean(L, 2);
+    PDLUA_DEBUG("pdlua_object_rawatoms: end. stack top is %d", lua_gettop(L));
+    return 0;
+}
+
+/** Lua object destruction. */
+static int pdlua_object_free(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Pd object pointer.
+  * */
+{
+    int i;
+
+    PDLUA_DEBUG("pdlua_object_free: stack top is %d", lua_gettop(L));
+    if (lua_islightuserdata(L, 1))
+    {
+        t_pdlua *o = lua_touserdata(L, 1);
+        if (o)
+        {
+            if (o->in) free(o->in);
+            if(o->out)
+            {
+                for (i = 0; i < o->outlets; ++i) outlet_free(o->out[i]);
+                free(o->out);
+                o->out = NULL;
+            }
+        }
+    }
+    PDLUA_DEBUG("pdlua_object_free: end. stack top is %d", lua_gettop(L));
+    return 0;
+}
+
+/** Dispatch Pd inlet messages to Lua objects. */
+static void pdlua_dispatch
+(
+    t_pdlua         *o, /**< The object that received the message. */
+    unsigned int    inlet, /**< The inlet that the message arrived at. */
+    t_symbol        *s, /**< The message selector. */
+    int             argc, /**< The message length. */
+    t_atom          *argv /**< The atoms in the message. */
+)
+{
+    PDLUA_DEBUG("pdlua_dispatch: stack top %d", lua_gettop(__L));
+    PDLUA_ARRAYS_MAYCHANGE();
+    if (PDLUA_RECORDING(o)) pdlua_rec_message(o, inlet, s, argc, argv);
+    lua_getglobal(__L, "pd");
+    lua_getfield (__L, -1, "_dispatcher");
+    lua_pushlightuserdata(__L, o);
+    lua_pushnumber(__L, inlet + 1); /* C has 0.., Lua has 1.. */
+    lua_pushstring(__L, s->s_name);
+    if (o->rawatoms) pdlua_pushatoms(__L, argc, argv);
+    else pdlua_pushatomtable(argc, argv);
+    /* the object may free itself, so take its name for the trace now */
+    t_symbol *classname = PDLUA_CLASSNAME(o);
+    t_pdlua_frame f;
+    pdlua_enter(&f, o);
+    double tracestart = pdlua_tracing ? sys_getrealtime() : 0;
+    if (lua_pcall(__L, 4, 0, 0))
+    {
+        pdlua_logf(f.obj, 1, "lua: error in dispatcher:\n%s", lua_tostring(__L, -1));
+        lua_pop(__L, 1); /* pop the error string */
+    }
+    pdlua_leave(&f);
+    if (tracestart && pdlua_tracing) pdlua_trace_add(PDLUA_TRACE_DISPATCH, o, classname, s, inlet + 1, tracestart);
+    lua_pop(__L, 1); /* pop the global "pd" */
+    PDLUA_DEBUG("pdlua_dispatch: end. stack top %d", lua_gettop(__L));
+    return;  
+}
+
+/** Dispatch a message for a declared method to a Lua object, with the
+ * arguments converted according to the method's signature. */
+static void pdlua_methoddispatch
+(
+    t_pdlua         *o, /**< The object that received the message. */
+    unsigned int    inlet, /**< The inlet that the message arrived at. */
+    t_pdlua_method  *m, /**< The method. */
+    int             argc, /**< The message length. */
+    t_atom          *argv /**< The atoms in the message. */
+)
+{
+    const char  *sig;
+    int         base, n = 0;
+
+    PDLUA_DEBUG("pdlua_methoddispatch: stack top %d", lua_gettop(__L));
+    base = lua_gettop(__L);
+    lua_getglobal(__L, "pd");
+    lua_getfield(__L, -1, "_objects");
+    lua_pushlightuserdata(__L, o);
+    lua_rawget(__L, -2);
+    if (!lua_istable(__L, -1))
+    {
+        lua_settop(__L, base);
+        return;
+    }
+    lua_rawgeti(__L, LUA_REGISTRYINDEX, m->name);
+    lua_gettable(__L, -2);
+    if (!lua_isfunction(__L, -1))
+    {
+        /* the method is gone (maybe a script was reloaded), let pd.Class:dispatch() sort it out */
+        lua_settop(__L, base);
+        pdlua_dispatch(o, inlet, m->sel, argc, argv);
+        return;
+    }
+    lua_insert(__L, -2); /* self goes after the function */
+    for (sig = m->sig; *sig; sig++, n++)
+    {
+        if (*sig == '*')
+        {
+            if (o->rawatoms) pdlua_pushatoms(__L, argc - n, argv + n);
+            else pdlua_pushatomtable(argc - n, argv + n);
+            n = argc;
+            break;
+        }
+        if (n >= argc) break;
+        if ((*sig == 'f' && argv[n].a_type == A_FLOAT) || (*sig == 's' && argv[n].a_type == A_SYMBOL) ||
+            (*sig == 'p' && argv[n].a_type == A_POINTER)) pdlua_pushatom(__L, &argv[n]);
+        else break;
+    }
+    if (*sig && *sig != '*')
+    {
+        pd_error(o, "lua: error: bad arguments for message '%s' to inlet %u of [%s]",
+            m->sel->s_name, inlet + 1, PDLUA_CLASSNAME(o)->s_name);
+        lua_settop(__L, base);
+        return;
+    }
+    PDLUA_ARRAYS_MAYCHANGE();
+    if (PDLUA_RECORDING(o)) pdlua_rec_message(o, inlet, m->sel, argc, argv);
+    /* the method may free the object or reload its class (and so its
+     * method table), so take the names for the trace now */
+    t_symbol *classname = PDLUA_CLASSNAME(o), *sel = m->sel;
+    t_pdlua_frame f;
+    pdlua_enter(&f, o);
+    double tracestart = pdlua_tracing ? sys_getrealtime() : 0;
+    if (lua_pcall(__L, lua_gettop(__L) - base - 3, 0, 0))
+    {
+        pdlua_logf(f.obj, 1, "lua: error in method `%s':\n%s", sel->s_name, lua_tostring(__L, -1));
+    }
+    pdlua_leave(&f);
+    if (tracestart && pdlua_tracing) pdlua_trace_add(PDLUA_TRACE_DISPATCH, o, classname, sel, inlet + 1, tracestart);
+    lua_settop(__L, base);
+    PDLUA_DEBUG("pdlua_methoddispatch: end. stack top %d", lua_gettop(__L));
+}
+
+/** Declare a method, see pdlua_methoddispatch(). */
+static int pdlua_method_add(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Methods of the class (pointer).
+  * \li \c 2 Inlet number (from 1).
+  * \li \c 3 Message selector string.
+  * \li \c 4 Signature string, one of 'f', 's' or 'p' per argument, '*' for the rest.
+  * \li \c 5 Name of the Lua method to call.
+  * \par Outputs:
+  * \li \c 1 True if the method was declared, or nil and an error message.
+  * */
+{
+    t_pdlua_classmethods    *cm = lua_islightuserdata(L, 1) ? lua_touserdata(L, 1) : NULL;
+    int                     inlet = luaL_checknumber(L, 2) - 1;
+    t_symbol                *sel = gensym((char *) luaL_checkstring(L, 3));
+    const char              *sig = luaL_checkstring(L, 4);
+    t_pdlua_inletmethods    *im;
+    t_pdlua_method          *m;
+    size_t                  i, len = strlen(sig);
+
+    PDLUA_DEBUG("pdlua_method_add: stack top is %d", lua_gettop(L));
+    luaL_checkstring(L, 5);
+    if (!cm || inlet < 0)
+    {
+        lua_pushnil(L);
+        lua_pushstring(L, "no such class or inlet");
+        return 2;
+    }
+    if (len > PDLUA_METHOD_MAXARGS || strspn(sig, "fsp*") != len || (strchr(sig, '*') && strchr(sig, '*') != sig + len - 1))
+    {
+        lua_pushnil(L);
+        lua_pushfstring(L, "bad signature `%s', expected up to %d of 'f', 's', 'p' and a final '*'", sig, PDLUA_METHOD_MAXARGS);
+        return 2;
+    }
+    if (inlet >= cm->n)
+    {
+        cm->inlets = resizebytes(cm->inlets, cm->n * sizeof(t_pdlua_inletmethods), (inlet + 1) * sizeof(t_pdlua_inletmethods));
+        memset(cm->inlets + cm->n, 0, (inlet + 1 - cm->n) * sizeof(t_pdlua_inletmethods));
+        cm->n = inlet + 1;
+    }
+    im = &cm->inlets[inlet];
+    for (i = 0; i < (size_t) im->n && im->vec[i].sel != sel; i++);
+    if (i == (size_t) im->n)
+    {
+        /* a new one, otherwise it is declared again (by a reloaded script) */
+        im->vec = resizebytes(im->vec, im->n * sizeof(t_pdlua_method), (im->n + 1) * sizeof(t_pdlua_method));
+        im->vec[im->n].sel = sel;
+        im->vec[im->n].name = LUA_NOREF;
+        im->n++;
+    }
+    m = &im->vec[i];
+    memcpy(m->sig, sig, len + 1);
+    luaL_unref(L, LUA_REGISTRYINDEX, m->name);
+    lua_pushvalue(L, 5);
+    m->name = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_pushboolean(L, 1);
+    PDLUA_DEBUG("pdlua_method_add: end. stack top is %d", lua_gettop(L));
+    return 1;
+}
+
+/** Forget all the methods declared by a class, so that a reloaded
+ * script declares them anew. */
+static int pdlua_method_clear(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Methods of the class (pointer).
+  * */
+{
+    t_pdlua_classmethods    *cm = lua_islightuserdata(L, 1) ? lua_touserdata(L, 1) : NULL;
+    int                     i, j;
+
+    PDLUA_DEBUG("pdlua_method_clear: stack top is %d", lua_gettop(L));
+    if (!cm) return 0;
+    for (i = 0; i < cm->n; i++)
+    {
+        t_pdlua_inletmethods *im = &cm->inlets[i];
+        for (j = 0; j < im->n; j++) luaL_unref(L, LUA_REGISTRYINDEX, im->vec[j].name);
+        if (im->vec) freebytes(im->vec, im->n * sizeof(t_pdlua_method));
+    }
+    if (cm->inlets) freebytes(cm->inlets, cm->n * sizeof(t_pdlua_inletmethods));
+    cm->inlets = NULL;
+    cm->n = 0;
+    PDLUA_DEBUG("pdlua_method_clear: end. stack top is %d", lua_gettop(L));
+    return 0;
+}
+
+/** Dispatch Pd receive messages to Lua objects. */
+static void pdlua_receivedispatch
+(
+    t_pdlua_proxyreceive    *r, /**< The proxy receive that received the message. */
+    t_symbol                *s, /**< The message selector. */
+    int                     argc, /**< The message length. */
+    t_atom                  *argv /**< The atoms in the message. */
+)
+{
+    PDLUA_DEBUG("pdlua_receivedispatch: stack top %d", lua_gettop(__L));
+    PDLUA_ARRAYS_MAYCHANGE();
+    lua_getglobal(__L, "pd");
+    lua_getfield (__L, -1, "_receivedispatch");
+    lua_pushlightuserdata(__L, r);
+    lua_pushstring(__L, s->s_name);
+    pdlua_pushatomtable(argc, argv);
+    /* the receive may be freed by the call, so take its name for the trace now */
+    t_symbol *name = r->name;
+    double tracestart = pdlua_tracing ? sys_getrealtime() : 0;
+    if (lua_pcall(__L, 3, 0, 0))
+    {
+        pdlua_logf(NULL, 1, "lua: error in receive dispatcher:\n%s", lua_tostring(__L, -1));
+        lua_pop(__L, 1); /* pop the error string */
+    }
+    if (tracestart && pdlua_tracing) pdlua_trace_add(PDLUA_TRACE_RECEIVE, r, name, s, 0, tracestart);
+    lua_pop(__L, 1); /* pop the global "pd" */
+    PDLUA_DEBUG("pdlua_receivedispatch: end. stack top %d", lua_gettop(__L));
+    return;  
+}
+
+/** Dispatch a batch of queued Pd receive messages to Lua objects. */
+static void pdlua_receivebatchdispatch
+(
+    t_pdlua_proxyreceive    *r, /**< The proxy receive that received the messages. */
+    int                     nmsgs, /**< The number of messages. */
+    t_atom                  *atoms /**< The queued messages (selector, atom count, atoms). */
+)
+{
+    int i, argc;
+
+    PDLUA_DEBUG("pdlua_receivebatchdispatch: stack top %d", lua_gettop(__L));
+    PDLUA_ARRAYS_MAYCHANGE();
+    lua_getglobal(__L, "pd");
+    lua_getfield (__L, -1, "_receivebatchdispatch");
+    lua_pushlightuserdata(__L, r);
+    lua_createtable(__L, nmsgs, 0);
+    for (i = 1; i <= nmsgs; ++i)
+    {
+        argc = atom_getfloat(&atoms[1]);
+        lua_createtable(__L, 0, 2);
+        lua_pushstring(__L, atoms[0].a_w.w_symbol->s_name);
+        lua_setfield(__L, -2, "sel");
+        pdlua_pushatomtable(argc, &atoms[2]);
+        lua_setfield(__L, -2, "atoms");
+        lua_rawseti(__L, -2, i);
+        atoms += argc + 2;
+    }
+    if (lua_pcall(__L, 2, 0, 0))
+    {
+        pdlua_logf(NULL, 1, "lua: error in receive dispatcher:\n%s", lua_tostring(__L, -1));
+        lua_pop(__L, 1); /* pop the error string */
+    }
+    lua_pop(__L, 1); /* pop the global "pd" */
+    PDLUA_DEBUG("pdlua_receivebatchdispatch: end. stack top %d", lua_gettop(__L));
+}
+
+/** Dispatch Pd clock messages to Lua objects. */
+static void pdlua_clockdispatch( t_pdlua_proxyclock *clock)
+/**< The proxy clock that received the message. */
+{
+    PDLUA_DEBUG("pdlua_clockdispatch: stack top %d", lua_gettop(__L));
+    PDLUA_ARRAYS_MAYCHANGE();
+    lua_getglobal(__L, "pd");
+    lua_getfield (__L, -1, "_clockdispatch");
+    lua_pushlightuserdata(__L, clock);
+    /* the clock may be freed by its callback, so take its owner now */
+    t_pdlua *owner = clock->owner;
+    t_symbol *classname = PDLUA_CLASSNAME(owner);
+    t_pdlua_frame f;
+    pdlua_enter(&f, owner);
+    double tracestart = pdlua_tracing ? sys_getrealtime() : 0;
+    if (lua_pcall(__L, 1, 0, 0))
+    {
+        pdlua_logf(f.obj, 1, "lua: error in clock dispatcher:\n%s", lua_tostring(__L, -1));
+        lua_pop(__L, 1); /* pop the error string */
+    }
+    pdlua_leave(&f);
+    if (tracestart && pdlua_tracing) pdlua_trace_add(PDLUA_TRACE_CLOCK, owner, classname, &s_bang, 0, tracestart);
+    lua_pop(__L, 1); /* pop the global "pd" */
+    PDLUA_DEBUG("pdlua_clockdispatch: end. stack top %d", lua_gettop(__L));
+    return;  
+}
+
+/** Convert a Lua table into a Pd atom array. */
+static t_atom *pdlua_popatomtable
+(
+    lua_State   *L, /**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c -1 Table to convert.
+  * */
+    int         *count, /**< Where to store the array length. */
+    t_pdlua     *o /**< Object reference for error messages. */
+)
+{
+    int         i;
+    int         ok = 1;
+    t_float     f;
+    const char  *s;
+    void        *p;
+    size_t      sl;
+    t_atom      *atoms = NULL;
+    t_pdlua_atoms *a;
+
+    PDLUA_DEBUG("pdlua_popatomtable: stack top %d", lua_gettop(L));
+    if ((a = pdlua_toatoms(L, -1)))
+    {
+        /* already atoms, just copy them */
+        *count = a->argc;
+        if (*count > 0)
+        {
+            atoms = malloc(*count * sizeof(t_atom));
+            memcpy(atoms, a->argv, *count * sizeof(t_atom));
+        }
+    }
+    else if (lua_istable(L, -1))
+    {
+#if LUA_VERSION_NUM	< 502
+        *count = lua_objlen(L, -1);
+#else // 5.2 style
+        *count = lua_rawlen(L, -1);
+#endif // LUA_VERSION_NUM	< 502
+        if (*count > 0) atoms = malloc(*count * sizeof(t_atom));
+        i = 0;
+        lua_pushnil(L);
+        while (lua_next(L, -2) != 0)
+        {
+            if (i == *count)
+            {
+                pd_error(o, "lua: error: too many table elements");
+                ok = 0;
+                break;
+            }
+            switch (lua_type(L, -1))
+            {
+                case (LUA_TNUMBER):
+                    f = lua_tonumber(L, -1);
+                    SETFLOAT(&atoms[i], f);
+                    break;
+                case (LUA_TSTRING):
+                    s = lua_tolstring(L, -1, &sl);
+                    if (s)
+                    {
+                        if (strlen(s) != sl) pd_error(o, "lua: warning: symbol munged (contains \\0 in body)");
+                        SETSYMBOL(&atoms[i], gensym((char *) s));
+                    }
+                    else
+                    {
+                        pd_error(o, "lua: error: null string in table");
+                        ok = 0;
+                    }
+                    break;
+                case (LUA_TLIGHTUSERDATA): /* FIXME: check experimentality */
+                    p = lua_touserdata(L, -1);
+                    SETPOINTER(&atoms[i], p);
+                    break;
+                default:
+                    pd_error(o, "lua: error: table element must be number or string or pointer");
+                    ok = 0;
+                    break;
+            }
+            lua_pop(L, 1);
+            ++i;
+        }
+        if (i != *count)
+        {
+            pd_error(o, "lua: error: too few table elements");
+            ok = 0;
+        }
+    }
+    else 
+    {
+        pd_error(o, "lua: error: not a table or pd.Atoms");
+        ok = 0;
+    }
+    lua_pop(L, 1);
+    PDLUA_DEBUG("pdlua_popatomtable: end. stack top %d", lua_gettop(L));
+    if (ok) return atoms;
+    if (atoms) free(atoms);
+    return NULL;
+}
+
+/** Send a message from a Lua object outlet. */
+static int pdlua_outlet(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Pd object pointer.
+  * \li \c 2 Outlet number.
+  * \li \c 3 Message selector string.
+  * \li \c 4 Message atom table.
+  * */
+{
+    t_pdlua         *o;
+    int             out;
+    size_t          sl;
+    const char      *s;
+    t_symbol        *sym;
+    int             count;
+    t_atom          *atoms;
+
+    PDLUA_DEBUG("pdlua_outlet: stack top %d", lua_gettop(L));
+    if (lua_islightuserdata(L, 1))
+    {
+        o = lua_touserdata(L, 1);
+        if (o) 
+        {
+            if (lua_isnumber(L, 2)) out = lua_tonumber(L, 2) - 1; /* C has 0.., Lua has 1.. */
+            else
+            {
+                pd_error(o, "lua: error: outlet must be a number");
+                lua_pop(L, 4); /* pop all the arguments */
+                return 0;
+            }
+            if (0 <= out && out < o->outlets) 
+            {
+                if (lua_isstring(L, 3)) 
+                {
+                    s = lua_tolstring(L, 3, &sl);
+                    sym = gensym((char *) s); /* const cast */
+                    if (s)
+                    {
+                        if (strlen(s) != sl) pd_error(o, "lua: warning: symbol munged (contains \\0 in body)");
+                        lua_pushvalue(L, 4);
+                        atoms = pdlua_popatomtable(L, &count, o);
+                        if (count == 0 || atoms)
+                        {
+                            /* downstream may free the object, so take its name now */
+                            t_symbol *classname = PDLUA_CLASSNAME(o);
+                            double tracestart = pdlua_tracing ? sys_getrealtime() : 0;
+                            outlet_anything(o->out[out], sym, count, atoms);
+                            PDLUA_ARRAYS_MAYCHANGE();
+                            if (tracestart && pdlua_tracing) pdlua_trace_add(PDLUA_TRACE_OUTLET, o, classname, sym, out + 1, tracestart);
+                        }
+                        else pd_error(o, "lua: error: no atoms??");
+                        if (atoms) 
+                        {
+                            free(atoms);
+                            lua_pop(L, 4); /* pop all the arguments */
+                            return 0;
+                        }
+                    }
+                    else pd_error(o, "lua: error: null selector");
+                }
+                else pd_error(o, "lua: error: selector must be a string");
+            }
+            else pd_error(o, "lua: error: outlet out of range");
+        }
+        else pd_error(NULL, "lua: error: no object to outlet from");
+    }
+    else pd_error(NULL, "lua: error: bad arguments to outlet");
+    lua_pop(L, 4); /* pop all the arguments */
+    PDLUA_DEBUG("pdlua_outlet: end. stack top %d", lua_gettop(L));
+    return 0;
+}
+
+/** Check the object and outlet number arguments of the sequence outlet functions. */
+static t_outlet *pdlua_checkoutlet
+(
+    lua_State   *L, /**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Pd object pointer.
+  * \li \c 2 Outlet number.
+  * */
+    t_pdlua     **po /**< Where to store the object, for error messages. */
+)
+{
+    t_pdlua *o;
+    int     out;
+
+    *po = NULL;
+    if (!lua_islightuserdata(L, 1) || !(o = lua_touserdata(L, 1)))
+    {
+        pd_error(NULL, "lua: error: no object to outlet from");
+        return NULL;
+    }
+    *po = o;
+    if (!lua_isnumber(L, 2))
+    {
+        pd_error(o, "lua: error: outlet must be a number");
+        return NULL;
+    }
+    out = lua_tonumber(L, 2) - 1; /* C has 0.., Lua has 1.. */
+    if (out < 0 || out >= o->outlets)
+    {
+        pd_error(o, "lua: error: outlet out of range");
+        return NULL;
+    }
+    return o->out[out];
+}
+
+/** Send the elements of a list from a Lua object outlet one by one.
+ * Each element goes out as a float, symbol or pointer message, and each one
+ * is handled completely downstream before the next one is sent. */
+static int pdlua_outlet_drip(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Pd object pointer.
+  * \li \c 2 Outlet number.
+  * \li \c 3 Atom table.
+  * \li \c 4 Reverse flag (optional).
+  * */
+{
+    t_pdlua     *o;
+    t_outlet    *out;
+    int         count = -1;
+    int         reverse;
+    int         i;
+    t_atom      *atoms;
+
+    PDLUA_DEBUG("pdlua_outlet_drip: stack top %d", lua_gettop(L));
+    if ((out = pdlua_checkoutlet(L, &o)))
+    {
+        reverse = lua_toboolean(L, 4);
+        lua_pushvalue(L, 3);
+        atoms = pdlua_popatomtable(L, &count, o);
+        /* downstream may free the object, so take its name now */
+        t_symbol *classname = PDLUA_CLASSNAME(o);
+        double tracestart = pdlua_tracing ? sys_getrealtime() : 0;
+        for (i = 0; atoms && i < count; i++)
+        {
+            t_atom *a = &atoms[reverse ? count - 1 - i : i];
+            switch (a->a_type)
+            {
+                case A_FLOAT: outlet_float(out, a->a_w.w_float); break;
+                case A_SYMBOL: outlet_symbol(out, a->a_w.w_symbol); break;
+                case A_POINTER: outlet_pointer(out, a->a_w.w_gpointer); break;
+                default: break;
+            }
+        }
+        PDLUA_ARRAYS_MAYCHANGE();
+        if (tracestart && pdlua_tracing)
+            pdlua_trace_add(PDLUA_TRACE_OUTLET, o, classname, gensym("outlet_drip"), lua_tonumber(L, 2), tracestart);
+        if (atoms) free(atoms);
+    }
+    PDLUA_DEBUG("pdlua_outlet_drip: end. stack top %d", lua_gettop(L));
+    return 0;
+}
+
+/** Send a sequence of messages from a Lua object outlet.
+ * The messages are given as selector and atom table pairs, in one flat table,
+ * and each one is handled completely downstream before the next one is sent. */
+static int pdlua_outlet_each(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Pd object pointer.
+  * \li \c 2 Outlet number.
+  * \li \c 3 Table of selector strings and atom tables, alternating.
+  * */
+{
+    t_pdlua     *o;
+    t_outlet    *out;
+    t_symbol    *sym;
+    int         n;
+    int         i;
+    int         count;
+    t_atom      *atoms;
+
+    PDLUA_DEBUG("pdlua_outlet_each: stack top %d", lua_gettop(L));
+    if ((out = pdlua_checkoutlet(L, &o)))
+    {
+        /* downstream may free the object, so take its name now */
+        t_symbol *classname = PDLUA_CLASSNAME(o);
+        if (lua_istable(L, 3))
+        {
+#if LUA_VERSION_NUM	< 502
+            n = lua_objlen(L, 3);
+#else // 5.2 style
+            n = lua_rawlen(L, 3);
+#endif // LUA_VERSION_NUM	< 502
+            for (i = 1; i < n; i += 2)
+            {
+                lua_rawgeti(L, 3, i);
+                if (!lua_isstring(L, -1))
+                {
+                    pd_error(o, "lua: error: selector must be a string");
+                    lua_pop(L, 1);
+                    break;
+                }
+                sym = gensym((char *) lua_tostring(L, -1)); /* const cast */
+                lua_pop(L, 1);
+                lua_rawgeti(L, 3, i + 1);
+                count = -1;
+                atoms = pdlua_popatomtable(L, &count, o);
+                if (count == 0 || atoms)
+                {
+                    double tracestart = pdlua_tracing ? sys_getrealtime() : 0;
+                    outlet_anything(out, sym, count, atoms);
+                    PDLUA_ARRAYS_MAYCHANGE();
+                    if (tracestart && pdlua_tracing)
+                        pdlua_trace_add(PDLUA_TRACE_OUTLET, o, classname, sym, lua_tonumber(L, 2), tracestart);
+                }
+                else break;
+                if (atoms) free(atoms);
+            }
+            if (n % 2) pd_error(o, "lua: error: message without atoms in outlet_each()");
+        }
+        else pd_error(o, "lua: error: outlet_each() needs a table of messages");
+    }
+    PDLUA_DEBUG("pdlua_outlet_each: end. stack top %d", lua_gettop(L));
+    return 0;
+}
+
+/** Send a message from a Lua object to a Pd receiver. */
+static int pdlua_send(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Receiver string.
+  * \li \c 2 Message selector string.
+  * \li \c 3 Message atom table.
+  * */
+
+{
+    size_t          receivenamel;
+    const char      *receivename;
+    t_symbol        *receivesym;
+    size_t          selnamel;
+    const char      *selname;
+    t_symbol        *selsym;
+    int             count;
+    t_atom          *atoms;
+
+    PDLUA_DEBUG("pdlua_send: stack top is %d", lua_gettop(L));
+    if (lua_isstring(L, 1)) 
+    {
+        receivename = lua_tolstring(L, 1, &receivenamel);
+        receivesym = gensym((char *) receivename); /* const cast */
+        if (receivesym) 
+        {
+            if (strlen(receivename) != receivenamel) pd_error(NULL, "lua: warning: symbol munged (contains \\0 in body)");
+            if (lua_isstring(L, 2)) 
+            {
+                selname = lua_tolstring(L, 2, &selnamel);
+                selsym = gensym((char *) selname); /* const cast */
+                if (selsym)
+                {
+                    if (strlen(selname) != selnamel) pd_error(NULL, "lua: warning: symbol munged (contains \\0 in body)");
+                    lua_pushvalue(L, 3);
+                    atoms = pdlua_popatomtable(L, &count, NULL);
+                    if ((count == 0 || atoms) && (receivesym->s_thing))
+                    {
+                        double tracestart = pdlua_tracing ? sys_getrealtime() : 0;
+                        typedmess(receivesym->s_thing, selsym, count, atoms);
+                        PDLUA_ARRAYS_MAYCHANGE();
+                        if (tracestart && pdlua_tracing) pdlua_trace_add(PDLUA_TRACE_SEND, NULL, receivesym, selsym, 0, tracestart);
+                    }
+                    else pd_error(NULL, "lua: error: no atoms??");
+                    if (atoms) 
+                    {
+                        free(atoms);
+                        PDLUA_DEBUG("pdlua_send: success end. stack top is %d", lua_gettop(L));
+                        return 0;
+                    }
+                }
+                else pd_error(NULL, "lua: error: null selector");
+            }
+            else pd_error(NULL, "lua: error: selector must be a string");
+        }
+        else pd_error(NULL, "lua: error: null receive name");
+    }
+    else pd_error(NULL, "lua: error: receive name must be string");
+    PDLUA_DEBUG("pdlua_send: fail end. stack top is %d", lua_gettop(L));
+    return 0;
+}
+
+/** Set a [value] object's value. */
+static int pdlua_setvalue(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Value name string.
+  * \li \c 2 Value number.
+  * \par Outputs:
+  * \li \c 1 success (usually depends on a [value] existing or not).
+  */
+{
+    const char  *str = luaL_checkstring(L, 1);
+    t_float     val = luaL_checknumber(L, 2);
+    int         err = value_setfloat(gensym(str), val);
+
+    PDLUA_DEBUG("pdlua_setvalue: stack top is %d", lua_gettop(L));
+    lua_pushboolean(L, !err);
+    PDLUA_DEBUG("pdlua_setvalue: end. stack top is %d", lua_gettop(L));
+    return 1;
+}
+
+/** Get a [value] object's value. */
+static int pdlua_getvalue(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Value name string.
+  * \par Outputs:
+  * \li \c 1 Value number, or nil for failure.
+  * */
+{
+    const char  *str = luaL_checkstring(L, 1);
+    t_float     val;
+    int         err = value_getfloat(gensym(str), &val);
+
+    PDLUA_DEBUG("pdlua_getvalue: stack top is %d", lua_gettop(L));
+    if (!err) lua_pushnumber(L, val);
+    else lua_pushnil(L);
+    PDLUA_DEBUG("pdlua_getvalue: end. stack top is %d", lua_gettop(L));
+    return 1;
+}
+
+/** Get a reference to a [value] cell.
+ * The cell is created if no [value] of that name exists yet, and is kept
+ * alive until the reference is released, so [value] objects of the same name
+ * created or deleted in the meantime share it. */
+static int pdlua_value_new(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Value name string.
+  * \par Outputs:
+  * \li \c 1 Value cell pointer.
+  * */
+{
+    const char  *str = luaL_checkstring(L, 1);
+
+    PDLUA_DEBUG("pdlua_value_new: stack top is %d", lua_gettop(L));
+    lua_pushlightuserdata(L, value_get(gensym(str)));
+    PDLUA_DEBUG("pdlua_value_new: end. stack top is %d", lua_gettop(L));
+    return 1;
+}
+
+/** Release a reference to a [value] cell. */
+static int pdlua_value_free(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Value name string.
+  * */
+{
+    const char  *str = luaL_checkstring(L, 1);
+
+    PDLUA_DEBUG("pdlua_value_free: stack top is %d", lua_gettop(L));
+    value_release(gensym(str));
+    PDLUA_DEBUG("pdlua_value_free: end. stack top is %d", lua_gettop(L));
+    return 0;
+}
+
+/** Read a [value] cell. */
+static int pdlua_readvalue(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Value cell pointer.
+  * \par Outputs:
+  * \li \c 1 Value number, or nil for failure.
+  * */
+{
+    t_float     *v = lua_islightuserdata(L, 1) ? lua_touserdata(L, 1) : NULL;
+
+    PDLUA_DEBUG("pdlua_readvalue: stack top is %d", lua_gettop(L));
+    if (v)
+    {
+        lua_pushnumber(L, *v);
+        PDLUA_DEBUG("pdlua_readvalue: end 1. stack top is %d", lua_gettop(L));
+        return 1;
+    }
+    PDLUA_DEBUG("pdlua_readvalue: end 2. stack top is %d", lua_gettop(L));
+    return 0;
+}
+
+/** Write a [value] cell. */
+static int pdlua_writevalue(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Value cell pointer.
+  * \li \c 2 Value number.
+  * */
+{
+    t_float     *v = lua_islightuserdata(L, 1) ? lua_touserdata(L, 1) : NULL;
+    t_float     x = luaL_checknumber(L, 2);
+
+    PDLUA_DEBUG("pdlua_writevalue: stack top is %d", lua_gettop(L));
+    if (v) *v = x;
+    PDLUA_DEBUG("pdlua_writevalue: end. stack top is %d", lua_gettop(L));
+    return 0;
+}
+
+/** Get a [table] object's array. */
+static int pdlua_getarray(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Table name string.
+  * \par Outputs:
+  * \li \c 1 Table length, or < 0 for failure.
+  * \li \c 2 Table pointer, or nil for failure.
+  * */
+{
+    t_garray        *a;
+    int             n;
+    PDLUA_ARRAYTYPE *v;
+    const char      *str = luaL_checkstring(L, 1);
+
+    PDLUA_DEBUG("pdlua_getarray: stack top is %d", lua_gettop(L));
+    if (!(a = (t_garray *) pd_findbyclass(gensym(str), garray_class))) 
+    {
+        lua_pushnumber(L, -1);
+        PDLUA_DEBUG("pdlua_getarray: end 1. stack top is %d", lua_gettop(L));
+        return 1;
+    }
+    else if (!PDLUA_ARRAYGRAB(a, &n, &v)) 
+    {
+        lua_pushnumber(L, -2);
+        PDLUA_DEBUG("pdlua_getarray: end 2. stack top is %d", lua_gettop(L));
+        return 1;
+    }
+    else 
+    {
+        lua_pushnumber(L, n);
+        lua_pushlightuserdata(L, v);
+        PDLUA_DEBUG("pdlua_getarray: end 3. stack top is %d", lua_gettop(L));
+        return 2;
+    }
+}
+
+/** Read from a [table] object's array. */
+static int pdlua_readarray(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Table length number.
+  * \li \c 2 Table array pointer.
+  * \li \c 3 Table index number.
+  * \par Outputs:
+  * \li \c 1 Table element value, or nil for index out of range.
+  * */
+{
+    int             n = luaL_checknumber(L, 1);
+    PDLUA_ARRAYTYPE *v = lua_islightuserdata(L, 2) ? lua_touserdata(L, 2) : NULL;
+    int             i = luaL_checknumber(L, 3);
+
+    PDLUA_DEBUG("pdlua_readarray: stack top is %d", lua_gettop(L));
+    if (0 <= i && i < n && v) 
+    {
+        lua_pushnumber(L, PDLUA_ARRAYELEM(v, i));
+        PDLUA_DEBUG("pdlua_readarray: end 1. stack top is %d", lua_gettop(L));
+        return 1;
+    }
+    PDLUA_DEBUG("pdlua_readarray: end 2. stack top is %d", lua_gettop(L));
+    return 0;
+}
+
+/** Write to a [table] object's array. */
+static int pdlua_writearray(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Table length number.
+  * \li \c 2 Table array pointer.
+  * \li \c 3 Table index number.
+  * \li \c 4 Table element value number.
+  * */
+{
+    int                 n = luaL_checknumber(L, 1);
+    PDLUA_ARRAYTYPE     *v = lua_islightuserdata(L, 2) ? lua_touserdata(L, 2) : NULL;
+    int                 i = luaL_checknumber(L, 3);
+    t_float             x = luaL_checknumber(L, 4);
+
+    PDLUA_DEBUG("pdlua_writearray: stack top is %d", lua_gettop(L));
+    if (0 <= i && i < n && v) PDLUA_ARRAYELEM(v, i) = x;
+    PDLUA_DEBUG("pdlua_writearray: end. stack top is %d", lua_gettop(L));
+    return 0;
+}
+
+/** Table handle data, kept in a Lua userdata. The first fields are read
+ * directly by the LuaJIT FFI bindings in pd.lua, keep them in sync. */
+typedef struct pdlua_table
+{
+    unsigned int    stamp; /**< pdlua_arraystamp when last validated. */
+    int             length; /**< Array length, < 0 if there is no such array. */
+    PDLUA_ARRAYTYPE *vec; /**< Array data. */
+    t_garray        *array; /**< The array, NULL if there is none. */
+    t_symbol        *name; /**< Name of the array. */
+} t_pdlua_table;
+
+/** Look up the array of a table handle again. */
+static int pdlua_table_revalidate(t_pdlua_table *t)
+{
+    t_garray *a = (t_garray *) pd_findbyclass(t->name, garray_class);
+
+    t->stamp = pdlua_arraystamp;
+    if (!a)
+    {
+        t->length = -1;
+        t->vec = NULL;
+    }
+    else if (!PDLUA_ARRAYGRAB(a, &t->length, &t->vec))
+    {
+        t->length = -2;
+        t->vec = NULL;
+        a = NULL;
+    }
+    t->array = a;
+    return t->array != NULL;
+}
+
+/** Check that a table handle is valid, looking up the array only if control
+ * went through Pd since the last check. */
+#define PDLUA_TABLE_VALID(t) \
+    ((t)->stamp == pdlua_arraystamp ? (t)->array != NULL : pdlua_table_revalidate(t))
+
+#define PDLUA_TABLE_META "pdlua.Table" /* registry name of the handles' metatable */
+
+/** Get a table handle from the Lua stack. */
+#define pdlua_checktable(L, idx) ((t_pdlua_table *) luaL_checkudata(L, idx, PDLUA_TABLE_META))
+
+/** Create a handle for a [table] object's array. */
+static int pdlua_table_new(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Table name string.
+  * \par Outputs:
+  * \li \c 1 Table handle.
+  * \li \c 2 Table length, or < 0 if there is no such array (yet).
+  * */
+{
+    t_symbol        *name = gensym((char *) luaL_checkstring(L, 1));
+    t_pdlua_table   *t;
+
+    PDLUA_DEBUG("pdlua_table_new: stack top is %d", lua_gettop(L));
+    t = lua_newuserdata(L, sizeof *t);
+    luaL_newmetatable(L, PDLUA_TABLE_META); /* just gets it after the first time */
+    lua_setmetatable(L, -2);
+    t->name = name;
+    pdlua_table_revalidate(t);
+    lua_pushnumber(L, t->length);
+    PDLUA_DEBUG("pdlua_table_new: end. stack top is %d", lua_gettop(L));
+    return 2;
+}
+
+/** Get the length of a table handle's array. */
+static int pdlua_table_length(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Table handle.
+  * \par Outputs:
+  * \li \c 1 Table length, or < 0 if there is no such array (any more).
+  * */
+{
+    t_pdlua_table *t = pdlua_checktable(L, 1);
+
+    PDLUA_DEBUG("pdlua_table_length: stack top is %d", lua_gettop(L));
+    PDLUA_TABLE_VALID(t);
+    lua_pushnumber(L, t->length);
+    PDLUA_DEBUG("pdlua_table_length: end. stack top is %d", lua_gettop(L));
+    return 1;
+}
+
+/** Read from a table handle's array. */
+static int pdlua_table_read(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Table handle.
+  * \li \c 2 Table index number.
+  * \par Outputs:
+  * \li \c 1 Table element value, or nil for index out of range.
+  * */
+{
+    t_pdlua_table   *t = pdlua_checktable(L, 1);
+    int             i = luaL_checknumber(L, 2);
+
+    PDLUA_DEBUG("pdlua_table_read: stack top is %d", lua_gettop(L));
+    if (PDLUA_TABLE_VALID(t) && 0 <= i && i < t->length)
+    {
+        lua_pushnumber(L, PDLUA_ARRAYELEM(t->vec, i));
+        PDLUA_DEBUG("pdlua_table_read: end 1. stack top is %d", lua_gettop(L));
+        return 1;
+    }
+    PDLUA_DEBUG("pdlua_table_read: end 2. stack top is %d", lua_gettop(L));
+    return 0;
+}
+
+/** Write to a table handle's array. */
+static int pdlua_table_write(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Table handle.
+  * \li \c 2 Table index number.
+  * \li \c 3 Table element value number.
+  * */
+{
+    t_pdlua_table   *t = pdlua_checktable(L, 1);
+    int             i = luaL_checknumber(L, 2);
+    t_float         x = luaL_checknumber(L, 3);
+
+    PDLUA_DEBUG("pdlua_table_write: stack top is %d", lua_gettop(L));
+    if (PDLUA_TABLE_VALID(t) && 0 <= i && i < t->length) PDLUA_ARRAYELEM(t->vec, i) = x;
+    PDLUA_DEBUG("pdlua_table_write: end. stack top is %d", lua_gettop(L));
+    return 0;
+}
+
+/** Text handle data, kept in a Lua userdata: a [text define] found by name,
+ * with an index of where its lines start, so that reading a line doesn't
+ * go through all the lines before it. */
+typedef struct pdlua_text
+{
+    unsigned int    stamp; /**< pdlua_arraystamp when last looked up. */
+    t_symbol        *name; /**< Name of the [text define]. */
+    t_binbuf        *binbuf; /**< Its contents, NULL if there is none. */
+    t_atom          *vec; /**< The atoms when indexed. */
+    int             natom; /**< The number of atoms when indexed. */
+    int             *lines; /**< Index of the first atom of each line. */
+    int             nlines; /**< Number of lines, < 0 if not indexed. */
+    int             linesize; /**< Allocated size of lines. */
+} t_pdlua_text;
+
+#define PDLUA_TEXT_META "pdlua.Text" /* registry name of the handles' metatable */
+
+/** Get a text handle from the Lua stack. */
+#define pdlua_checktext(L, idx) ((t_pdlua_text *) luaL_checkudata(L, idx, PDLUA_TEXT_META))
+
+/** Lines end with a semicolon or a comma, as in [text get]. */
+#define PDLUA_TEXT_ENDSLINE(a) ((a)->a_type == A_SEMI || (a)->a_type == A_COMMA)
+
+/** Index the lines of a text handle's buffer. */
+static void pdlua_text_index(t_pdlua_text *t)
+{
+    int i;
+
+    t->vec = binbuf_getvec(t->binbuf);
+    t->natom = binbuf_getnatom(t->binbuf);
+    t->nlines = 0;
+    for (i = 0; i < t->natom; i++)
+    {
+        /* a line starts at the first atom and after each end of a line */
+        if (i == 0 || PDLUA_TEXT_ENDSLINE(&t->vec[i - 1]))
+        {
+            if (t->nlines == t->linesize)
+            {
+                int size = t->linesize ? t->linesize * 2 : 64;
+                t->lines = t->lines ? resizebytes(t->lines, t->linesize * sizeof(int), size * sizeof(int))
+                    : getbytes(size * sizeof(int));
+                t->linesize = size;
+            }
+            t->lines[t->nlines++] = i;
+        }
+    }
+}
+
+/** Check that a text handle is valid, looking up the buffer only if control
+ * went through Pd since the last check, and indexing it again if it changed
+ * size or moved. */
+static int pdlua_text_valid(t_pdlua_text *t)
+{
+    if (t->stamp != pdlua_arraystamp)
+    {
+        t->stamp = pdlua_arraystamp;
+        t->binbuf = text_getbufbyname(t->name);
+        if (!t->binbuf || binbuf_getvec(t->binbuf) != t->vec || binbuf_getnatom(t->binbuf) != t->natom)
+            t->nlines = -1;
+    }
+    if (!t->binbuf) return 0;
+    if (t->nlines < 0) pdlua_text_index(t);
+    return 1;
+}
+
+/** Find the atoms of a line (without the semicolon or comma ending it).
+ * The index is checked against the line's own ends on the way, and made
+ * again if the text was changed in Pd since. Returns 0 if there's no such
+ * line. */
+static int pdlua_text_line(t_pdlua_text *t, int i, int *start, int *end)
+{
+    int retry, j;
+
+    for (retry = 0; retry < 2; retry++)
+    {
+        if (i < 0 || i >= t->nlines) return 0;
+        *start = t->lines[i];
+        if (*start < t->natom && (*start == 0 || PDLUA_TEXT_ENDSLINE(&t->vec[*start - 1])))
+        {
+            for (j = *start; j < t->natom && !PDLUA_TEXT_ENDSLINE(&t->vec[j]); j++);
+            if (i + 1 < t->nlines ? j + 1 == t->lines[i + 1] : j + 1 >= t->natom)
+            {
+                *end = j;
+                return 1;
+            }
+        }
+        pdlua_text_index(t);
+    }
+    return 0;
+}
+
+/** Free the line index of a text handle. */
+static int pdlua_text_gc(lua_State *L)
+{
+    t_pdlua_text *t = pdlua_checktext(L, 1);
+
+    if (t->lines) freebytes(t->lines, t->linesize * sizeof(int));
+    t->lines = NULL;
+    t->linesize = 0;
+    t->nlines = -1;
+    return 0;
+}
+
+/** Create a handle for a [text define] object's contents. */
+static int pdlua_text_new(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Text name string.
+  * \par Outputs:
+  * \li \c 1 Text handle.
+  * \li \c 2 Number of lines, or < 0 if there is no such text (yet).
+  * */
+{
+    t_symbol        *name = gensym((char *) luaL_checkstring(L, 1));
+    t_pdlua_text    *t;
+
+    PDLUA_DEBUG("pdlua_text_new: stack top is %d", lua_gettop(L));
+    t = lua_newuserdata(L, sizeof *t);
+    memset(t, 0, sizeof *t);
+    if (luaL_newmetatable(L, PDLUA_TEXT_META)) /* just gets it after the first time */
+    {
+        lua_pushcfunction(L, pdlua_text_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+    t->name = name;
+    t->stamp = pdlua_arraystamp - 1; /* look it up now */
+    t->nlines = -1;
+    lua_pushnumber(L, pdlua_text_valid(t) ? t->nlines : -1);
+    PDLUA_DEBUG("pdlua_text_new: end. stack top is %d", lua_gettop(L));
+    return 2;
+}
+
+/** Get the number of lines of a text handle's buffer. */
+static int pdlua_text_length(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Text handle.
+  * \par Outputs:
+  * \li \c 1 Number of lines, or < 0 if there is no such text (any more).
+  * */
+{
+    t_pdlua_text *t = pdlua_checktext(L, 1);
+
+    PDLUA_DEBUG("pdlua_text_length: stack top is %d", lua_gettop(L));
+    lua_pushnumber(L, pdlua_text_valid(t) ? t->nlines : -1);
+    PDLUA_DEBUG("pdlua_text_length: end. stack top is %d", lua_gettop(L));
+    return 1;
+}
+
+/** Read lines from a text handle's buffer. */
+static int pdlua_text_read(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Text handle.
+  * \li \c 2 Number of the first line (from 0).
+  * \li \c 3 Number of lines, or nil for just the one line.
+  * \li \c 4 Optional flag, true to get pd.Atoms.
+  * \par Outputs:
+  * \li \c 1 The atoms of the line (a table, or pd.Atoms), or with a number
+  * of lines, a table of them (as many as there are), or nil if there's no
+  * such text or line.
+  * */
+{
+    t_pdlua_text    *t = pdlua_checktext(L, 1);
+    int             from = luaL_checknumber(L, 2);
+    int             n = lua_isnumber(L, 3) ? lua_tonumber(L, 3) : -1;
+    int             raw = lua_toboolean(L, 4);
+    int             i, start, end;
+
+    PDLUA_DEBUG("pdlua_text_read: stack top is %d", lua_gettop(L));
+    if (!pdlua_text_valid(t)) return 0;
+    if (n < 0)
+    {
+        if (!pdlua_text_line(t, from, &start, &end)) return 0;
+        pdlua_pushbinbuf(L, t->vec + start, end - start, raw);
+        PDLUA_DEBUG("pdlua_text_read: end 1. stack top is %d", lua_gettop(L));
+        return 1;
+    }
+    if (from < 0) from = 0;
+    lua_newtable(L);
+    for (i = 0; i < n && pdlua_text_line(t, from + i, &start, &end); i++)
+    {
+        pdlua_pushbinbuf(L, t->vec + start, end - start, raw);
+        lua_rawseti(L, -2, i + 1);
+    }
+    PDLUA_DEBUG("pdlua_text_read: end 2. stack top is %d", lua_gettop(L));
+    return 1;
+}
+
+/** Replace lines of a text handle's buffer. */
+static int pdlua_text_replace(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Text handle.
+  * \li \c 2 Number of the first line to replace (from 0).
+  * \li \c 3 Number of lines to replace (0 to insert).
+  * \li \c 4 Table of the new lines, each a table or pd.Atoms.
+  * \par Outputs:
+  * \li \c 1 The number of lines now, or nil for failure.
+  * */
+{
+    t_pdlua_text    *t = pdlua_checktext(L, 1);
+    int             from = luaL_checknumber(L, 2);
+    int             n = luaL_checknumber(L, 3);
+    int             count, i, m, head, tail, size;
+    t_atom          *vec, *atoms;
+    t_pdlua_atoms   *a;
+
+    PDLUA_DEBUG("pdlua_text_replace: stack top is %d", lua_gettop(L));
+    luaL_checktype(L, 4, LUA_TTABLE);
+    lua_settop(L, 4);
+    if (!pdlua_text_valid(t))
+    {
+        pd_error(NULL, "lua: error: text %s not found", t->name->s_name);
+        return 0;
+    }
+    if (from < 0) from = 0;
+    if (from > t->nlines) from = t->nlines;
+    if (n < 0) n = 0;
+    if (n > t->nlines - from) n = t->nlines - from;
+    /* what stays: the atoms before the first line replaced, and after the last */
+    head = from < t->nlines ? t->lines[from] : t->natom;
+    tail = from + n < t->nlines ? t->lines[from + n] : t->natom;
+    size = head + (t->natom - tail);
+    if (head > 0 && !PDLUA_TEXT_ENDSLINE(&t->vec[head - 1]))
+        size++; /* the last line had no end, it gets one now */
+    /* add up the new lines first, so that everything is copied only once */
+#if LUA_VERSION_NUM	< 502
+    count = lua_objlen(L, 4);
+#else // 5.2 style
+    count = lua_rawlen(L, 4);
+#endif // LUA_VERSION_NUM	< 502
+    for (i = 1; i <= count; i++)
+    {
+        lua_rawgeti(L, 4, i);
+        if ((a = pdlua_toatoms(L, -1))) size += a->argc + 1;
+        else if (lua_istable(L, -1))
+#if LUA_VERSION_NUM	< 502
+            size += lua_objlen(L, -1) + 1;
+#else // 5.2 style
+            size += lua_rawlen(L, -1) + 1;
+#endif // LUA_VERSION_NUM	< 502
+        else
+        {
+            pd_error(NULL, "lua: error: line %d is not a table or pd.Atoms", i);
+            return 0;
+        }
+        lua_pop(L, 1);
+    }
+    vec = getbytes(size * sizeof(t_atom));
+    memcpy(vec, t->vec, head * sizeof(t_atom));
+    if (head > 0 && !PDLUA_TEXT_ENDSLINE(&t->vec[head - 1])) SETSEMI(&vec[head++]);
+    for (i = 1; i <= count; i++)
+    {
+        lua_rawgeti(L, 4, i);
+        if ((a = pdlua_toatoms(L, -1)))
+        {
+            memcpy(vec + head, a->argv, a->argc * sizeof(t_atom));
+            head += a->argc;
+            lua_pop(L, 1);
+        }
+        else
+        {
+            atoms = pdlua_popatomtable(L, &m, NULL);
+            if (m > 0 && !atoms)
+            {
+                freebytes(vec, size * sizeof(t_atom));
+                return 0;
+            }
+            if (m > 0) memcpy(vec + head, atoms, m * sizeof(t_atom));
+            head += m;
+            if (atoms) free(atoms);
+        }
+        SETSEMI(&vec[head++]);
+    }
+    memcpy(vec + head, t->vec + tail, (t->natom - tail) * sizeof(t_atom));
+    binbuf_clear(t->binbuf);
+    binbuf_add(t->binbuf, size, vec);
+    freebytes(vec, size * sizeof(t_atom));
+    pdlua_text_index(t);
+    text_notifybyname(t->name);
+    /* other handles on the text still point to the old atoms */
+    PDLUA_ARRAYS_MAYCHANGE();
+    t->stamp = pdlua_arraystamp;
+    lua_pushnumber(L, t->nlines);
+    PDLUA_DEBUG("pdlua_text_replace: end. stack top is %d", lua_gettop(L));
+    return 1;
+}
+
+/** Pointer handle data, kept in a Lua userdata: a reference of our own to a
+ * scalar (or an element of an array field), so that it stays usable after
+ * the message it came in with, and notices when what it points to is gone. */
+typedef struct pdlua_pointer
+{
+    t_gpointer  gp; /**< The pointer. */
+} t_pdlua_pointer;
+
+#define PDLUA_POINTER_META "pdlua.Pointer" /* registry name of the handles' metatable */
+
+/** Get a pointer handle from the Lua stack. */
+#define pdlua_checkpointer(L, idx) (&((t_pdlua_pointer *) luaL_checkudata(L, idx, PDLUA_POINTER_META))->gp)
+
+/** Where a field name was found in a template. Field names are looked up
+ * once per template and name, and checked against the template's slot on
+ * every use, so an edited [struct] is noticed (and the name looked up
+ * again) without having to watch templates. */
+typedef struct pdlua_fieldslot
+{
+    t_template  *tmpl; /**< The template. */
+    const char  *name; /**< The field name, as a Lua string. */
+    int         slot; /**< The field's word in the scalar. */
+} t_pdlua_fieldslot;
+
+#define PDLUA_FIELDCACHE_SIZE 256 /* must be a power of two */
+static t_pdlua_fieldslot pdlua_fieldcache[PDLUA_FIELDCACHE_SIZE];
+
+/** Find the word of a field in a template, or -1 (after an error message)
+ * if there's no such field. */
+static int pdlua_field_find(t_template *tmpl, const char *name)
+{
+    t_pdlua_fieldslot   *c = &pdlua_fieldcache[(((uintptr_t) tmpl >> 4) ^ ((uintptr_t) name >> 3)) & (PDLUA_FIELDCACHE_SIZE - 1)];
+    int                 i;
+
+    if (c->tmpl == tmpl && c->name == name && c->slot < tmpl->t_n && !strcmp(tmpl->t_vec[c->slot].ds_name->s_name, name))
+        return c->slot;
+    for (i = 0; i < tmpl->t_n; i++)
+    {
+        if (!strcmp(tmpl->t_vec[i].ds_name->s_name, name))
+        {
+            c->tmpl = tmpl;
+            c->name = name;
+            c->slot = i;
+            return i;
+        }
+    }
+    pd_error(NULL, "lua: error: template %s has no field %s", tmpl->t_sym->s_name, name);
+    return -1;
+}
+
+/** Get the words and the template of what a pointer points to, or NULL
+ * (after an error message) if the pointer is stale or empty. */
+static t_word *pdlua_pointer_words(t_gpointer *gp, t_template **tmpl)
+{
+    t_symbol *s;
+
+    if (!gpointer_check(gp, 0))
+    {
+        pd_error(NULL, "lua: error: stale or empty pointer");
+        return NULL;
+    }
+    if (!(*tmpl = template_findbyname(s = gpointer_gettemplatesym(gp))))
+    {
+        pd_error(NULL, "lua: error: couldn't find template %s", s->s_name);
+        return NULL;
+    }
+    return gp->gp_stub->gs_which == GP_ARRAY ? gp->gp_un.gp_w : gp->gp_un.gp_scalar->sc_vec;
+}
+
+/** Get the array of an array field, or NULL (after an error message). */
+static t_array *pdlua_pointer_array(t_gpointer *gp, const char *field, t_template **elemtmpl)
+{
+    t_template  *tmpl;
+    t_word      *w = pdlua_pointer_words(gp, &tmpl);
+    t_array     *a;
+    int         slot;
+
+    if (!w || (slot = pdlua_field_find(tmpl, field)) < 0) return NULL;
+    if (tmpl->t_vec[slot].ds_type != DT_ARRAY)
+    {
+        pd_error(NULL, "lua: error: field %s is not an array", field);
+        return NULL;
+    }
+    a = w[slot].w_array;
+    if (!(*elemtmpl = template_findbyname(a->a_templatesym)))
+    {
+        pd_error(NULL, "lua: error: couldn't find template %s", a->a_templatesym->s_name);
+        return NULL;
+    }
+    return a;
+}
+
+/** Push the value of a field: a number, a string, the size of an array,
+ * or the atoms of a text. */
+static void pdlua_pushfield(lua_State *L, t_template *tmpl, t_word *w, int slot)
+{
+    switch (tmpl->t_vec[slot].ds_type)
+    {
+        case DT_FLOAT:
+            lua_pushnumber(L, w[slot].w_float);
+            break;
+        case DT_SYMBOL:
+            lua_pushstring(L, w[slot].w_symbol->s_name);
+            break;
+        case DT_ARRAY:
+            lua_pushnumber(L, w[slot].w_array->a_n);
+            break;
+        default: /* text */
+            pdlua_pushbinbuf(L, binbuf_getvec(w[slot].w_binbuf), binbuf_getnatom(w[slot].w_binbuf), 0);
+            break;
+    }
+}
+
+/** Set a float or symbol field from the Lua value at idx. Returns 0 (after
+ * an error message) if the field is something else or the value doesn't
+ * fit. */
+static int pdlua_setfield(lua_State *L, int idx, t_template *tmpl, t_word *w, int slot)
+{
+    int type = tmpl->t_vec[slot].ds_type;
+
+    if (type == DT_FLOAT && lua_type(L, idx) == LUA_TNUMBER)
+        w[slot].w_float = lua_tonumber(L, idx);
+    else if (type == DT_SYMBOL && lua_type(L, idx) == LUA_TSTRING)
+        w[slot].w_symbol = gensym(lua_tostring(L, idx));
+    else
+    {
+        pd_error(NULL, "lua: error: can't set field %s to a %s", tmpl->t_vec[slot].ds_name->s_name,
+            luaL_typename(L, idx));
+        return 0;
+    }
+    return 1;
+}
+
+/** Push a new pointer handle, empty. */
+static t_gpointer *pdlua_pointer_push(lua_State *L)
+{
+    t_pdlua_pointer *p = lua_newuserdata(L, sizeof *p);
+
+    gpointer_init(&p->gp);
+    luaL_getmetatable(L, PDLUA_POINTER_META);
+    lua_setmetatable(L, -2);
+    return &p->gp;
+}
+
+/** Release the reference of a pointer handle. */
+static int pdlua_pointer_gc(lua_State *L)
+{
+    gpointer_unset(pdlua_checkpointer(L, 1));
+    return 0;
+}
+
+/** Create a pointer handle. */
+static int pdlua_pointer_new(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 A pointer from a message, a pointer handle to copy, or the
+  * name of a canvas (like "pd-data") for a pointer to its head.
+  * \par Outputs:
+  * \li \c 1 Pointer handle, or nil for failure.
+  * */
+{
+    t_gpointer  *from = NULL;
+    t_gpointer  *gp;
+    t_glist     *glist = NULL;
+
+    PDLUA_DEBUG("pdlua_pointer_new: stack top is %d", lua_gettop(L));
+    if (lua_islightuserdata(L, 1)) /* a pointer atom from a message */
+        from = lua_touserdata(L, 1);
+    else if (lua_type(L, 1) == LUA_TUSERDATA)
+        from = pdlua_checkpointer(L, 1);
+    else if (!(glist = (t_glist *) pd_findbyclass(gensym(luaL_checkstring(L, 1)), canvas_class)))
     {
-        pd_error(o, "lua: error in dispatcher:\n%s", lua_tostring(__L, -1));
-        lua_pop(__L, 1); /* pop the error string */
+        pd_error(NULL, "lua: error: canvas %s not found", lua_tostring(L, 1));
+        return 0;
     }
-    lua_pop(__L, 1); /* pop the global "pd" */
-    PDLUA_DEBUG("pdlua_dispatch: end. stack top %d", lua_gettop(__L));
-    return;  
+    if (from && !gpointer_check(from, 1))
+    {
+        pd_error(NULL, "lua: error: stale or empty pointer");
+        return 0;
+    }
+    gp = pdlua_pointer_push(L);
+    if (from) gpointer_copy(from, gp);
+    else gpointer_setglist(gp, glist, NULL);
+    PDLUA_DEBUG("pdlua_pointer_new: end. stack top is %d", lua_gettop(L));
+    return 1;
 }
 
-/** Dispatch Pd receive messages to Lua objects. */
-static void pdlua_receivedispatch
-(
-    t_pdlua_proxyreceive    *r, /**< The proxy receive that received the message. */
-    t_symbol                *s, /**< The message selector. */
-    int                     argc, /**< The message length. */
-    t_atom                  *argv /**< The atoms in the message. */
-)
+/** Check whether a pointer handle points to something. */
+static int pdlua_pointer_valid(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Pointer handle.
+  * \par Outputs:
+  * \li \c 1 True if it points to a scalar or array element that's still there.
+  * */
 {
-    PDLUA_DEBUG("pdlua_receivedispatch: stack top %d", lua_gettop(__L));
-    lua_getglobal(__L, "pd");
-    lua_getfield (__L, -1, "_receivedispatch");
-    lua_pushlightuserdata(__L, r);
-    lua_pushstring(__L, s->s_name);
-    pdlua_pushatomtable(argc, argv);
-    if (lua_pcall(__L, 3, 0, 0))
+    lua_pushboolean(L, gpointer_check(pdlua_checkpointer(L, 1), 0));
+    return 1;
+}
+
+/** Get the template name of what a pointer handle points to. */
+static int pdlua_pointer_template(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Pointer handle.
+  * \par Outputs:
+  * \li \c 1 Template name (as in [struct]), or nil if the pointer is stale.
+  * */
+{
+    t_gpointer  *gp = pdlua_checkpointer(L, 1);
+    const char  *s;
+
+    if (!gpointer_check(gp, 0)) return 0;
+    s = gpointer_gettemplatesym(gp)->s_name;
+    lua_pushstring(L, strncmp(s, "pd-", 3) ? s : s + 3);
+    return 1;
+}
+
+/** Get a field of what a pointer handle points to. */
+static int pdlua_pointer_get(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Pointer handle.
+  * \li \c 2 Field name.
+  * \par Outputs:
+  * \li \c 1 Field value: a number, a string, an array's size or a text's
+  * atoms, or nil for failure.
+  * */
+{
+    t_gpointer  *gp = pdlua_checkpointer(L, 1);
+    const char  *field = luaL_checkstring(L, 2);
+    t_template  *tmpl;
+    t_word      *w;
+    int         slot;
+
+    PDLUA_DEBUG("pdlua_pointer_get: stack top is %d", lua_gettop(L));
+    if (!(w = pdlua_pointer_words(gp, &tmpl)) || (slot = pdlua_field_find(tmpl, field)) < 0) return 0;
+    pdlua_pushfield(L, tmpl, w, slot);
+    PDLUA_DEBUG("pdlua_pointer_get: end. stack top is %d", lua_gettop(L));
+    return 1;
+}
+
+/** Set a field of what a pointer handle points to. */
+static int pdlua_pointer_set(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Pointer handle.
+  * \li \c 2 Field name.
+  * \li \c 3 Number for a float field, or string for a symbol field.
+  * */
+{
+    t_gpointer  *gp = pdlua_checkpointer(L, 1);
+    const char  *field = luaL_checkstring(L, 2);
+    t_template  *tmpl;
+    t_word      *w;
+    int         slot;
+
+    PDLUA_DEBUG("pdlua_pointer_set: stack top is %d", lua_gettop(L));
+    if ((w = pdlua_pointer_words(gp, &tmpl)) && (slot = pdlua_field_find(tmpl, field)) >= 0)
+        pdlua_setfield(L, 3, tmpl, w, slot);
+    PDLUA_DEBUG("pdlua_pointer_set: end. stack top is %d", lua_gettop(L));
+    return 0;
+}
+
+/** Redraw the scalar a pointer handle points to (or into), as [set] does. */
+static int pdlua_pointer_redraw(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Pointer handle.
+  * */
+{
+    t_gpointer  *gp = pdlua_checkpointer(L, 1);
+    t_array     *a;
+
+    if (!gpointer_check(gp, 0)) return 0;
+    if (gp->gp_stub->gs_which == GP_GLIST)
+        scalar_redraw(gp->gp_un.gp_scalar, gp->gp_stub->gs_un.gs_glist);
+    else
     {
-        pd_error(r->owner, "lua: error in receive dispatcher:\n%s", lua_tostring(__L, -1));
-        lua_pop(__L, 1); /* pop the error string */
+        /* the scalar the (outermost) array belongs to */
+        for (a = gp->gp_stub->gs_un.gs_array; a->a_gp.gp_stub->gs_which == GP_ARRAY;
+            a = a->a_gp.gp_stub->gs_un.gs_array);
+        scalar_redraw(a->a_gp.gp_un.gp_scalar, a->a_gp.gp_stub->gs_un.gs_glist);
     }
-    lua_pop(__L, 1); /* pop the global "pd" */
-    PDLUA_DEBUG("pdlua_receivedispatch: end. stack top %d", lua_gettop(__L));
-    return;  
+    return 0;
 }
 
-/** Dispatch Pd clock messages to Lua objects. */
-static void pdlua_clockdispatch( t_pdlua_proxyclock *clock)
-/**< The proxy clock that received the message. */
+/** Move a pointer handle to the next scalar of its canvas, as [pointer]'s
+ * "next" does. */
+static int pdlua_pointer_next(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Pointer handle.
+  * \par Outputs:
+  * \li \c 1 True if there was another scalar, false at the end (the
+  * pointer is empty then).
+  * */
 {
-    PDLUA_DEBUG("pdlua_clockdispatch: stack top %d", lua_gettop(__L));
-    lua_getglobal(__L, "pd");
-    lua_getfield (__L, -1, "_clockdispatch");
-    lua_pushlightuserdata(__L, clock);
-    if (lua_pcall(__L, 1, 0, 0))
+    t_gpointer  *gp = pdlua_checkpointer(L, 1);
+    t_glist     *glist;
+    t_gobj      *y;
+
+    if (!gpointer_check(gp, 1) || gp->gp_stub->gs_which != GP_GLIST)
     {
-        pd_error(clock->owner, "lua: error in clock dispatcher:\n%s", lua_tostring(__L, -1));
-        lua_pop(__L, 1); /* pop the error string */
+        pd_error(NULL, "lua: error: next: stale or empty pointer, or not into a canvas");
+        lua_pushboolean(L, 0);
+        return 1;
     }
-    lua_pop(__L, 1); /* pop the global "pd" */
-    PDLUA_DEBUG("pdlua_clockdispatch: end. stack top %d", lua_gettop(__L));
-    return;  
+    glist = gp->gp_stub->gs_un.gs_glist;
+    y = gp->gp_un.gp_scalar ? gp->gp_un.gp_scalar->sc_gobj.g_next : glist->gl_list;
+    while (y && pd_class(&y->g_pd) != scalar_class) y = y->g_next;
+    if (y) gpointer_setglist(gp, glist, (t_scalar *) y);
+    else gpointer_unset(gp);
+    lua_pushboolean(L, y != NULL);
+    return 1;
 }
 
-/** Convert a Lua table into a Pd atom array. */
-static t_atom *pdlua_popatomtable
-(
-    lua_State   *L, /**< Lua interpreter state.
+/** Get a pointer handle to an element of an array field. */
+static int pdlua_pointer_element(lua_State *L)
+/**< Lua interpreter state.
   * \par Inputs:
-  * \li \c -1 Table to convert.
+  * \li \c 1 Pointer handle.
+  * \li \c 2 Array field name.
+  * \li \c 3 Element index (from 0).
+  * \par Outputs:
+  * \li \c 1 Pointer handle to the element, or nil for failure.
   * */
-    int         *count, /**< Where to store the array length. */
-    t_pdlua     *o /**< Object reference for error messages. */
-)
 {
-    int         i;
-    int         ok = 1;
-    t_float     f;
-    const char  *s;
-    void        *p;
-    size_t      sl;
-    t_atom      *atoms = NULL;
+    t_gpointer  *gp = pdlua_checkpointer(L, 1);
+    const char  *field = luaL_checkstring(L, 2);
+    int         i = luaL_checknumber(L, 3);
+    t_template  *elemtmpl;
+    t_array     *a;
 
-    PDLUA_DEBUG("pdlua_popatomtable: stack top %d", lua_gettop(L));
-    if (lua_istable(L, -1))
+    if (!(a = pdlua_pointer_array(gp, field, &elemtmpl)) || i < 0 || i >= a->a_n) return 0;
+    gpointer_setarray(pdlua_pointer_push(L), a, (t_word *) (a->a_vec + i * a->a_elemsize));
+    return 1;
+}
+
+/** Read one field of a range of elements of an array field. */
+static int pdlua_pointer_elements(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Pointer handle.
+  * \li \c 2 Array field name.
+  * \li \c 3 Field name in the elements.
+  * \li \c 4 First element (from 0).
+  * \li \c 5 Number of elements, nil for all up to the end.
+  * \par Outputs:
+  * \li \c 1 Table of the field values, or nil for failure.
+  * */
+{
+    t_gpointer  *gp = pdlua_checkpointer(L, 1);
+    const char  *field = luaL_checkstring(L, 2);
+    const char  *elemfield = luaL_checkstring(L, 3);
+    int         from = luaL_optnumber(L, 4, 0);
+    int         n = luaL_optnumber(L, 5, -1);
+    t_template  *elemtmpl;
+    t_array     *a;
+    int         slot, i;
+
+    PDLUA_DEBUG("pdlua_pointer_elements: stack top is %d", lua_gettop(L));
+    if (!(a = pdlua_pointer_array(gp, field, &elemtmpl)) || (slot = pdlua_field_find(elemtmpl, elemfield)) < 0)
+        return 0;
+    if (from < 0) from = 0;
+    if (n < 0 || n > a->a_n - from) n = a->a_n - from;
+    lua_createtable(L, n > 0 ? n : 0, 0);
+    for (i = 0; i < n; i++)
     {
+        pdlua_pushfield(L, elemtmpl, (t_word *) (a->a_vec + (from + i) * a->a_elemsize), slot);
+        lua_rawseti(L, -2, i + 1);
+    }
+    PDLUA_DEBUG("pdlua_pointer_elements: end. stack top is %d", lua_gettop(L));
+    return 1;
+}
+
+/** Write one field of a range of elements of an array field. */
+static int pdlua_pointer_setelements(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Pointer handle.
+  * \li \c 2 Array field name.
+  * \li \c 3 Field name in the elements.
+  * \li \c 4 Table of values.
+  * \li \c 5 First element (from 0).
+  * \par Outputs:
+  * \li \c 1 Number of elements written, or nil for failure.
+  * */
+{
+    t_gpointer  *gp = pdlua_checkpointer(L, 1);
+    const char  *field = luaL_checkstring(L, 2);
+    const char  *elemfield = luaL_checkstring(L, 3);
+    int         from = luaL_optnumber(L, 5, 0);
+    t_template  *elemtmpl;
+    t_array     *a;
+    int         slot, i, n;
+
+    PDLUA_DEBUG("pdlua_pointer_setelements: stack top is %d", lua_gettop(L));
+    luaL_checktype(L, 4, LUA_TTABLE);
+    if (!(a = pdlua_pointer_array(gp, field, &elemtmpl)) || (slot = pdlua_field_find(elemtmpl, elemfield)) < 0)
+        return 0;
+    if (from < 0) from = 0;
 #if LUA_VERSION_NUM	< 502
-        *count = lua_objlen(L, -1);
+    n = lua_objlen(L, 4);
 #else // 5.2 style
-        *count = lua_rawlen(L, -1);
+    n = lua_rawlen(L, 4);
 #endif // LUA_VERSION_NUM	< 502
-        if (*count > 0) atoms = malloc(*count * sizeof(t_atom));
-        i = 0;
-        lua_pushnil(L);
-        while (lua_next(L, -2) != 0)
+    if (n > a->a_n - from) n = a->a_n - from;
+    for (i = 0; i < n; i++)
+    {
+        int ok;
+        lua_rawgeti(L, 4, i + 1);
+        ok = pdlua_setfield(L, -1, elemtmpl, (t_word *) (a->a_vec + (from + i) * a->a_elemsize), slot);
+        lua_pop(L, 1);
+        if (!ok) break;
+    }
+    lua_pushnumber(L, i > 0 ? i : 0);
+    PDLUA_DEBUG("pdlua_pointer_setelements: end. stack top is %d", lua_gettop(L));
+    return 1;
+}
+
+/** Get the pointer of a pointer handle, to send it in a message. */
+static int pdlua_pointer_atom(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Pointer handle.
+  * \par Outputs:
+  * \li \c 1 The pointer, as in messages, valid as long as the handle.
+  * */
+{
+    lua_pushlightuserdata(L, pdlua_checkpointer(L, 1));
+    return 1;
+}
+
+/** Create the metatable for pointer handles. */
+static void pdlua_pointer_setup(lua_State *L)
+{
+    luaL_newmetatable(L, PDLUA_POINTER_META);
+    lua_pushcfunction(L, pdlua_pointer_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1); /* pop the metatable */
+}
+
+/** Arrays waiting to be redrawn. Redraws are coalesced: an array marked
+ * dirty any number of times is redrawn once, at most every
+ * pdlua_redrawinterval milliseconds, and looked up by name only then. */
+static t_symbol **pdlua_dirtyarrays = NULL;
+static int pdlua_ndirtyarrays = 0;
+static int pdlua_dirtyarraysize = 0;
+static double pdlua_redrawinterval = 30; /* milliseconds, 0 redraws right away */
+static double pdlua_redrawtime = 0; /* logical time of the last flush */
+static t_clock *pdlua_redrawclock = NULL;
+
+/** Redraw all dirty arrays, called from the redraw clock. */
+static void pdlua_redrawclock_tick(void *dummy)
+{
+    t_garray    *a;
+    int         i;
+
+    pdlua_redrawtime = clock_getlogicaltime();
+    for (i = 0; i < pdlua_ndirtyarrays; i++)
+        if ((a = (t_garray *) pd_findbyclass(pdlua_dirtyarrays[i], garray_class))) garray_redraw(a);
+    pdlua_ndirtyarrays = 0;
+}
+
+/** Redraw a [table] object's graph, soon. */
+static int pdlua_redrawarray(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Table name string.
+  * */
+{
+    t_symbol    *name = gensym((char *) luaL_checkstring(L, 1));
+    t_garray    *a;
+    int         i;
+    double      wait;
+
+    PDLUA_DEBUG("pdlua_redrawarray: stack top is %d", lua_gettop(L));
+    if (pdlua_redrawinterval <= 0)
+    {
+        if ((a = (t_garray *) pd_findbyclass(name, garray_class))) garray_redraw(a);
+        PDLUA_DEBUG("pdlua_redrawarray: end 1. stack top is %d", lua_gettop(L));
+        return 0;
+    }
+    for (i = 0; i < pdlua_ndirtyarrays; i++)
+    {
+        if (pdlua_dirtyarrays[i] == name)
         {
-            if (i == *count)
+            PDLUA_DEBUG("pdlua_redrawarray: end 2. stack top is %d", lua_gettop(L));
+            return 0; /* already dirty, so the clock is set */
+        }
+    }
+    if (pdlua_ndirtyarrays == pdlua_dirtyarraysize)
+    {
+        int size = pdlua_dirtyarraysize ? 2 * pdlua_dirtyarraysize : 16;
+        pdlua_dirtyarrays = resizebytes(pdlua_dirtyarrays, pdlua_dirtyarraysize * sizeof(t_symbol *),
+            size * sizeof(t_symbol *));
+        pdlua_dirtyarraysize = size;
+    }
+    pdlua_dirtyarrays[pdlua_ndirtyarrays++] = name;
+    if (pdlua_ndirtyarrays == 1)
+    {
+        if (!pdlua_redrawclock) pdlua_redrawclock = clock_new(NULL, (t_method) pdlua_redrawclock_tick);
+        wait = pdlua_redrawinterval - clock_gettimesince(pdlua_redrawtime);
+        clock_delay(pdlua_redrawclock, wait > 0 ? wait : 0);
+    }
+    PDLUA_DEBUG("pdlua_redrawarray: end 3. stack top is %d", lua_gettop(L));
+    return 0;
+}
+
+/** Get or set the minimum time between array redraws. */
+static int pdlua_setredrawinterval(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Interval in milliseconds (0 redraws right away), or nil to leave it.
+  * \par Outputs:
+  * \li \c 1 The interval in milliseconds.
+  * */
+{
+    PDLUA_DEBUG("pdlua_setredrawinterval: stack top is %d", lua_gettop(L));
+    if (lua_isnumber(L, 1))
+    {
+        pdlua_redrawinterval = lua_tonumber(L, 1);
+        /* don't let arrays that are already dirty wait for the old interval */
+        if (pdlua_ndirtyarrays)
+        {
+            double wait = pdlua_redrawinterval - clock_gettimesince(pdlua_redrawtime);
+            if (pdlua_redrawinterval > 0) clock_delay(pdlua_redrawclock, wait > 0 ? wait : 0);
+            else
             {
-                pd_error(o, "lua: error: too many table elements");
-                ok = 0;
-                break;
+                clock_unset(pdlua_redrawclock);
+                pdlua_redrawclock_tick(NULL);
             }
-            switch (lua_type(L, -1))
+        }
+    }
+    lua_pushnumber(L, pdlua_redrawinterval);
+    PDLUA_DEBUG("pdlua_setredrawinterval: end. stack top is %d", lua_gettop(L));
+    return 1;
+}
+
+/** An entry in the log ring buffer. */
+typedef struct pdlua_logentry
+{
+    t_pdlua     *obj; /**< The object it's from, NULL if none (or deleted since). */
+    int         error; /**< An error (shown with pd_error()) or a post(). */
+    char        *msg; /**< The message. */
+    int         count; /**< How many times in a row it was logged. */
+    int         reported; /**< How many of those have been accounted for on the console. */
+    int         shown; /**< Whether it made it to the console at all. */
+    double      time; /**< Logical time it was last logged. */
+} t_pdlua_logentry;
+
+/** The last PDLUA_LOG_SIZE distinct messages; repeats only bump a counter.
+ * Messages are shown on Pd's console from a clock rather than right away, so
+ * that a flood of them costs little more than the copy into the ring. */
+static t_pdlua_logentry pdlua_logring[PDLUA_LOG_SIZE];
+static unsigned int pdlua_lognext = 0; /* number of entries ever started */
+static unsigned int pdlua_logflushed = 0; /* entries before this one have been flushed */
+static t_clock *pdlua_logclock = NULL;
+static int pdlua_logpending = 0;
+static double pdlua_logrepeattime = 0;
+/** Console rate limit for messages without object. */
+static t_pdlua_logbucket pdlua_lognullbucket = {PDLUA_LOG_BURST, 0, 0, 0};
+
+static void pdlua_logflush(void *dummy);
+
+static void pdlua_logschedule(double delay)
+{
+    if (!pdlua_logclock) pdlua_logclock = clock_new(NULL, (t_method) pdlua_logflush);
+    if (!pdlua_logpending || delay == 0) clock_delay(pdlua_logclock, delay);
+    pdlua_logpending = 1;
+}
+
+/** Take a token from the bucket, returns 0 if there was none. */
+static int pdlua_logbucket_take(t_pdlua_logbucket *b)
+{
+    b->tokens += clock_gettimesince(b->time) * PDLUA_LOG_RATE / 1000.;
+    if (b->tokens > PDLUA_LOG_BURST) b->tokens = PDLUA_LOG_BURST;
+    b->time = clock_getlogicaltime();
+    if (b->tokens < 1)
+    {
+        b->dropped++;
+        return 0;
+    }
+    b->tokens -= 1;
+    return 1;
+}
+
+/** Show the log entries that haven't been shown yet on Pd's console. */
+static void pdlua_logflush(void *dummy)
+{
+    unsigned int        i = pdlua_logflushed ? pdlua_logflushed - 1 : 0;
+    t_pdlua_logentry    *e;
+    t_pdlua_logbucket   *b;
+
+    pdlua_logpending = 0;
+    if (pdlua_lognext - i > PDLUA_LOG_SIZE) i = pdlua_lognext - PDLUA_LOG_SIZE;
+    for (; i < pdlua_lognext; i++)
+    {
+        e = &pdlua_logring[i % PDLUA_LOG_SIZE];
+        if (i < pdlua_logflushed)
+        {
+            /* flushed before, but it has been repeated since */
+            if (e->count > e->reported && e->shown && (i + 1 < pdlua_lognext ||
+                clock_gettimesince(pdlua_logrepeattime) >= PDLUA_LOG_REPEAT))
             {
-                case (LUA_TNUMBER):
-                    f = lua_tonumber(L, -1);
-                    SETFLOAT(&atoms[i], f);
-                    break;
-                case (LUA_TSTRING):
-                    s = lua_tolstring(L, -1, &sl);
-                    if (s)
-                    {
-                        if (strlen(s) != sl) pd_error(o, "lua: warning: symbol munged (contains \\0 in body)");
-                        SETSYMBOL(&atoms[i], gensym((char *) s));
-                    }
-                    else
-                    {
-                        pd_error(o, "lua: error: null string in table");
-                        ok = 0;
-                    }
-                    break;
-                case (LUA_TLIGHTUSERDATA): /* FIXME: check experimentality */
-                    p = lua_touserdata(L, -1);
-                    SETPOINTER(&atoms[i], p);
-                    break;
-                default:
-                    pd_error(o, "lua: error: table element must be number or string or pointer");
-                    ok = 0;
-                    break;
+                post("lua: (last message repeated %d more times)", e->count - e->reported);
+                e->reported = e->count;
+                pdlua_logrepeattime = clock_getlogicaltime();
             }
-            lua_pop(L, 1);
-            ++i;
+            continue;
+        }
+        b = e->obj ? &e->obj->log : &pdlua_lognullbucket;
+        if ((e->shown = pdlua_logbucket_take(b)))
+        {
+            if (e->error) pd_error(e->obj, "%s", e->msg);
+            else post("%s", e->msg);
+            if (e->count > 1) post("lua: (message repeated %d times)", e->count);
+        }
+        e->reported = e->count;
+    }
+    pdlua_logflushed = pdlua_lognext;
+    /* tell about messages dropped by the rate limit, at most once in a while per object */
+    for (i = pdlua_lognext > PDLUA_LOG_SIZE ? pdlua_lognext - PDLUA_LOG_SIZE : 0; i < pdlua_lognext; i++)
+    {
+        e = &pdlua_logring[i % PDLUA_LOG_SIZE];
+        b = e->obj ? &e->obj->log : &pdlua_lognullbucket;
+        if (b->dropped)
+        {
+            if (clock_gettimesince(b->noticetime) >= PDLUA_LOG_REPEAT)
+            {
+                pd_error(e->obj, "lua: %d messages not shown here (too many), send \"log\" to [pdlua] to see them", b->dropped);
+                b->dropped = 0;
+                b->noticetime = clock_getlogicaltime();
+            }
+            else pdlua_logschedule(PDLUA_LOG_REPEAT);
         }
-        if (i != *count)
+    }
+    /* report a repeating message later on, once it has settled */
+    if (pdlua_lognext)
+    {
+        e = &pdlua_logring[(pdlua_lognext - 1) % PDLUA_LOG_SIZE];
+        if (e->count > e->reported && e->shown) pdlua_logschedule(PDLUA_LOG_REPEAT);
+    }
+}
+
+/** Log a message from an object (or NULL) to the ring buffer and the console. */
+static void pdlua_log
+(
+    t_pdlua     *o, /**< The object the message is from, or NULL. */
+    int         error, /**< Whether it is an error. */
+    const char  *msg /**< The message. */
+)
+{
+    t_pdlua_logentry    *e;
+    size_t              len;
+
+    if (pdlua_lognext)
+    {
+        e = &pdlua_logring[(pdlua_lognext - 1) % PDLUA_LOG_SIZE];
+        if (e->obj == o && e->error == error && !strcmp(e->msg, msg))
         {
-            pd_error(o, "lua: error: too few table elements");
-            ok = 0;
+            e->count++;
+            e->time = clock_getlogicaltime();
+            pdlua_logschedule(pdlua_logflushed == pdlua_lognext ? PDLUA_LOG_REPEAT : 0);
+            return;
         }
     }
-    else 
+    /* overwriting an entry that hasn't been flushed yet loses it */
+    if (pdlua_lognext - pdlua_logflushed >= PDLUA_LOG_SIZE) pdlua_logflushed++;
+    e = &pdlua_logring[pdlua_lognext % PDLUA_LOG_SIZE];
+    if (e->msg) free(e->msg);
+    len = strlen(msg);
+    e->msg = malloc(len + 1);
+    memcpy(e->msg, msg, len + 1);
+    e->obj = o;
+    e->error = error;
+    e->count = 1;
+    e->reported = 0;
+    e->shown = 0;
+    e->time = clock_getlogicaltime();
+    pdlua_lognext++;
+    pdlua_logschedule(0);
+}
+
+/** Log a formatted message. */
+static void pdlua_logf(t_pdlua *o, int error, const char *fmt, ...)
+{
+    char    buf[MAXPDSTRING];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(buf, MAXPDSTRING, fmt, ap);
+    va_end(ap);
+    pdlua_log(o, error, buf);
+}
+
+/** Remove an object that is going away from the log. */
+static void pdlua_logforget(t_pdlua *o)
+{
+    int i;
+
+    for (i = 0; i < PDLUA_LOG_SIZE; i++)
     {
-        pd_error(o, "lua: error: not a table");
-        ok = 0;
+        if (pdlua_logring[i].obj == o) pdlua_logring[i].obj = NULL;
     }
-    lua_pop(L, 1);
-    PDLUA_DEBUG("pdlua_popatomtable: end. stack top %d", lua_gettop(L));
-    if (ok) return atoms;
-    if (atoms) free(atoms);
-    return NULL;
 }
 
-/** Send a message from a Lua object outlet. */
-static int pdlua_outlet(lua_State *L)
+/** Post all messages in the log ring buffer to Pd's console. */
+static int pdlua_logdump(lua_State *L)
+/**< Lua interpreter state. */
+{
+    unsigned int        i;
+    t_pdlua_logentry    *e;
+
+    PDLUA_DEBUG("pdlua_logdump: stack top is %d", lua_gettop(L));
+    i = pdlua_lognext > PDLUA_LOG_SIZE ? pdlua_lognext - PDLUA_LOG_SIZE : 0;
+    post("lua: log: last %u of %u messages:", pdlua_lognext - i, pdlua_lognext);
+    for (; i < pdlua_lognext; i++)
+    {
+        e = &pdlua_logring[i % PDLUA_LOG_SIZE];
+        if (e->count > 1)
+            post("[%.3f s ago, %d times] %s%s", clock_gettimesince(e->time) / 1000.,
+                e->count, e->error ? "error: " : "", e->msg);
+        else
+            post("[%.3f s ago] %s%s", clock_gettimesince(e->time) / 1000.,
+                e->error ? "error: " : "", e->msg);
+    }
+    PDLUA_DEBUG("pdlua_logdump: end. stack top is %d", lua_gettop(L));
+    return 0;
+}
+
+/** Turn recording of a trace of the Lua message flow on or off. */
+static int pdlua_trace_enable(lua_State *L)
 /**< Lua interpreter state.
   * \par Inputs:
-  * \li \c 1 Pd object pointer.
-  * \li \c 2 Outlet number.
-  * \li \c 3 Message selector string.
-  * \li \c 4 Message atom table.
+  * \li \c 1 Boolean, true to start a new trace, false to stop recording.
   * */
 {
-    t_pdlua         *o;
-    int             out;
-    size_t          sl;
-    const char      *s;
-    t_symbol        *sym;
-    int             count;
-    t_atom          *atoms;
-
-    PDLUA_DEBUG("pdlua_outlet: stack top %d", lua_gettop(L));
-    if (lua_islightuserdata(L, 1))
+    PDLUA_DEBUG("pdlua_trace_enable: stack top is %d", lua_gettop(L));
+    if (lua_toboolean(L, 1))
     {
-        o = lua_touserdata(L, 1);
-        if (o) 
-        {
-            if (lua_isnumber(L, 2)) out = lua_tonumber(L, 2) - 1; /* C has 0.., Lua has 1.. */
-            else
-            {
-                pd_error(o, "lua: error: outlet must be a number");
-                lua_pop(L, 4); /* pop all the arguments */
-                return 0;
-            }
-            if (0 <= out && out < o->outlets) 
-            {
-                if (lua_isstring(L, 3)) 
-                {
-                    s = lua_tolstring(L, 3, &sl);
-                    sym = gensym((char *) s); /* const cast */
-                    if (s)
-                    {
-                        if (strlen(s) != sl) pd_error(o, "lua: warning: symbol munged (contains \\0 in body)");
-                        lua_pushvalue(L, 4);
-                        atoms = pdlua_popatomtable(L, &count, o);
-                        if (count == 0 || atoms) outlet_anything(o->out[out], sym, count, atoms);
-                        else pd_error(o, "lua: error: no atoms??");
-                        if (atoms) 
-                        {
-                            free(atoms);
-                            lua_pop(L, 4); /* pop all the arguments */
-                            return 0;
-                        }
-                    }
-                    else pd_error(o, "lua: error: null selector");
-                }
-                else pd_error(o, "lua: error: selector must be a string");
-            }
-            else pd_error(o, "lua: error: outlet out of range");
-        }
-        else pd_error(NULL, "lua: error: no object to outlet from");
+        if (!pdlua_trace) pdlua_trace = getbytes(PDLUA_TRACE_SIZE * sizeof(t_pdlua_traceevent));
+        pdlua_tracenext = 0;
+        pdlua_tracestart = sys_getrealtime();
+        pdlua_tracing = 1;
     }
-    else pd_error(NULL, "lua: error: bad arguments to outlet");
-    lua_pop(L, 4); /* pop all the arguments */
-    PDLUA_DEBUG("pdlua_outlet: end. stack top %d", lua_gettop(L));
+    else pdlua_tracing = 0;
+    PDLUA_DEBUG("pdlua_trace_enable: end. stack top is %d", lua_gettop(L));
     return 0;
 }
 
-/** Send a message from a Lua object to a Pd receiver. */
-static int pdlua_send(lua_State *L)
+/** Write a string as a JSON string literal. */
+static void pdlua_trace_writestring(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; s++)
+    {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') fprintf(f, "\\%c", c);
+        else if (c < 0x20) fprintf(f, "\\u%04x", c);
+        else fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+/** Write the recorded trace to a file, in Chrome's trace event format.
+ * The file can be opened in chrome://tracing or https://ui.perfetto.dev */
+static int pdlua_trace_write(lua_State *L)
 /**< Lua interpreter state.
   * \par Inputs:
-  * \li \c 1 Receiver string.
-  * \li \c 2 Message selector string.
-  * \li \c 3 Message atom table.
+  * \li \c 1 Pd object pointer, the file name is relative to its patch.
+  * \li \c 2 File name string.
   * */
+{
+    static const char   *kinds[] = {"dispatch", "outlet", "send", "clock", "receive"};
+    t_pdlua             *o = lua_islightuserdata(L, 1) ? lua_touserdata(L, 1) : NULL;
+    const char          *filename = luaL_checkstring(L, 2);
+    char                path[MAXPDSTRING];
+    FILE                *f;
+    unsigned int        i, n;
+    t_pdlua_traceevent  *e;
+
+    PDLUA_DEBUG("pdlua_trace_write: stack top is %d", lua_gettop(L));
+    if (!pdlua_trace)
+    {
+        pd_error(o, "lua: error: no trace recorded");
+        return 0;
+    }
+    if (o) canvas_makefilename(o->canvas, filename, path, MAXPDSTRING);
+    else snprintf(path, MAXPDSTRING, "%s", filename);
+    if (!(f = fopen(path, "w")))
+    {
+        pd_error(o, "lua: error: can't write trace to `%s'", path);
+        return 0;
+    }
+    n = pdlua_tracenext < PDLUA_TRACE_SIZE ? pdlua_tracenext : PDLUA_TRACE_SIZE;
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (i = pdlua_tracenext - n; i != pdlua_tracenext; i++)
+    {
+        e = &pdlua_trace[i & (PDLUA_TRACE_SIZE - 1)];
+        fprintf(f, "{\"name\":");
+        pdlua_trace_writestring(f, e->sel->s_name);
+        fprintf(f, ",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f,\"args\":{",
+            kinds[e->kind], (e->start - pdlua_tracestart) * 1e6, (e->end - e->start) * 1e6);
+        if (e->obj) fprintf(f, "\"object\":\"%p\",", e->obj);
+        fprintf(f, e->kind == PDLUA_TRACE_SEND || e->kind == PDLUA_TRACE_RECEIVE ? "\"receiver\":" : "\"class\":");
+        pdlua_trace_writestring(f, e->name->s_name);
+        if (e->port) fprintf(f, ",\"%s\":%d", e->kind == PDLUA_TRACE_DISPATCH ? "inlet" : "outlet", e->port);
+        fprintf(f, "}}%s\n", i + 1 != pdlua_tracenext ? "," : "");
+    }
+    fprintf(f, "]}\n");
+    fclose(f);
+    post("lua: wrote %u trace events to %s%s", n, path,
+        pdlua_tracenext > n ? " (older events were overwritten)" : "");
+    PDLUA_DEBUG("pdlua_trace_write: end. stack top is %d", lua_gettop(L));
+    return 0;
+}
 
+/** Start or stop recording the messages to Lua objects. */
+static int pdlua_record(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Pd object pointer, the file name is relative to its patch.
+  * \li \c 2 File name string to start a new recording, or nil to stop.
+  * */
 {
-    size_t          receivenamel;
-    const char      *receivename;
-    t_symbol        *receivesym;
-    size_t          selnamel;
-    const char      *selname;
-    t_symbol        *selsym;
-    int             count;
-    t_atom          *atoms;
+    t_pdlua     *o = lua_islightuserdata(L, 1) ? lua_touserdata(L, 1) : NULL;
+    char        path[MAXPDSTRING];
 
-    PDLUA_DEBUG("pdlua_send: stack top is %d", lua_gettop(L));
-    if (lua_isstring(L, 1)) 
+    PDLUA_DEBUG("pdlua_record: stack top is %d", lua_gettop(L));
+    if (pdlua_recfile)
     {
-        receivename = lua_tolstring(L, 1, &receivenamel);
-        receivesym = gensym((char *) receivename); /* const cast */
-        if (receivesym) 
+        int err = ferror(pdlua_recfile);
+        if (fclose(pdlua_recfile) || err) pd_error(o, "lua: error: writing the recording failed");
+        else post("lua: recorded %u objects", pdlua_recobjects);
+        pdlua_recfile = NULL;
+    }
+    if (lua_isstring(L, 2))
+    {
+        if (o) canvas_makefilename(o->canvas, lua_tostring(L, 2), path, MAXPDSTRING);
+        else snprintf(path, MAXPDSTRING, "%s", lua_tostring(L, 2));
+        if (!(pdlua_recfile = fopen(path, "wb")))
         {
-            if (strlen(receivename) != receivenamel) pd_error(NULL, "lua: warning: symbol munged (contains \\0 in body)");
-            if (lua_isstring(L, 2)) 
-            {
-                selname = lua_tolstring(L, 2, &selnamel);
-                selsym = gensym((char *) selname); /* const cast */
-                if (selsym)
-                {
-                    if (strlen(selname) != selnamel) pd_error(NULL, "lua: warning: symbol munged (contains \\0 in body)");
-                    lua_pushvalue(L, 3);
-                    atoms = pdlua_popatomtable(L, &count, NULL);
-                    if ((count == 0 || atoms) && (receivesym->s_thing)) typedmess(receivesym->s_thing, selsym, count, atoms);
-                    else pd_error(NULL, "lua: error: no atoms??");
-                    if (atoms) 
-                    {
-                        free(atoms);
-                        PDLUA_DEBUG("pdlua_send: success end. stack top is %d", lua_gettop(L));
-                        return 0;
-                    }
-                }
-                else pd_error(NULL, "lua: error: null selector");
-            }
-            else pd_error(NULL, "lua: error: selector must be a string");
+            pd_error(o, "lua: error: can't write recording to `%s'", path);
+            return 0;
         }
-        else pd_error(NULL, "lua: error: null receive name");
+        fwrite(PDLUA_REC_MAGIC, 1, strlen(PDLUA_REC_MAGIC), pdlua_recfile);
+        if (pdlua_recsyms) memset(pdlua_recsyms, 0, pdlua_recsymsize * sizeof(t_pdlua_recsym));
+        pdlua_recsymcount = 0;
+        pdlua_recobjects = 0;
+        pdlua_recgen++;
+        pdlua_recstart = clock_getlogicaltime();
+        pdlua_recskip = gensym("pdlua");
+        post("lua: recording the messages to Lua objects to %s", path);
     }
-    else pd_error(NULL, "lua: error: receive name must be string");
-    PDLUA_DEBUG("pdlua_send: fail end. stack top is %d", lua_gettop(L));
+    PDLUA_DEBUG("pdlua_record: end. stack top is %d", lua_gettop(L));
     return 0;
 }
 
-/** Set a [value] object's value. */
-static int pdlua_setvalue(lua_State *L)
-/**< Lua interpreter state.
-  * \par Inputs:
-  * \li \c 1 Value name string.
-  * \li \c 2 Value number.
-  * \par Outputs:
-  * \li \c 1 success (usually depends on a [value] existing or not).
-  */
+/** Read an unsigned varint from a recording. */
+static int pdlua_replay_uint(t_pdlua_replay *r, unsigned int *v)
 {
-    const char  *str = luaL_checkstring(L, 1);
-    t_float     val = luaL_checknumber(L, 2);
-    int         err = value_setfloat(gensym(str), val);
+    unsigned int shift;
 
-    PDLUA_DEBUG("pdlua_setvalue: stack top is %d", lua_gettop(L));
-    lua_pushboolean(L, !err);
-    PDLUA_DEBUG("pdlua_setvalue: end. stack top is %d", lua_gettop(L));
+    *v = 0;
+    for (shift = 0; r->pos < r->size && shift < 32; shift += 7)
+    {
+        unsigned char c = r->buf[r->pos++];
+        *v |= (unsigned int) (c & 0x7f) << shift;
+        if (!(c & 0x80)) return 1;
+    }
+    return 0;
+}
+
+static int pdlua_replay_double(t_pdlua_replay *r, double *d)
+{
+    uint64_t    u = 0;
+    int         i;
+
+    if (r->size - r->pos < 8) return 0;
+    for (i = 0; i < 8; i++) u |= (uint64_t) r->buf[r->pos++] << (8 * i);
+    memcpy(d, &u, sizeof(*d));
     return 1;
 }
 
-/** Get a [value] object's value. */
-static int pdlua_getvalue(lua_State *L)
-/**< Lua interpreter state.
-  * \par Inputs:
-  * \li \c 1 Value name string.
-  * \par Outputs:
-  * \li \c 1 Value number, or nil for failure.
-  * */
+static int pdlua_replay_symbol(t_pdlua_replay *r, t_symbol **s)
 {
-    const char  *str = luaL_checkstring(L, 1);
-    t_float     val;
-    int         err = value_getfloat(gensym(str), &val);
+    unsigned int id;
 
-    PDLUA_DEBUG("pdlua_getvalue: stack top is %d", lua_gettop(L));
-    if (!err) lua_pushnumber(L, val);
-    else lua_pushnil(L);
-    PDLUA_DEBUG("pdlua_getvalue: end. stack top is %d", lua_gettop(L));
+    if (!pdlua_replay_uint(r, &id) || id >= r->nsyms) return 0;
+    *s = r->syms[id];
     return 1;
 }
 
-/** Get a [table] object's array. */
-static int pdlua_getarray(lua_State *L)
-/**< Lua interpreter state.
-  * \par Inputs:
-  * \li \c 1 Table name string.
-  * \par Outputs:
-  * \li \c 1 Table length, or < 0 for failure.
-  * \li \c 2 Table pointer, or nil for failure.
-  * */
+/** Read atoms from a recording into r->argv. */
+static int pdlua_replay_atoms(t_pdlua_replay *r, int *argc)
 {
-    t_garray        *a;
-    int             n;
-    PDLUA_ARRAYTYPE *v;
-    const char      *str = luaL_checkstring(L, 1);
+    unsigned int    i, n;
+    double          f;
+    t_symbol        *s;
 
-    PDLUA_DEBUG("pdlua_getarray: stack top is %d", lua_gettop(L));
-    if (!(a = (t_garray *) pd_findbyclass(gensym(str), garray_class))) 
+    /* each atom takes a byte at least, which keeps bogus counts in check */
+    if (!pdlua_replay_uint(r, &n) || n > r->size - r->pos) return 0;
+    if ((int) n > r->maxargs)
     {
-        lua_pushnumber(L, -1);
-        PDLUA_DEBUG("pdlua_getarray: end 1. stack top is %d", lua_gettop(L));
-        return 1;
+        r->argv = resizebytes(r->argv, r->maxargs * sizeof(t_atom), n * sizeof(t_atom));
+        r->maxargs = n;
     }
-    else if (!PDLUA_ARRAYGRAB(a, &n, &v)) 
+    for (i = 0; i < n; i++)
+    {
+        if (r->pos >= r->size) return 0;
+        switch (r->buf[r->pos++])
+        {
+        case 'f':
+            if (!pdlua_replay_double(r, &f)) return 0;
+            SETFLOAT(&r->argv[i], f);
+            break;
+        case 's':
+            if (!pdlua_replay_symbol(r, &s)) return 0;
+            SETSYMBOL(&r->argv[i], s);
+            break;
+        case 'p':
+            /* pointers don't survive the recording */
+            SETSYMBOL(&r->argv[i], &s_);
+            break;
+        default:
+            return 0;
+        }
+    }
+    *argc = n;
+    return 1;
+}
+
+/** Add the time a callback took to the stats of a replay. */
+static void pdlua_replay_count(t_pdlua_replay *r, t_symbol *name, unsigned int inlet, t_symbol *sel, double t)
+{
+    t_pdlua_replaystat  *st;
+    int                 i;
+
+    for (i = 0; i < r->nstats; i++)
+    {
+        st = &r->stats[i];
+        if (st->name == name && st->inlet == inlet && st->sel == sel) break;
+    }
+    if (i == r->nstats)
+    {
+        if (r->nstats == r->maxstats)
+        {
+            int size = r->maxstats ? 2 * r->maxstats : 32;
+            r->stats = resizebytes(r->stats, r->maxstats * sizeof(t_pdlua_replaystat), size * sizeof(t_pdlua_replaystat));
+            r->maxstats = size;
+        }
+        st = &r->stats[r->nstats++];
+        st->name = name;
+        st->inlet = inlet;
+        st->sel = sel;
+        st->count = 0;
+        st->total = st->max = 0;
+    }
+    st->count++;
+    st->total += t;
+    if (t > st->max) st->max = t;
+}
+
+/** Replay the creation of an object. */
+static int pdlua_replay_new(t_pdlua_replay *r)
+{
+    unsigned int    id;
+    t_symbol        *name;
+    t_pd            *x;
+    int             argc;
+    double          t;
+
+    if (!pdlua_replay_uint(r, &id) || !pdlua_replay_symbol(r, &name) || !pdlua_replay_atoms(r, &argc)) return 0;
+    if (!id || id > r->size) return 0; /* ids are handed out from 1 with a record each */
+    if (id >= r->maxobjs)
+    {
+        unsigned int size = r->maxobjs ? 2 * r->maxobjs : 64;
+        while (size <= id) size *= 2;
+        r->objs = resizebytes(r->objs, r->maxobjs * sizeof(t_pdlua *), size * sizeof(t_pdlua *));
+        memset(r->objs + r->maxobjs, 0, (size - r->maxobjs) * sizeof(t_pdlua *));
+        r->maxobjs = size;
+    }
+    if (r->objs[id]) return 0;
+    t = sys_getrealtime();
+    canvas_setcurrent(r->owner->canvas);
+    pd_typedmess(&pd_objectmaker, name, argc, r->argv);
+    canvas_unsetcurrent(r->owner->canvas);
+    t = sys_getrealtime() - t;
+    x = pd_newest();
+    if (x && (*x)->c_freemethod == (t_method) pdlua_free)
+    {
+        r->objs[id] = (t_pdlua *) x;
+        pdlua_replay_count(r, PDLUA_CLASSNAME(x), 0, gensym("new"), t);
+    }
+    else pd_error(r->owner, "lua: error: replay couldn't create [%s], skipping its messages", name->s_name);
+    return 1;
+}
+
+/** Replay a message to an object. */
+static int pdlua_replay_message(t_pdlua_replay *r)
+{
+    unsigned int    id, inlet;
+    t_symbol        *sel;
+    t_pdlua         *o;
+    int             argc;
+    double          t;
+
+    if (!pdlua_replay_uint(r, &id) || !pdlua_replay_uint(r, &inlet) || !pdlua_replay_symbol(r, &sel) ||
+        !pdlua_replay_atoms(r, &argc)) return 0;
+    o = id < r->maxobjs ? r->objs[id] : NULL;
+    if (!o || inlet < 1 || (int) inlet > o->inlets) return 1;
+    t = sys_getrealtime();
+    pdlua_proxyinlet_anything(&o->in[inlet - 1], sel, argc, r->argv);
+    pdlua_replay_count(r, PDLUA_CLASSNAME(o), inlet, sel, sys_getrealtime() - t);
+    return 1;
+}
+
+/** Replay the destruction of an object. */
+static int pdlua_replay_free(t_pdlua_replay *r)
+{
+    unsigned int id;
+
+    if (!pdlua_replay_uint(r, &id)) return 0;
+    if (id < r->maxobjs && r->objs[id])
+    {
+        pd_free((t_pd *) r->objs[id]);
+        r->objs[id] = NULL;
+    }
+    return 1;
+}
+
+static int pdlua_replay_cmp(const void *a, const void *b)
+{
+    double ta = ((const t_pdlua_replaystat *) a)->total, tb = ((const t_pdlua_replaystat *) b)->total;
+    return ta < tb ? 1 : ta > tb ? -1 : 0;
+}
+
+/** Post the time spent in the callbacks of a replay, most expensive first. */
+static void pdlua_replay_report(t_pdlua_replay *r)
+{
+    t_pdlua_replaystat  *st;
+    unsigned int        count = 0;
+    double              total = 0;
+    int                 i;
+
+    qsort(r->stats, r->nstats, sizeof(t_pdlua_replaystat), pdlua_replay_cmp);
+    for (i = 0; i < r->nstats; i++)
     {
-        lua_pushnumber(L, -2);
-        PDLUA_DEBUG("pdlua_getarray: end 2. stack top is %d", lua_gettop(L));
-        return 1;
+        count += r->stats[i].count;
+        total += r->stats[i].total;
     }
-    else 
+    post("lua: replay of %s: %u callbacks, %.3f ms", r->path->s_name, count, total * 1e3);
+    post("lua:   total ms      count    mean us     max us  callback");
+    for (i = 0; i < r->nstats; i++)
     {
-        lua_pushnumber(L, n);
-        lua_pushlightuserdata(L, v);
-        PDLUA_DEBUG("pdlua_getarray: end 3. stack top is %d", lua_gettop(L));
-        return 2;
+        st = &r->stats[i];
+        if (st->inlet) post("lua: %10.3f %10u %10.2f %10.2f  [%s] inlet %u %s", st->total * 1e3, st->count,
+            st->total * 1e6 / st->count, st->max * 1e6, st->name->s_name, st->inlet, st->sel->s_name);
+        else post("lua: %10.3f %10u %10.2f %10.2f  [%s] new", st->total * 1e3, st->count,
+            st->total * 1e6 / st->count, st->max * 1e6, st->name->s_name);
     }
 }
 
-/** Read from a [table] object's array. */
-static int pdlua_readarray(lua_State *L)
-/**< Lua interpreter state.
-  * \par Inputs:
-  * \li \c 1 Table length number.
-  * \li \c 2 Table array pointer.
-  * \li \c 3 Table index number.
-  * \par Outputs:
-  * \li \c 1 Table element value, or nil for index out of range.
-  * */
+/** Replay the records that are due, called from the replay's clock. */
+static void pdlua_replay_tick(t_pdlua_replay *r)
 {
-    int             n = luaL_checknumber(L, 1);
-    PDLUA_ARRAYTYPE *v = lua_islightuserdata(L, 2) ? lua_touserdata(L, 2) : NULL;
-    int             i = luaL_checknumber(L, 3);
+    double          now = clock_gettimesince(r->start), time;
+    size_t          record = r->pos;
+    unsigned char   type;
+    int             ok = 1;
 
-    PDLUA_DEBUG("pdlua_readarray: stack top is %d", lua_gettop(L));
-    if (0 <= i && i < n && v) 
+    PDLUA_DEBUG("pdlua_replay_tick: stack top %d", lua_gettop(__L));
+    r->busy++;
+    while (ok && !r->dead && r->pos < r->size)
     {
-        lua_pushnumber(L, PDLUA_ARRAYELEM(v, i));
-        PDLUA_DEBUG("pdlua_readarray: end 1. stack top is %d", lua_gettop(L));
-        return 1;
+        record = r->pos;
+        type = r->buf[r->pos++];
+        if (type == PDLUA_REC_SYMBOL)
+        {
+            unsigned int len;
+            char buf[MAXPDSTRING];
+            if (!(ok = pdlua_replay_uint(r, &len) && len < MAXPDSTRING && len <= r->size - r->pos)) break;
+            memcpy(buf, r->buf + r->pos, len);
+            buf[len] = 0;
+            r->pos += len;
+            if (r->nsyms == r->maxsyms)
+            {
+                unsigned int size = r->maxsyms ? 2 * r->maxsyms : 256;
+                r->syms = resizebytes(r->syms, r->maxsyms * sizeof(t_symbol *), size * sizeof(t_symbol *));
+                r->maxsyms = size;
+            }
+            r->syms[r->nsyms++] = gensym(buf);
+            continue;
+        }
+        if (!(ok = pdlua_replay_double(r, &time))) break;
+        if (time > now)
+        {
+            /* not due yet, come back for it */
+            r->pos = record;
+            r->busy--;
+            clock_delay(r->clock, time - now);
+            PDLUA_DEBUG("pdlua_replay_tick: end. stack top %d", lua_gettop(__L));
+            return;
+        }
+        switch (type)
+        {
+        case PDLUA_REC_NEW: ok = pdlua_replay_new(r); break;
+        case PDLUA_REC_MESSAGE: ok = pdlua_replay_message(r); break;
+        case PDLUA_REC_FREE: ok = pdlua_replay_free(r); break;
+        default: ok = 0;
+        }
     }
-    PDLUA_DEBUG("pdlua_readarray: end 2. stack top is %d", lua_gettop(L));
-    return 0;
+    r->busy--;
+    if (!ok) pd_error(r->dead ? NULL : r->owner, "lua: error: %s is damaged at byte %lu, replay stopped",
+        r->path->s_name, (unsigned long) record);
+    pdlua_replay_stop(r, 0);
+    PDLUA_DEBUG("pdlua_replay_tick: end. stack top %d", lua_gettop(__L));
 }
 
-/** Write to a [table] object's array. */
-static int pdlua_writearray(lua_State *L)
-/**< Lua interpreter state.
-  * \par Inputs:
-  * \li \c 1 Table length number.
-  * \li \c 2 Table array pointer.
-  * \li \c 3 Table index number.
-  * \li \c 4 Table element value number.
-  * */
+/** Stop a replay, done or not, post its report and free the objects it
+ * created. When the [pdlua] object that started it is deleted, it stops
+ * quietly, as the patch may be going away. */
+static void pdlua_replay_stop(t_pdlua_replay *r, int quiet)
 {
-    int                 n = luaL_checknumber(L, 1);
-    PDLUA_ARRAYTYPE     *v = lua_islightuserdata(L, 2) ? lua_touserdata(L, 2) : NULL;
-    int                 i = luaL_checknumber(L, 3);
-    t_float             x = luaL_checknumber(L, 4);
+    unsigned int i;
 
-    PDLUA_DEBUG("pdlua_writearray: stack top is %d", lua_gettop(L));
-    if (0 <= i && i < n && v) PDLUA_ARRAYELEM(v, i) = x;
-    PDLUA_DEBUG("pdlua_writearray: end. stack top is %d", lua_gettop(L));
-    return 0;
+    if (quiet) r->quiet = 1;
+    if (r->busy)
+    {
+        /* we're being stopped while replaying, pdlua_replay_tick() will finish the job */
+        r->dead = 1;
+        return;
+    }
+    if (!r->quiet) pdlua_replay_report(r);
+    quiet = r->quiet;
+    clock_free(r->clock);
+    for (i = 0; i < r->maxobjs; i++)
+        if (r->objs[i]) pd_free((t_pd *) r->objs[i]);
+    if (r->objs) freebytes(r->objs, r->maxobjs * sizeof(t_pdlua *));
+    if (r->syms) freebytes(r->syms, r->maxsyms * sizeof(t_symbol *));
+    if (r->argv) freebytes(r->argv, r->maxargs * sizeof(t_atom));
+    if (r->stats) freebytes(r->stats, r->maxstats * sizeof(t_pdlua_replaystat));
+    freebytes(r->buf, r->size);
+    freebytes(r, sizeof(t_pdlua_replay));
+    if (pdlua_replaying == r) pdlua_replaying = NULL;
+    /* lets a headless run quit when it's done: [r pdlua-replayed] */
+    if (!quiet && gensym("pdlua-replayed")->s_thing) pd_bang(gensym("pdlua-replayed")->s_thing);
 }
 
-/** Redraw a [table] object's graph. */
-static int pdlua_redrawarray(lua_State *L)
+/** Start or stop replaying a recording. */
+static int pdlua_replay(lua_State *L)
 /**< Lua interpreter state.
   * \par Inputs:
-  * \li \c 1 Table name string.
+  * \li \c 1 Pd object pointer, the file name is relative to its patch.
+  * \li \c 2 File name string to start a replay, or nil to stop it.
   * */
 {
-    t_garray    *a;
-    const char  *str = luaL_checkstring(L, 1);
+    t_pdlua         *o = lua_islightuserdata(L, 1) ? lua_touserdata(L, 1) : NULL;
+    char            path[MAXPDSTRING];
+    t_pdlua_replay  *r;
+    FILE            *f;
+    long            size;
+    size_t          magic = strlen(PDLUA_REC_MAGIC);
 
-    PDLUA_DEBUG("pdlua_redrawarray: stack top is %d", lua_gettop(L));
-    if ((a = (t_garray *) pd_findbyclass(gensym(str), garray_class))) garray_redraw(a);
-    PDLUA_DEBUG("pdlua_redrawarray: end. stack top is %d", lua_gettop(L));
+    PDLUA_DEBUG("pdlua_replay: stack top is %d", lua_gettop(L));
+    if (!o) return 0;
+    if (!lua_isstring(L, 2))
+    {
+        if (pdlua_replaying) pdlua_replay_stop(pdlua_replaying, 0);
+        return 0;
+    }
+    if (pdlua_replaying)
+    {
+        pd_error(o, "lua: error: there is a replay running already");
+        return 0;
+    }
+    canvas_makefilename(o->canvas, lua_tostring(L, 2), path, MAXPDSTRING);
+    if (!(f = fopen(path, "rb")))
+    {
+        pd_error(o, "lua: error: can't open recording `%s'", path);
+        return 0;
+    }
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    r = getbytes(sizeof(t_pdlua_replay));
+    r->size = size > 0 ? size : 0;
+    r->buf = getbytes(r->size);
+    if (r->size < magic || fread(r->buf, 1, r->size, f) != r->size || memcmp(r->buf, PDLUA_REC_MAGIC, magic))
+    {
+        pd_error(o, "lua: error: `%s' is not a recording", path);
+        fclose(f);
+        freebytes(r->buf, r->size);
+        freebytes(r, sizeof(t_pdlua_replay));
+        return 0;
+    }
+    fclose(f);
+    r->pos = magic;
+    r->owner = o;
+    r->path = gensym(path);
+    r->start = clock_getlogicaltime();
+    r->clock = clock_new(r, (t_method) pdlua_replay_tick);
+    clock_delay(r->clock, 0);
+    pdlua_replaying = r;
+    PDLUA_DEBUG("pdlua_replay: end. stack top is %d", lua_gettop(L));
     return 0;
 }
 
@@ -1440,7 +6566,8 @@ static int pdlua_post(lua_State *L)
 {
     const char *str = luaL_checkstring(L, 1);
     PDLUA_DEBUG("pdlua_post: stack top is %d", lua_gettop(L));
-    post("%s", str);
+    /* counts against the rate limit of the object whose code is running */
+    pdlua_log(pdlua_frames ? pdlua_frames->obj : NULL, 0, str);
     PDLUA_DEBUG("pdlua_post: end. stack top is %d", lua_gettop(L));
     return 0;
 }
@@ -1465,7 +6592,7 @@ static int pdlua_error(lua_State *L)
         if (o)
         {
             s = luaL_checkstring(L, 2);
-            if (s) pd_error(o, "%s", s);
+            if (s) pdlua_log(o, 1, s);
             else pd_error(o, "lua: error: null string in error function");
         }
         else pd_error(NULL, "lua: error: null object in error function");
@@ -1584,6 +6711,58 @@ static int pdlua_dofilex(lua_State *L)
     return lua_gettop(L) - n;
 }
 
+/** Compile a Lua script using the path of a class, without running it,
+ * so that a reload can tell if the script failed to compile or to run. */
+static int pdlua_loadfilex(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Pd class pointer.
+  * \li \c 2 Filename string.
+  * \par Outputs:
+  * \li \c 1 The compiled script as a function, or nil for failure.
+  * \li \c 2 The directory it was found in, or the error message.
+  * */
+{
+    char                buf[MAXPDSTRING];
+    char                *ptr;
+    t_pdlua_readerdata  reader;
+    int                 fd;
+    int                 err;
+    t_class             *c = lua_islightuserdata(L, 1) ? lua_touserdata(L, 1) : NULL;
+    const char          *filename = luaL_checkstring(L, 2);
+
+    PDLUA_DEBUG("pdlua_loadfilex: stack top %d", lua_gettop(L));
+    if (!c)
+    {
+        lua_pushnil(L);
+        lua_pushstring(L, "no such class");
+        return 2;
+    }
+    fd = sys_trytoopenone(c->c_externdir->s_name, filename, "", buf, &ptr, MAXPDSTRING, 1);
+    if (fd < 0)
+    {
+        lua_pushnil(L);
+        lua_pushfstring(L, "can't open `%s'", filename);
+        return 2;
+    }
+    reader.fd = fd;
+#if LUA_VERSION_NUM	< 502
+    err = lua_load(L, pdlua_reader, &reader, filename);
+#else // 5.2 style
+    err = lua_load(L, pdlua_reader, &reader, filename, NULL);
+#endif // LUA_VERSION_NUM	< 502
+    close(fd);
+    if (err)
+    {
+        lua_pushnil(L);
+        lua_insert(L, -2); /* nil before the error message */
+        return 2;
+    }
+    lua_pushstring(L, buf);
+    PDLUA_DEBUG("pdlua_loadfilex: end. stack top %d", lua_gettop(L));
+    return 2;
+}
+
 /** Run a Lua script using Pd's path. */
 static int pdlua_dofile(lua_State *L)
 /**< Lua interpreter state.
@@ -1655,10 +6834,163 @@ static int pdlua_dofile(lua_State *L)
     return lua_gettop(L) - n;
 }
 
+#ifdef PDLUA_INOTIFY
+/** A directory watched for changed scripts. */
+typedef struct pdlua_watchdir
+{
+    int         wd; /**< The inotify watch descriptor. */
+    t_symbol    *dir; /**< The canonical path of the directory. */
+} t_pdlua_watchdir;
+
+/** The inotify instance, or -1 if nothing is watched. */
+static int pdlua_inotify_fd = -1;
+/** The directories being watched. */
+static t_pdlua_watchdir *pdlua_watchdirs = NULL;
+static int pdlua_nwatchdirs = 0;
+
+/** Called from Pd's scheduler when the inotify descriptor is readable. */
+static void pdlua_watch_poll(void *dummy, int fd)
+{
+    /* inotify needs a buffer aligned for its event structures */
+    char        buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    char        path[MAXPDSTRING];
+    ssize_t     len;
+    char        *ptr;
+    int         i, npaths = 0;
+
+    PDLUA_DEBUG("pdlua_watch_poll: stack top %d", lua_gettop(__L));
+    PDLUA_ARRAYS_MAYCHANGE();
+    /* collect the changed paths in a set first, editors often produce several
+       events per save, and the script only needs to be reloaded once */
+    lua_newtable(__L);
+    while ((len = read(fd, buf, sizeof(buf))) > 0)
+    {
+        for (ptr = buf; ptr < buf + len; )
+        {
+            const struct inotify_event *ev = (const struct inotify_event *)ptr;
+            ptr += sizeof(struct inotify_event) + ev->len;
+            if (!ev->len) continue;
+            for (i = 0; i < pdlua_nwatchdirs; i++)
+            {
+                if (pdlua_watchdirs[i].wd == ev->wd) break;
+            }
+            if (i == pdlua_nwatchdirs) continue;
+            snprintf(path, MAXPDSTRING, "%s/%s", pdlua_watchdirs[i].dir->s_name, ev->name);
+            lua_pushstring(__L, path);
+            lua_pushboolean(__L, 1);
+            lua_settable(__L, -3);
+            npaths++;
+        }
+    }
+    if (!npaths)
+    {
+        lua_pop(__L, 1);
+        return;
+    }
+    lua_getglobal(__L, "pd");
+    lua_getfield(__L, -1, "_hotreload");
+    lua_pushvalue(__L, -3);
+    if (lua_pcall(__L, 1, 0, 0))
+    {
+        pd_error(NULL, "lua: error in hot reload:\n%s", lua_tostring(__L, -1));
+        lua_pop(__L, 1);
+    }
+    lua_pop(__L, 2); /* pop the pd table and the set of paths */
+    PDLUA_DEBUG("pdlua_watch_poll: end. stack top %d", lua_gettop(__L));
+}
+#endif // PDLUA_INOTIFY
+
+/** Start watching a script file for changes.
+ * The containing directory is watched rather than the file itself, so that
+ * editors which save by replacing the file are handled as well. */
+static int pdlua_watchfile(lua_State *L)
+/**< Lua interpreter state.
+  * \par Inputs:
+  * \li \c 1 Path of the script.
+  * \par Outputs:
+  * \li \c 1 Canonical path of the script (as passed to pd._hotreload), or nil if it can't be watched.
+  * */
+{
+#ifdef PDLUA_INOTIFY
+    const char  *path = luaL_checkstring(L, 1);
+    const char  *name = strrchr(path, '/');
+    char        dir[MAXPDSTRING];
+    char        real[PATH_MAX];
+    int         wd, i;
+
+    PDLUA_DEBUG("pdlua_watchfile: stack top %d", lua_gettop(L));
+    if (!name || name - path >= MAXPDSTRING) return 0;
+    memcpy(dir, path, name - path);
+    dir[name - path] = '\0';
+    if (!realpath(dir[0] ? dir : "/", real)) return 0;
+    if (pdlua_inotify_fd < 0)
+    {
+        pdlua_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (pdlua_inotify_fd < 0)
+        {
+            pd_error(NULL, "lua: error: can't watch files: inotify_init1() failed");
+            return 0;
+        }
+        sys_addpollfn(pdlua_inotify_fd, pdlua_watch_poll, NULL);
+    }
+    wd = inotify_add_watch(pdlua_inotify_fd, real, IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (wd < 0)
+    {
+        pd_error(NULL, "lua: error: can't watch directory `%s'", real);
+        return 0;
+    }
+    /* inotify hands out the same descriptor for a directory watched twice */
+    for (i = 0; i < pdlua_nwatchdirs; i++)
+    {
+        if (pdlua_watchdirs[i].wd == wd) break;
+    }
+    if (i == pdlua_nwatchdirs)
+    {
+        pdlua_watchdirs = resizebytes(pdlua_watchdirs,
+            pdlua_nwatchdirs * sizeof(t_pdlua_watchdir),
+            (pdlua_nwatchdirs + 1) * sizeof(t_pdlua_watchdir));
+        pdlua_watchdirs[i].wd = wd;
+        pdlua_watchdirs[i].dir = gensym(real);
+        pdlua_nwatchdirs++;
+    }
+    lua_pushfstring(L, "%s%s", real, name);
+    PDLUA_DEBUG("pdlua_watchfile: end. stack top %d", lua_gettop(L));
+    return 1;
+#else
+    return 0;
+#endif // PDLUA_INOTIFY
+}
+
+/** Stop watching all script files. */
+static int pdlua_unwatchall(lua_State *L)
+/**< Lua interpreter state. */
+{
+#ifdef PDLUA_INOTIFY
+    PDLUA_DEBUG("pdlua_unwatchall: stack top %d", lua_gettop(L));
+    if (pdlua_inotify_fd >= 0)
+    {
+        sys_rmpollfn(pdlua_inotify_fd);
+        close(pdlua_inotify_fd); /* this removes all the watches too */
+        pdlua_inotify_fd = -1;
+    }
+    if (pdlua_watchdirs)
+    {
+        freebytes(pdlua_watchdirs, pdlua_nwatchdirs * sizeof(t_pdlua_watchdir));
+        pdlua_watchdirs = NULL;
+        pdlua_nwatchdirs = 0;
+    }
+    PDLUA_DEBUG("pdlua_unwatchall: end. stack top %d", lua_gettop(L));
+#endif // PDLUA_INOTIFY
+    return 0;
+}
+
 /** Initialize the pd API for Lua. */
 static void pdlua_init(lua_State *L)
 /**< Lua interpreter state. */
 {
+    pdlua_atoms_setup(L);
+    pdlua_textreader_setup(L);
+    pdlua_pointer_setup(L);
     lua_newtable(L);
     lua_setglobal(L, "pd");
     lua_getglobal(L, "pd");
@@ -1668,6 +7000,20 @@ static void pdlua_init(lua_State *L)
 #else
     lua_pushboolean(L, 0);
 #endif // _WIN32
+    lua_settable(L, -3);
+    /* memory layout of arrays, for the LuaJIT FFI bindings in pd.lua */
+    lua_pushstring(L, "_ffi");
+    lua_newtable(L);
+    lua_pushnumber(L, sizeof(t_float));
+    lua_setfield(L, -2, "floatsize");
+#ifdef PDLUA_PD41
+    lua_pushboolean(L, 1);
+#else
+    lua_pushboolean(L, 0);
+#endif // PDLUA_PD41
+    lua_setfield(L, -2, "words");
+    lua_pushlightuserdata(L, &pdlua_arraystamp);
+    lua_setfield(L, -2, "arraystamp");
     lua_settable(L, -3);
     lua_pushstring(L, "_register");
     lua_pushcfunction(L, pdlua_class_new);
@@ -1675,6 +7021,12 @@ static void pdlua_init(lua_State *L)
     lua_pushstring(L, "_create");
     lua_pushcfunction(L, pdlua_object_new);
     lua_settable(L, -3);
+    lua_pushstring(L, "_addmethod");
+    lua_pushcfunction(L, pdlua_method_add);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_clearmethods");
+    lua_pushcfunction(L, pdlua_method_clear);
+    lua_settable(L, -3);
     lua_pushstring(L, "_createinlets");
     lua_pushcfunction(L, pdlua_object_createinlets);
     lua_settable(L, -3);
@@ -1690,6 +7042,12 @@ static void pdlua_init(lua_State *L)
     lua_pushstring(L, "_outlet");
     lua_pushcfunction(L, pdlua_outlet);
     lua_settable(L, -3);
+    lua_pushstring(L, "_outletdrip");
+    lua_pushcfunction(L, pdlua_outlet_drip);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_outleteach");
+    lua_pushcfunction(L, pdlua_outlet_each);
+    lua_settable(L, -3);
     lua_pushstring(L, "_createreceive");
     lua_pushcfunction(L, pdlua_receive_new);
     lua_settable(L, -3);
@@ -1711,11 +7069,75 @@ static void pdlua_init(lua_State *L)
     lua_pushstring(L, "_clockdelay");
     lua_pushcfunction(L, pdlua_clock_delay);
     lua_settable(L, -3);
+    lua_pushstring(L, "_schedule");
+    lua_pushcfunction(L, pdlua_schedule);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_unschedule");
+    lua_pushcfunction(L, pdlua_unschedule);
+    lua_settable(L, -3);
+    lua_pushstring(L, "systime");
+    lua_pushcfunction(L, pdlua_systime);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_idlewake");
+    lua_pushcfunction(L, pdlua_idlewake);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_queuenew");
+    lua_pushcfunction(L, pdlua_queue_new);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_queuepush");
+    lua_pushcfunction(L, pdlua_queue_push);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_queueclear");
+    lua_pushcfunction(L, pdlua_queue_lclear);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_queuesize");
+    lua_pushcfunction(L, pdlua_queue_size);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_queuefree");
+    lua_pushcfunction(L, pdlua_queue_lfree);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_channelnew");
+    lua_pushcfunction(L, pdlua_channel_new);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_channelfree");
+    lua_pushcfunction(L, pdlua_channel_free);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_channellisten");
+    lua_pushcfunction(L, pdlua_channel_listen);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_channelsend");
+    lua_pushcfunction(L, pdlua_channel_send);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_realtime");
+    lua_pushcfunction(L, pdlua_realtime);
+    lua_settable(L, -3);
+    lua_pushstring(L, "timesince");
+    lua_pushcfunction(L, pdlua_timesince);
+    lua_settable(L, -3);
     lua_pushstring(L, "_dofile");
     lua_pushcfunction(L, pdlua_dofile);
     lua_settable(L, -3);
     lua_pushstring(L, "_dofilex");
     lua_pushcfunction(L, pdlua_dofilex);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_loadfilex");
+    lua_pushcfunction(L, pdlua_loadfilex);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_invalidateclass");
+    lua_pushcfunction(L, pdlua_invalidateclass);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_watchfile");
+    lua_pushcfunction(L, pdlua_watchfile);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_unwatchall");
+    lua_pushcfunction(L, pdlua_unwatchall);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_canwatch");
+#ifdef PDLUA_INOTIFY
+    lua_pushboolean(L, 1);
+#else
+    lua_pushboolean(L, 0);
+#endif // PDLUA_INOTIFY
     lua_settable(L, -3);
     lua_pushstring(L, "send");
     lua_pushcfunction(L, pdlua_send);
@@ -1726,6 +7148,18 @@ static void pdlua_init(lua_State *L)
     lua_pushstring(L, "setvalue");
     lua_pushcfunction(L, pdlua_setvalue);
     lua_settable(L, -3);
+    lua_pushstring(L, "_valuenew");
+    lua_pushcfunction(L, pdlua_value_new);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_valuefree");
+    lua_pushcfunction(L, pdlua_value_free);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_readvalue");
+    lua_pushcfunction(L, pdlua_readvalue);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_writevalue");
+    lua_pushcfunction(L, pdlua_writevalue);
+    lua_settable(L, -3);
     lua_pushstring(L, "_getarray");
     lua_pushcfunction(L, pdlua_getarray);
     lua_settable(L, -3);
@@ -1738,9 +7172,114 @@ static void pdlua_init(lua_State *L)
     lua_pushstring(L, "_redrawarray");
     lua_pushcfunction(L, pdlua_redrawarray);
     lua_settable(L, -3);
+    lua_pushstring(L, "_atomsnew");
+    lua_pushcfunction(L, pdlua_atoms_new);
+    lua_settable(L, -3);
+    lua_pushstring(L, "pack");
+    lua_pushcfunction(L, pdlua_pack);
+    lua_settable(L, -3);
+    lua_pushstring(L, "unpack");
+    lua_pushcfunction(L, pdlua_unpack);
+    lua_settable(L, -3);
+    lua_pushstring(L, "oscencode");
+    lua_pushcfunction(L, pdlua_oscencode);
+    lua_settable(L, -3);
+    lua_pushstring(L, "oscdecode");
+    lua_pushcfunction(L, pdlua_oscdecode);
+    lua_settable(L, -3);
+    lua_pushstring(L, "oscbundle");
+    lua_pushcfunction(L, pdlua_oscbundle);
+    lua_settable(L, -3);
+    lua_pushstring(L, "parse");
+    lua_pushcfunction(L, pdlua_parse);
+    lua_settable(L, -3);
+    lua_pushstring(L, "format");
+    lua_pushcfunction(L, pdlua_format);
+    lua_settable(L, -3);
+    lua_pushstring(L, "parsefile");
+    lua_pushcfunction(L, pdlua_parsefile);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_rawatoms");
+    lua_pushcfunction(L, pdlua_object_rawatoms);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_tablenew");
+    lua_pushcfunction(L, pdlua_table_new);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_tablelength");
+    lua_pushcfunction(L, pdlua_table_length);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_tableread");
+    lua_pushcfunction(L, pdlua_table_read);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_tablewrite");
+    lua_pushcfunction(L, pdlua_table_write);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_textnew");
+    lua_pushcfunction(L, pdlua_text_new);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_textlength");
+    lua_pushcfunction(L, pdlua_text_length);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_textread");
+    lua_pushcfunction(L, pdlua_text_read);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_textreplace");
+    lua_pushcfunction(L, pdlua_text_replace);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_pointernew");
+    lua_pushcfunction(L, pdlua_pointer_new);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_pointervalid");
+    lua_pushcfunction(L, pdlua_pointer_valid);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_pointertemplate");
+    lua_pushcfunction(L, pdlua_pointer_template);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_pointerget");
+    lua_pushcfunction(L, pdlua_pointer_get);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_pointerset");
+    lua_pushcfunction(L, pdlua_pointer_set);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_pointerredraw");
+    lua_pushcfunction(L, pdlua_pointer_redraw);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_pointernext");
+    lua_pushcfunction(L, pdlua_pointer_next);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_pointerelement");
+    lua_pushcfunction(L, pdlua_pointer_element);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_pointerelements");
+    lua_pushcfunction(L, pdlua_pointer_elements);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_pointersetelements");
+    lua_pushcfunction(L, pdlua_pointer_setelements);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_pointeratom");
+    lua_pushcfunction(L, pdlua_pointer_atom);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_redrawinterval");
+    lua_pushcfunction(L, pdlua_setredrawinterval);
+    lua_settable(L, -3);
     lua_pushstring(L, "post");
     lua_pushcfunction(L, pdlua_post);
     lua_settable(L, -3);
+    lua_pushstring(L, "_trace");
+    lua_pushcfunction(L, pdlua_trace_enable);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_tracewrite");
+    lua_pushcfunction(L, pdlua_trace_write);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_record");
+    lua_pushcfunction(L, pdlua_record);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_replay");
+    lua_pushcfunction(L, pdlua_replay);
+    lua_settable(L, -3);
+    lua_pushstring(L, "_logdump");
+    lua_pushcfunction(L, pdlua_logdump);
+    lua_settable(L, -3);
     lua_pushstring(L, "_error");
     lua_pushcfunction(L, pdlua_error);
     lua_settable(L, -3);
@@ -1759,6 +7298,7 @@ static int pdlua_loader_fromfd
     t_pdlua_readerdata  reader;
 
     PDLUA_DEBUG("pdlua_loader: stack top %d", lua_gettop(__L));
+    PDLUA_ARRAYS_MAYCHANGE();
     class_set_extern_dir(gensym(dirbuf));
     pdlua_setrequirepath(__L, dirbuf);
     reader.fd = fd;
@@ -1877,6 +7417,10 @@ static int pdlua_loader_pathwise
 #define xstr(s) str(s)
 #define str(s) #s
 
+#ifdef PDLUA_EMBEDDED
+#include "pdlua_runtime.h" // pd.lua as bytecode (or source), made by the Makefile
+#endif
+
 /** Start the Lua runtime and register our loader hook. */
 #ifdef _WIN32
 __declspec(dllexport)
@@ -1894,6 +7438,9 @@ void pdlua_setup(void)
     char                pdluaver[MAXPDSTRING];
     char                compiled[MAXPDSTRING];
     char                luaversionStr[MAXPDSTRING];
+#ifdef PDLUA_EMBEDDED
+    const char          *runtime;
+#endif
 #if LUA_VERSION_NUM	< 504
     const lua_Number    *luaversion = lua_version (NULL);
 #else
@@ -1920,7 +7467,11 @@ void pdlua_setup(void)
 
     lvm = (*luaversion)/100;
     lvl = (*luaversion) - (100*lvm);
+#ifdef LUAJIT_VERSION
+    snprintf(luaversionStr, MAXPDSTRING-1, "Using lua version %d.%d (%s)", lvm, lvl, LUAJIT_VERSION);
+#else
     snprintf(luaversionStr, MAXPDSTRING-1, "Using lua version %d.%d", lvm, lvl);
+#endif
 
 #if PLUGDATA
     snprintf(versbuf, versbuf_length-1,
@@ -1976,14 +7527,36 @@ void pdlua_setup(void)
 #else
     sprintf(pd_lua_path, "%s/pd.lua", pdlua_proxyinlet_class->c_externdir->s_name); /* the full path to pd.lua */
 #endif
-    PDLUA_DEBUG("pd_lua_path %s", pd_lua_path);
-    fd = open(pd_lua_path, O_RDONLY);
-/*    fd = canvas_open(canvas_getcurrent(), "pd", ".lua", buf, &ptr, MAXPDSTRING, 1);  looks all over and rarely succeeds */
-    PDLUA_DEBUG ("pd.lua loaded from %s", pd_lua_path);
-    PDLUA_DEBUG("pdlua canvas_open done fd = %d", fd);
     PDLUA_DEBUG("pdlua_setup: stack top %d", lua_gettop(__L));
-    if (fd >= 0)
-    { /* pd.lua was opened */
+    result = -1;
+#ifdef PDLUA_EMBEDDED
+    /* pd.lua is built into the binary, precompiled (see the Makefile); a
+       pd.lua file is only used instead if the PDLUA_RUNTIME environment
+       variable asks for it (with its path, or empty for the default one) */
+    if (!(runtime = getenv("PDLUA_RUNTIME")))
+    {
+        result = luaL_loadbuffer(__L, (const char *) pdlua_runtime, sizeof(pdlua_runtime), "pd.lua");
+        PDLUA_DEBUG ("pdlua luaL_loadbuffer returned %d", result);
+        if (0 != result)
+        {
+            pd_error(NULL, "lua: error loading built-in `pd.lua', trying the file:\n%s", lua_tostring(__L, -1));
+            lua_pop(__L, 1);
+        }
+    }
+    else if (*runtime) snprintf(pd_lua_path, MAXPDSTRING, "%s", runtime);
+#endif // PDLUA_EMBEDDED
+    if (0 != result)
+    {
+        PDLUA_DEBUG("pd_lua_path %s", pd_lua_path);
+        fd = open(pd_lua_path, O_RDONLY);
+/*        fd = canvas_open(canvas_getcurrent(), "pd", ".lua", buf, &ptr, MAXPDSTRING, 1);  looks all over and rarely succeeds */
+        PDLUA_DEBUG("pdlua canvas_open done fd = %d", fd);
+        if (fd < 0)
+        { /* pd.lua couldn't be opened */
+            pd_error(NULL, "lua: error loading `%s': can't open it", pd_lua_path);
+            pd_error(NULL, "lua: loader will not be registered!");
+            return;
+        }
         reader.fd = fd;
 #if LUA_VERSION_NUM	< 502
         result = lua_load(__L, pdlua_reader, &reader, "pd.lua");
@@ -1991,36 +7564,30 @@ void pdlua_setup(void)
         result = lua_load(__L, pdlua_reader, &reader, "pd.lua", NULL); // mode bt for binary or text
 #endif // LUA_VERSION_NUM	< 502
         PDLUA_DEBUG ("pdlua lua_load returned %d", result);
-        if (0 == result)
-        {
-            result = lua_pcall(__L, 0, 0, 0);
-            PDLUA_DEBUG ("pdlua lua_pcall returned %d", result);
-        }
-        if (0 != result)
-        //if (lua_load(__L, pdlua_reader, &reader, "pd.lua") || lua_pcall(__L, 0, 0, 0))
-        {
-            pd_error(NULL, "lua: error loading `pd.lua':\n%s", lua_tostring(__L, -1));
-            pd_error(NULL, "lua: loader will not be registered!");
-            pd_error(NULL, "lua: (is `pd.lua' in Pd's path list?)");
-            lua_pop(__L, 1);
-        }
-        else
-        {
-            int maj=0,min=0,bug=0;
-	    sys_getversion(&maj,&min,&bug);
-	    if((maj==0) && (min<47))
-	      /* before Pd<0.47, the loaders had to iterate over each path themselves */
-	      sys_register_loader((loader_t)pdlua_loader_legacy);
-	    else
-	      /* since Pd>=0.47, Pd tries the loaders for each path */
-	      sys_register_loader((loader_t)pdlua_loader_pathwise);
-        }
-	close(fd);
+        close(fd);
     }
-    else
+    if (0 == result)
+    {
+        result = lua_pcall(__L, 0, 0, 0);
+        PDLUA_DEBUG ("pdlua lua_pcall returned %d", result);
+    }
+    if (0 != result)
     {
-        pd_error(NULL, "lua: error loading `pd.lua': canvas_open() failed");
+        pd_error(NULL, "lua: error loading `pd.lua':\n%s", lua_tostring(__L, -1));
         pd_error(NULL, "lua: loader will not be registered!");
+        pd_error(NULL, "lua: (is `pd.lua' in Pd's path list?)");
+        lua_pop(__L, 1);
+    }
+    else
+    {
+        int maj=0,min=0,bug=0;
+        sys_getversion(&maj,&min,&bug);
+        if((maj==0) && (min<47))
+          /* before Pd<0.47, the loaders had to iterate over each path themselves */
+          sys_register_loader((loader_t)pdlua_loader_legacy);
+        else
+          /* since Pd>=0.47, Pd tries the loaders for each path */
+          sys_register_loader((loader_t)pdlua_loader_pathwise);
     }
     PDLUA_DEBUG("pdlua_setup: end. stack top %d", lua_gettop(__L));
 #ifndef PLUGDATA